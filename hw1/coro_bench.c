@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include "libcoro.h"
+
+/**
+ * Microbenchmark of the coroutine library: cost of a coroutine
+ * creation, of a short-lived coroutine's whole life (with stacks
+ * reused from the pool) and of a single context switch.
+ *
+ * The same source is built twice - 'coro_bench' uses the default
+ * (assembly on x86-64) context switch, 'coro_bench_portable' is
+ * compiled with CORO_PORTABLE_SWITCH and uses the old
+ * sigsetjmp/siglongjmp + sigaltstack implementation. Comparing
+ * their output gives the before/after numbers.
+ *
+ * Build with -DCMAKE_BUILD_TYPE=Release to get meaningful numbers.
+ *
+ * $> ./coro_bench [coroutines] [yields_per_coroutine]
+ */
+
+static int64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_yield_f(void *arg)
+{
+	long yields = *(long *)arg;
+	for (long i = 0; i < yields; ++i)
+		coro_yield();
+	return 0;
+}
+
+static int
+bench_empty_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int coro_count = argc > 1 ? atoi(argv[1]) : 2;
+	long yields = argc > 2 ? atol(argv[2]) : 1000000;
+	int create_count = 1000;
+	if (coro_count < 1 || yields < 1) {
+		printf("Usage: %s [coroutines] [yields_per_coroutine]\n",
+		       argv[0]);
+		return 1;
+	}
+	coro_sched_init();
+
+	int64_t start = bench_now_ns();
+	for (int i = 0; i < create_count; ++i)
+		coro_new(bench_empty_f, NULL);
+	int64_t create_ns = bench_now_ns() - start;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+
+	start = bench_now_ns();
+	for (int i = 0; i < create_count; ++i) {
+		coro_new(bench_empty_f, NULL);
+		coro_delete(coro_sched_wait());
+	}
+	int64_t churn_ns = bench_now_ns() - start;
+
+	for (int i = 0; i < coro_count; ++i)
+		coro_new(bench_yield_f, &yields);
+	long long switches = 0;
+	start = bench_now_ns();
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	int64_t switch_ns = bench_now_ns() - start;
+	switches += coro_switch_count(coro_this());
+
+#ifdef CORO_PORTABLE_SWITCH
+	const char *impl = "portable";
+#else
+	const char *impl = "default";
+#endif
+	printf("impl: %s\n", impl);
+	printf("create: %.1f ns/coro (%d coroutines)\n",
+	       (double)create_ns / create_count, create_count);
+	printf("churn: %.1f ns/coro (create, run, delete)\n",
+	       (double)churn_ns / create_count);
+	printf("switch: %.2f ns/switch (%lld switches, %d coroutines)\n",
+	       (double)switch_ns / switches, switches, coro_count);
+	return 0;
+}
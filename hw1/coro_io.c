@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include "coro_io.h"
+#include "libcoro.h"
+
+enum coro_io_op {
+	CORO_IO_OPEN,
+	CORO_IO_READ,
+	CORO_IO_PREAD,
+	CORO_IO_WRITE,
+	CORO_IO_PWRITE,
+	CORO_IO_WRITEV,
+};
+
+/**
+ * A syscall to be done by a helper thread. It lives on the stack
+ * of the coroutine, which is parked until the request is done.
+ */
+struct coro_io_req {
+	enum coro_io_op op;
+	int fd;
+	void *buf;
+	size_t count;
+	const struct iovec *iov;
+	off_t offset;
+	const char *path;
+	int flags;
+	mode_t mode;
+	/** Syscall result and its errno. */
+	ssize_t result;
+	int error;
+	/** Coroutine, waiting for the request. */
+	struct coro *coro;
+	/**
+	 * Set by the helper under coro_io_lock. The coroutine checks
+	 * it under the same lock, so it can't leave while the helper
+	 * still wakes it up.
+	 */
+	bool is_done;
+	/** Link in the request queue. */
+	struct coro_io_req *next;
+};
+
+/** Requests, not taken by the helpers yet. */
+static struct coro_io_req *coro_io_head = NULL;
+static struct coro_io_req *coro_io_tail = NULL;
+static pthread_t *coro_io_threads = NULL;
+static int coro_io_thread_count = 0;
+static bool coro_io_is_stopping = false;
+static pthread_mutex_t coro_io_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when a request is queued. */
+static pthread_cond_t coro_io_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+coro_io_exec(struct coro_io_req *req)
+{
+	switch (req->op) {
+	case CORO_IO_OPEN:
+		req->result = open(req->path, req->flags, req->mode);
+		break;
+	case CORO_IO_READ:
+		req->result = read(req->fd, req->buf, req->count);
+		break;
+	case CORO_IO_PREAD:
+		req->result = pread(req->fd, req->buf, req->count,
+				    req->offset);
+		break;
+	case CORO_IO_WRITE:
+		req->result = write(req->fd, req->buf, req->count);
+		break;
+	case CORO_IO_PWRITE:
+		req->result = pwrite(req->fd, req->buf, req->count,
+				     req->offset);
+		break;
+	case CORO_IO_WRITEV:
+		req->result = writev(req->fd, req->iov, req->count);
+		break;
+	}
+	req->error = req->result < 0 ? errno : 0;
+}
+
+static void *
+coro_io_worker_f(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&coro_io_lock);
+	while (true) {
+		while (coro_io_head == NULL && ! coro_io_is_stopping)
+			pthread_cond_wait(&coro_io_cond, &coro_io_lock);
+		struct coro_io_req *req = coro_io_head;
+		if (req == NULL)
+			break;
+		coro_io_head = req->next;
+		if (coro_io_head == NULL)
+			coro_io_tail = NULL;
+		pthread_mutex_unlock(&coro_io_lock);
+		coro_io_exec(req);
+		pthread_mutex_lock(&coro_io_lock);
+		req->is_done = true;
+		coro_wakeup(req->coro);
+	}
+	pthread_mutex_unlock(&coro_io_lock);
+	return NULL;
+}
+
+/** Start the helpers, if not yet. The lock must be held. */
+static void
+coro_io_start(int thread_count)
+{
+	if (coro_io_thread_count > 0)
+		return;
+	if (thread_count < 1)
+		thread_count = 1;
+	coro_io_is_stopping = false;
+	coro_io_threads = calloc(thread_count, sizeof(coro_io_threads[0]));
+	for (int i = 0; i < thread_count; ++i) {
+		errno = pthread_create(&coro_io_threads[i], NULL,
+				       coro_io_worker_f, NULL);
+		if (errno != 0) {
+			printf("Error %s\n", strerror(errno));
+			exit(-1);
+		}
+	}
+	coro_io_thread_count = thread_count;
+}
+
+void
+coro_io_init(int thread_count)
+{
+	pthread_mutex_lock(&coro_io_lock);
+	coro_io_start(thread_count);
+	pthread_mutex_unlock(&coro_io_lock);
+}
+
+void
+coro_io_shutdown(void)
+{
+	pthread_mutex_lock(&coro_io_lock);
+	coro_io_is_stopping = true;
+	pthread_cond_broadcast(&coro_io_cond);
+	int thread_count = coro_io_thread_count;
+	pthread_mutex_unlock(&coro_io_lock);
+	for (int i = 0; i < thread_count; ++i)
+		pthread_join(coro_io_threads[i], NULL);
+	free(coro_io_threads);
+	coro_io_threads = NULL;
+	coro_io_thread_count = 0;
+}
+
+/**
+ * Do the request. In a coroutine it is given to the helpers and
+ * the coroutine is parked until it is done.
+ */
+static ssize_t
+coro_io_submit(struct coro_io_req *req)
+{
+	if (! coro_can_park()) {
+		coro_io_exec(req);
+	} else {
+		req->coro = coro_this();
+		req->is_done = false;
+		req->next = NULL;
+		pthread_mutex_lock(&coro_io_lock);
+		coro_io_start(CORO_IO_THREADS_DEFAULT);
+		if (coro_io_tail == NULL)
+			coro_io_head = req;
+		else
+			coro_io_tail->next = req;
+		coro_io_tail = req;
+		pthread_cond_signal(&coro_io_cond);
+		while (! req->is_done) {
+			pthread_mutex_unlock(&coro_io_lock);
+			coro_park();
+			pthread_mutex_lock(&coro_io_lock);
+		}
+		pthread_mutex_unlock(&coro_io_lock);
+	}
+	if (req->result < 0)
+		errno = req->error;
+	return req->result;
+}
+
+int
+coro_open(const char *path, int flags, mode_t mode)
+{
+	struct coro_io_req req = {.op = CORO_IO_OPEN, .path = path,
+				  .flags = flags, .mode = mode};
+	return coro_io_submit(&req);
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t count)
+{
+	struct coro_io_req req = {.op = CORO_IO_READ, .fd = fd, .buf = buf,
+				  .count = count};
+	return coro_io_submit(&req);
+}
+
+ssize_t
+coro_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	struct coro_io_req req = {.op = CORO_IO_PREAD, .fd = fd, .buf = buf,
+				  .count = count, .offset = offset};
+	return coro_io_submit(&req);
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t count)
+{
+	struct coro_io_req req = {.op = CORO_IO_WRITE, .fd = fd,
+				  .buf = (void *)buf, .count = count};
+	return coro_io_submit(&req);
+}
+
+ssize_t
+coro_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	struct coro_io_req req = {.op = CORO_IO_PWRITE, .fd = fd,
+				  .buf = (void *)buf, .count = count,
+				  .offset = offset};
+	return coro_io_submit(&req);
+}
+
+ssize_t
+coro_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct coro_io_req req = {.op = CORO_IO_WRITEV, .fd = fd, .iov = iov,
+				  .count = iovcnt};
+	return coro_io_submit(&req);
+}
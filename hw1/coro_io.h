@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Blocking file I/O for coroutines. The syscalls are done by a
+ * pool of helper threads, while the calling coroutine is parked,
+ * so the other coroutines of its thread keep working. Outside of
+ * a coroutine the calls are done directly.
+ *
+ * The functions return what the syscalls do, with errno set on
+ * failure.
+ */
+
+enum {
+	CORO_IO_THREADS_DEFAULT = 4,
+};
+
+/**
+ * Start @a thread_count helper threads. Optional - the first
+ * request starts CORO_IO_THREADS_DEFAULT of them.
+ */
+void
+coro_io_init(int thread_count);
+
+/**
+ * Stop and join the helper threads. No requests should be in
+ * progress.
+ */
+void
+coro_io_shutdown(void);
+
+int
+coro_open(const char *path, int flags, mode_t mode);
+
+ssize_t
+coro_read(int fd, void *buf, size_t count);
+
+ssize_t
+coro_pread(int fd, void *buf, size_t count, off_t offset);
+
+ssize_t
+coro_write(int fd, const void *buf, size_t count);
+
+ssize_t
+coro_pwrite(int fd, const void *buf, size_t count, off_t offset);
+
+ssize_t
+coro_writev(int fd, const struct iovec *iov, int iovcnt);
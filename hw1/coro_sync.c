@@ -0,0 +1,423 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include "coro_sync.h"
+#include "libcoro.h"
+
+/**
+ * All the primitives are built the same way: the state is
+ * protected by a short thread lock, never held across a switch,
+ * and a waiting coroutine puts a waiter on its own stack into a
+ * wait list, then parks.
+ *
+ * The waker sets the flag and calls coro_wakeup() under the
+ * lock. The waiter checks the flag under the same lock, so it
+ * can't leave (and free the waiter, or even finish) while the
+ * waker still uses it. Spurious park returns just cause another
+ * check.
+ */
+
+/** A parked coroutine in a wait list. */
+struct coro_waiter {
+	struct coro *coro;
+	/** Set by the waker. */
+	bool is_woken;
+	struct coro_waiter *next;
+};
+
+/** FIFO of waiters. */
+struct coro_wait_list {
+	struct coro_waiter *head;
+	struct coro_waiter *tail;
+};
+
+static void
+coro_wait_list_push(struct coro_wait_list *l, struct coro_waiter *w)
+{
+	w->next = NULL;
+	if (l->tail == NULL)
+		l->head = w;
+	else
+		l->tail->next = w;
+	l->tail = w;
+}
+
+/** Wake up the first waiter. The lock must be held. */
+static bool
+coro_wait_list_wake_one(struct coro_wait_list *l)
+{
+	struct coro_waiter *w = l->head;
+	if (w == NULL)
+		return false;
+	l->head = w->next;
+	if (l->head == NULL)
+		l->tail = NULL;
+	w->is_woken = true;
+	coro_wakeup(w->coro);
+	return true;
+}
+
+/** Wake up all the waiters. The lock must be held. */
+static void
+coro_wait_list_wake_all(struct coro_wait_list *l)
+{
+	while (coro_wait_list_wake_one(l))
+		;
+}
+
+/** Remove a waiter, which has not been woken up. The lock must be held. */
+static void
+coro_wait_list_remove(struct coro_wait_list *l, struct coro_waiter *w)
+{
+	struct coro_waiter *prev = NULL;
+	struct coro_waiter *it = l->head;
+	while (it != w) {
+		prev = it;
+		it = it->next;
+	}
+	if (prev == NULL)
+		l->head = w->next;
+	else
+		prev->next = w->next;
+	if (l->tail == w)
+		l->tail = prev;
+}
+
+/**
+ * Park until the waiter is woken up, or until the deadline. The
+ * lock must be held, it is released for the wait and is held
+ * again on return.
+ * @retval true Woken up.
+ * @retval false Timed out, the waiter is removed from the list.
+ */
+static bool
+coro_waiter_park(struct coro_wait_list *l, struct coro_waiter *w,
+		 pthread_mutex_t *lock, uint64_t deadline_ns)
+{
+	while (! w->is_woken) {
+		if (deadline_ns != UINT64_MAX && coro_now_ns() >= deadline_ns) {
+			coro_wait_list_remove(l, w);
+			return false;
+		}
+		pthread_mutex_unlock(lock);
+		/* Without a deadline the coroutine needs no timer. */
+		if (deadline_ns == UINT64_MAX)
+			coro_park();
+		else
+			coro_park_until(deadline_ns);
+		pthread_mutex_lock(lock);
+	}
+	return true;
+}
+
+/**
+ * Wait in the list until woken up, or until the deadline. The
+ * lock must be held.
+ */
+static bool
+coro_wait_list_wait(struct coro_wait_list *l, pthread_mutex_t *lock,
+		    uint64_t deadline_ns)
+{
+	struct coro_waiter w;
+	w.coro = coro_this();
+	w.is_woken = false;
+	coro_wait_list_push(l, &w);
+	return coro_waiter_park(l, &w, lock, deadline_ns);
+}
+
+/** Channel. */
+
+struct coro_chan {
+	pthread_mutex_t lock;
+	/** Ring buffer of messages. */
+	void **buf;
+	size_t capacity;
+	/** Index of the oldest message. */
+	size_t head;
+	size_t count;
+	bool is_closed;
+	/** Senders, waiting for a free slot. */
+	struct coro_wait_list senders;
+	/** Receivers, waiting for a message. */
+	struct coro_wait_list receivers;
+};
+
+struct coro_chan *
+coro_chan_new(size_t capacity)
+{
+	if (capacity == 0)
+		capacity = 1;
+	struct coro_chan *ch = calloc(1, sizeof(*ch));
+	ch->buf = malloc(capacity * sizeof(ch->buf[0]));
+	ch->capacity = capacity;
+	pthread_mutex_init(&ch->lock, NULL);
+	return ch;
+}
+
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+	pthread_mutex_destroy(&ch->lock);
+	free(ch->buf);
+	free(ch);
+}
+
+int
+coro_chan_send_until(struct coro_chan *ch, void *msg, uint64_t deadline_ns)
+{
+	pthread_mutex_lock(&ch->lock);
+	while (ch->count == ch->capacity && ! ch->is_closed) {
+		if (! coro_wait_list_wait(&ch->senders, &ch->lock,
+					  deadline_ns)) {
+			pthread_mutex_unlock(&ch->lock);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	if (ch->is_closed) {
+		pthread_mutex_unlock(&ch->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	ch->buf[(ch->head + ch->count) % ch->capacity] = msg;
+	++ch->count;
+	coro_wait_list_wake_one(&ch->receivers);
+	pthread_mutex_unlock(&ch->lock);
+	return 0;
+}
+
+int
+coro_chan_send(struct coro_chan *ch, void *msg)
+{
+	return coro_chan_send_until(ch, msg, UINT64_MAX);
+}
+
+int
+coro_chan_recv_until(struct coro_chan *ch, void **msg, uint64_t deadline_ns)
+{
+	pthread_mutex_lock(&ch->lock);
+	while (ch->count == 0 && ! ch->is_closed) {
+		if (! coro_wait_list_wait(&ch->receivers, &ch->lock,
+					  deadline_ns)) {
+			pthread_mutex_unlock(&ch->lock);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	if (ch->count == 0) {
+		pthread_mutex_unlock(&ch->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	*msg = ch->buf[ch->head];
+	ch->head = (ch->head + 1) % ch->capacity;
+	--ch->count;
+	coro_wait_list_wake_one(&ch->senders);
+	pthread_mutex_unlock(&ch->lock);
+	return 0;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void **msg)
+{
+	return coro_chan_recv_until(ch, msg, UINT64_MAX);
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	pthread_mutex_lock(&ch->lock);
+	ch->is_closed = true;
+	coro_wait_list_wake_all(&ch->senders);
+	coro_wait_list_wake_all(&ch->receivers);
+	pthread_mutex_unlock(&ch->lock);
+}
+
+size_t
+coro_chan_count(struct coro_chan *ch)
+{
+	pthread_mutex_lock(&ch->lock);
+	size_t count = ch->count;
+	pthread_mutex_unlock(&ch->lock);
+	return count;
+}
+
+/** Wait group. */
+
+struct coro_wait_group {
+	pthread_mutex_t lock;
+	/** Jobs not done yet. */
+	int count;
+	struct coro_wait_list waiters;
+};
+
+struct coro_wait_group *
+coro_wait_group_new(void)
+{
+	struct coro_wait_group *wg = calloc(1, sizeof(*wg));
+	pthread_mutex_init(&wg->lock, NULL);
+	return wg;
+}
+
+void
+coro_wait_group_delete(struct coro_wait_group *wg)
+{
+	pthread_mutex_destroy(&wg->lock);
+	free(wg);
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *wg, int count)
+{
+	pthread_mutex_lock(&wg->lock);
+	wg->count += count;
+	if (wg->count <= 0)
+		coro_wait_list_wake_all(&wg->waiters);
+	pthread_mutex_unlock(&wg->lock);
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *wg)
+{
+	coro_wait_group_add(wg, -1);
+}
+
+bool
+coro_wait_group_wait_until(struct coro_wait_group *wg, uint64_t deadline_ns)
+{
+	pthread_mutex_lock(&wg->lock);
+	bool ok = true;
+	while (wg->count > 0 && ok)
+		ok = coro_wait_list_wait(&wg->waiters, &wg->lock, deadline_ns);
+	pthread_mutex_unlock(&wg->lock);
+	return ok;
+}
+
+void
+coro_wait_group_wait(struct coro_wait_group *wg)
+{
+	coro_wait_group_wait_until(wg, UINT64_MAX);
+}
+
+/** Mutex. */
+
+struct coro_mutex {
+	pthread_mutex_t lock;
+	bool is_locked;
+	struct coro_wait_list waiters;
+};
+
+struct coro_mutex *
+coro_mutex_new(void)
+{
+	struct coro_mutex *m = calloc(1, sizeof(*m));
+	pthread_mutex_init(&m->lock, NULL);
+	return m;
+}
+
+void
+coro_mutex_delete(struct coro_mutex *m)
+{
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	if (m->is_locked) {
+		/* The unlocker hands the mutex over, still locked. */
+		coro_wait_list_wait(&m->waiters, &m->lock, UINT64_MAX);
+	} else {
+		m->is_locked = true;
+	}
+	pthread_mutex_unlock(&m->lock);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	bool ok = ! m->is_locked;
+	m->is_locked = true;
+	pthread_mutex_unlock(&m->lock);
+	return ok;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+	if (! coro_wait_list_wake_one(&m->waiters))
+		m->is_locked = false;
+	pthread_mutex_unlock(&m->lock);
+}
+
+/** Condition variable. */
+
+struct coro_cond {
+	pthread_mutex_t lock;
+	struct coro_wait_list waiters;
+};
+
+struct coro_cond *
+coro_cond_new(void)
+{
+	struct coro_cond *c = calloc(1, sizeof(*c));
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+}
+
+void
+coro_cond_delete(struct coro_cond *c)
+{
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+bool
+coro_cond_wait_until(struct coro_cond *c, struct coro_mutex *m,
+		     uint64_t deadline_ns)
+{
+	pthread_mutex_lock(&c->lock);
+	/*
+	 * Get into the list before the mutex is released - a
+	 * signal sent right after the unlock is not lost.
+	 */
+	struct coro_waiter w;
+	w.coro = coro_this();
+	w.is_woken = false;
+	coro_wait_list_push(&c->waiters, &w);
+	pthread_mutex_unlock(&c->lock);
+	coro_mutex_unlock(m);
+
+	pthread_mutex_lock(&c->lock);
+	bool ok = coro_waiter_park(&c->waiters, &w, &c->lock, deadline_ns);
+	pthread_mutex_unlock(&c->lock);
+	coro_mutex_lock(m);
+	return ok;
+}
+
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m)
+{
+	coro_cond_wait_until(c, m, UINT64_MAX);
+}
+
+void
+coro_cond_signal(struct coro_cond *c)
+{
+	pthread_mutex_lock(&c->lock);
+	coro_wait_list_wake_one(&c->waiters);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *c)
+{
+	pthread_mutex_lock(&c->lock);
+	coro_wait_list_wake_all(&c->waiters);
+	pthread_mutex_unlock(&c->lock);
+}
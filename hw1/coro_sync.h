@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Synchronization primitives for coroutines. A coroutine which has
+ * to wait is parked - taken off the run queue until it is
+ * signalled, so waiting costs no CPU. All the primitives can be
+ * shared by coroutines of different threads of a coro_rt runtime.
+ *
+ * The waits work only inside coroutines - the main coroutine of a
+ * thread can't be parked. The _until() versions give up at a
+ * deadline - a coro_now_ns() time.
+ */
+
+struct coro_chan;
+struct coro_wait_group;
+struct coro_mutex;
+struct coro_cond;
+
+/** Bounded channel API. */
+
+/**
+ * Create a channel which buffers up to @a capacity messages.
+ * Capacity 0 is treated as 1.
+ */
+struct coro_chan *
+coro_chan_new(size_t capacity);
+
+/** Free the channel. Nobody should wait on it. */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Put a message into the channel. If it is full, wait until a
+ * receiver takes something.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed, errno is EPIPE.
+ */
+int
+coro_chan_send(struct coro_chan *ch, void *msg);
+
+/**
+ * Same as coro_chan_send(), but fails with errno ETIMEDOUT when
+ * the deadline has come.
+ */
+int
+coro_chan_send_until(struct coro_chan *ch, void *msg, uint64_t deadline_ns);
+
+/**
+ * Take a message from the channel. If it is empty, wait until a
+ * sender puts something.
+ * @param[out] msg The message.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed and empty, errno is EPIPE.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void **msg);
+
+/**
+ * Same as coro_chan_recv(), but fails with errno ETIMEDOUT when
+ * the deadline has come.
+ */
+int
+coro_chan_recv_until(struct coro_chan *ch, void **msg, uint64_t deadline_ns);
+
+/**
+ * Close the channel: senders fail from now on, receivers get the
+ * remaining messages, then fail. All the waiters are woken up.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
+
+/** Number of messages in the channel. */
+size_t
+coro_chan_count(struct coro_chan *ch);
+
+/** Wait group API. */
+
+struct coro_wait_group *
+coro_wait_group_new(void);
+
+void
+coro_wait_group_delete(struct coro_wait_group *wg);
+
+/** Add @a count to the number of awaited jobs. */
+void
+coro_wait_group_add(struct coro_wait_group *wg, int count);
+
+/** Mark one job done. The last one wakes up all the waiters. */
+void
+coro_wait_group_done(struct coro_wait_group *wg);
+
+/** Wait until all the jobs are done. */
+void
+coro_wait_group_wait(struct coro_wait_group *wg);
+
+/** Wait until all the jobs are done, false on timeout. */
+bool
+coro_wait_group_wait_until(struct coro_wait_group *wg, uint64_t deadline_ns);
+
+/** Mutex API. */
+
+struct coro_mutex *
+coro_mutex_new(void);
+
+void
+coro_mutex_delete(struct coro_mutex *m);
+
+/**
+ * Lock the mutex, waiting if it is locked. The waiters get it in
+ * the order they came.
+ */
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+/** Lock the mutex, if it is free. */
+bool
+coro_mutex_trylock(struct coro_mutex *m);
+
+/** Unlock the mutex, or hand it over to the first waiter. */
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+/** Condition variable API. */
+
+struct coro_cond *
+coro_cond_new(void);
+
+void
+coro_cond_delete(struct coro_cond *c);
+
+/**
+ * Unlock @a m, wait for a signal, lock @a m again. Like with
+ * pthread conditions, the awaited predicate should be checked in
+ * a loop.
+ */
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m);
+
+/**
+ * Same as coro_cond_wait(), false if the deadline has come
+ * without a signal. The mutex is locked again anyway.
+ */
+bool
+coro_cond_wait_until(struct coro_cond *c, struct coro_mutex *m,
+		     uint64_t deadline_ns);
+
+/** Wake up one waiter. */
+void
+coro_cond_signal(struct coro_cond *c);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *c);
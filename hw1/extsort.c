@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "extsort.h"
+#include "int_reader.h"
+#include "kmerge.h"
+#include "coro_io.h"
+#include "libcoro.h"
+
+enum {
+	/** A chunk is spilled, when it has less room left, in values. */
+	EXTSORT_CHUNK_ROOM_MIN = 1 << 10,
+};
+
+/** A run being merged. */
+struct extsort_reader {
+	const struct extsort_run *run;
+	/** Values read so far. */
+	size_t done;
+	int *buf;
+	size_t capacity;
+	/** errno of a failed read, 0 if none. */
+	int error;
+};
+
+void
+extsort_create(struct extsort *e, const char *dir, size_t memory,
+	       int workers)
+{
+	e->dir = strdup(dir);
+	e->memory = memory;
+	/*
+	 * A chunk and the buffer of its radix sort take two times the
+	 * chunk, and the text is read in pieces of up to 2 bytes per
+	 * value of the chunk.
+	 */
+	size_t share = memory / (workers > 0 ? workers : 1);
+	e->chunk_size = share / (2 * sizeof(int) + 2);
+	if (e->chunk_size < EXTSORT_CHUNK_MIN)
+		e->chunk_size = EXTSORT_CHUNK_MIN;
+	e->runs = NULL;
+	e->run_count = 0;
+	e->run_capacity = 0;
+	pthread_mutex_init(&e->lock, NULL);
+}
+
+void
+extsort_destroy(struct extsort *e)
+{
+	for (int i = 0; i < e->run_count; ++i)
+		close(e->runs[i].fd);
+	free(e->runs);
+	free(e->dir);
+	pthread_mutex_destroy(&e->lock);
+}
+
+/** Create a temporary file, which is removed, when closed. */
+static int
+extsort_tmpfile(struct extsort *e)
+{
+	size_t len = strlen(e->dir) + sizeof("/extsort.XXXXXX");
+	char *path = malloc(len);
+	snprintf(path, len, "%s/extsort.XXXXXX", e->dir);
+	int fd = mkstemp(path);
+	if (fd >= 0)
+		unlink(path);
+	free(path);
+	return fd;
+}
+
+static void
+extsort_add_run(struct extsort *e, int fd, size_t size)
+{
+	pthread_mutex_lock(&e->lock);
+	if (e->run_count == e->run_capacity) {
+		e->run_capacity = e->run_capacity * 2 + 8;
+		e->runs = realloc(e->runs,
+				  e->run_capacity * sizeof(e->runs[0]));
+	}
+	e->runs[e->run_count].fd = fd;
+	e->runs[e->run_count].size = size;
+	++e->run_count;
+	pthread_mutex_unlock(&e->lock);
+}
+
+/** Sort the chunk and write it into a new run. */
+static int
+extsort_spill(struct extsort *e, struct int_array *chunk,
+	      int_sort_yield_f yield, void *arg)
+{
+	int_sort_auto(chunk->data, chunk->size, yield, arg);
+	int fd = extsort_tmpfile(e);
+	if (fd < 0)
+		return -1;
+	/* The whole chunk goes in one write, no buffer is needed. */
+	struct int_writer w;
+	int_writer_create(&w, fd, INT_WRITER_BINARY, INT_WRITER_NUMBER_MAX);
+	int_writer_put_array(&w, chunk->data, chunk->size);
+	if (int_writer_destroy(&w) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	extsort_add_run(e, fd, chunk->size);
+	chunk->size = 0;
+	return 0;
+}
+
+int
+extsort_add_file(struct extsort *e, const char *path,
+		 int_sort_yield_f yield, void *arg)
+{
+	int fd = coro_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	size_t text_size = 2 * e->chunk_size;
+	if (text_size > INT_READER_CHUNK_SIZE)
+		text_size = INT_READER_CHUNK_SIZE;
+	char *text = malloc(text_size);
+	struct int_array chunk;
+	int_array_create(&chunk);
+	int_array_reserve(&chunk, e->chunk_size);
+	struct int_parser p;
+	int_parser_create(&p);
+	off_t offset = 0;
+	int rc = 0;
+	while (true) {
+		/*
+		 * A number takes at least 2 bytes with its separator,
+		 * so the piece can't overflow the chunk.
+		 */
+		size_t room = e->chunk_size - chunk.size;
+		size_t len = 2 * (room - 1);
+		if (len > text_size)
+			len = text_size;
+		ssize_t n = coro_pread(fd, text, len, offset);
+		if (n < 0) {
+			rc = -1;
+			break;
+		}
+		if (n == 0)
+			break;
+		int_parser_feed(&p, text, n, &chunk);
+		offset += n;
+		if (e->chunk_size - chunk.size < EXTSORT_CHUNK_ROOM_MIN &&
+		    extsort_spill(e, &chunk, yield, arg) != 0) {
+			rc = -1;
+			break;
+		}
+		coro_maybe_yield();
+	}
+	if (rc == 0) {
+		int_parser_finish(&p, &chunk);
+		if (chunk.size > 0)
+			rc = extsort_spill(e, &chunk, yield, arg);
+	}
+	int err = errno;
+	int_array_destroy(&chunk);
+	free(text);
+	close(fd);
+	errno = err;
+	return rc;
+}
+
+/** Read the whole piece, retrying short reads. */
+static int
+extsort_read(int fd, void *buf, size_t size, off_t offset)
+{
+	char *pos = buf;
+	while (size > 0) {
+		ssize_t rc = coro_pread(fd, pos, size, offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			if (rc == 0)
+				errno = EIO;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+		offset += rc;
+	}
+	return 0;
+}
+
+static void
+extsort_refill(struct kmerge_run *r)
+{
+	struct extsort_reader *reader = r->arg;
+	size_t left = reader->run->size - reader->done;
+	size_t count = left < reader->capacity ? left : reader->capacity;
+	r->cur = r->end = reader->buf;
+	if (count == 0 || reader->error != 0)
+		return;
+	if (extsort_read(reader->run->fd, reader->buf, count * sizeof(int),
+			 reader->done * sizeof(int)) != 0) {
+		reader->error = errno;
+		return;
+	}
+	reader->done += count;
+	left -= count;
+	/* Let the kernel read the next piece, while this one is merged. */
+	if (left > 0) {
+		size_t next = left < reader->capacity ? left : reader->capacity;
+		posix_fadvise(reader->run->fd, reader->done * sizeof(int),
+			      next * sizeof(int), POSIX_FADV_WILLNEED);
+	}
+	r->end = reader->buf + count;
+}
+
+/**
+ * Merge @a count runs into @a fd, reading them through buffers of
+ * @a buffer_size values in total.
+ */
+static int
+extsort_merge_runs(const struct extsort_run *runs, int count,
+		   size_t buffer_size, int fd, enum int_writer_format format,
+		   size_t output_buffer_size)
+{
+	struct extsort_reader *readers = calloc(count, sizeof(readers[0]));
+	struct kmerge_run *sources = calloc(count, sizeof(sources[0]));
+	for (int i = 0; i < count; ++i) {
+		readers[i].run = &runs[i];
+		readers[i].capacity = buffer_size / count;
+		readers[i].buf = malloc(readers[i].capacity * sizeof(int));
+		sources[i].refill = extsort_refill;
+		sources[i].arg = &readers[i];
+	}
+	struct kmerge m;
+	kmerge_create(&m, sources, count);
+	struct int_writer w;
+	int_writer_create(&w, fd, format, output_buffer_size);
+	const int *block;
+	size_t len;
+	while ((len = kmerge_next(&m, &block)) != 0)
+		int_writer_put_array(&w, block, len);
+	kmerge_destroy(&m);
+	int rc = int_writer_destroy(&w);
+	int err = errno;
+	for (int i = 0; i < count; ++i) {
+		if (readers[i].error != 0 && rc == 0) {
+			rc = -1;
+			err = readers[i].error;
+		}
+		free(readers[i].buf);
+	}
+	free(sources);
+	free(readers);
+	errno = err;
+	return rc;
+}
+
+int
+extsort_merge(struct extsort *e, int fd, enum int_writer_format format)
+{
+	size_t output_buffer_size = e->memory / 4;
+	if (output_buffer_size > INT_WRITER_BUFFER_SIZE_DEFAULT)
+		output_buffer_size = INT_WRITER_BUFFER_SIZE_DEFAULT;
+	size_t buffer_size = (e->memory - output_buffer_size) / sizeof(int);
+	int fan_in = buffer_size / EXTSORT_BUFFER_MIN;
+	if (fan_in < 2)
+		fan_in = 2;
+	if (buffer_size < (size_t)fan_in * EXTSORT_BUFFER_MIN)
+		buffer_size = (size_t)fan_in * EXTSORT_BUFFER_MIN;
+	/*
+	 * Too many runs to give each one a buffer - merge the first
+	 * ones into a bigger run, and put it to the end, until the
+	 * rest fit.
+	 */
+	while (e->run_count > fan_in) {
+		int out = extsort_tmpfile(e);
+		if (out < 0)
+			return -1;
+		if (extsort_merge_runs(e->runs, fan_in, buffer_size, out,
+				       INT_WRITER_BINARY,
+				       output_buffer_size) != 0) {
+			int err = errno;
+			close(out);
+			errno = err;
+			return -1;
+		}
+		size_t size = 0;
+		for (int i = 0; i < fan_in; ++i) {
+			size += e->runs[i].size;
+			close(e->runs[i].fd);
+		}
+		e->run_count -= fan_in;
+		memmove(e->runs, e->runs + fan_in,
+			e->run_count * sizeof(e->runs[0]));
+		extsort_add_run(e, out, size);
+	}
+	return extsort_merge_runs(e->runs, e->run_count, buffer_size, fd,
+				  format, output_buffer_size);
+}
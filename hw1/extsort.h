@@ -0,0 +1,76 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include "int_sort.h"
+#include "int_writer.h"
+
+/**
+ * External sort for inputs, which don't fit into memory. Files are
+ * parsed in chunks, each chunk is sorted and spilled into a
+ * temporary file as a binary run. Then the runs are merged by
+ * kmerge, each run is read through its own buffer. When there are
+ * too many runs for the memory, they are merged in several passes.
+ * The temporary files are unlinked right after creation, so they
+ * disappear with the process.
+ */
+
+enum {
+	/** Runs are not read in smaller pieces, in values. */
+	EXTSORT_BUFFER_MIN = 1 << 12,
+	/** Chunks are not made smaller, in values. */
+	EXTSORT_CHUNK_MIN = 1 << 14,
+};
+
+/** A sorted run in a temporary file. */
+struct extsort_run {
+	int fd;
+	/** Number of values. */
+	size_t size;
+};
+
+struct extsort {
+	/** Directory of the temporary files. */
+	char *dir;
+	/** Memory, which the sort may use, in bytes. */
+	size_t memory;
+	/** Number of values in a chunk. */
+	size_t chunk_size;
+	struct extsort_run *runs;
+	int run_count;
+	int run_capacity;
+	/** Files are added from several threads. */
+	pthread_mutex_t lock;
+};
+
+/**
+ * Start a sort within @a memory bytes. @a workers files can be
+ * added at the same time, each of them takes its share of the
+ * memory for a chunk.
+ */
+void
+extsort_create(struct extsort *e, const char *dir, size_t memory,
+	       int workers);
+
+/** Close the runs. */
+void
+extsort_destroy(struct extsort *e);
+
+/**
+ * Read the file chunk by chunk, sort the chunks and spill them as
+ * runs. Can be called from coroutines, @a yield is given to the
+ * sort of each chunk.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+extsort_add_file(struct extsort *e, const char *path,
+		 int_sort_yield_f yield, void *arg);
+
+/**
+ * Merge all the runs into @a fd.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+extsort_merge(struct extsort *e, int fd, enum int_writer_format format);
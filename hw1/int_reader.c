@@ -0,0 +1,361 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "int_reader.h"
+#include "coro_io.h"
+#include "libcoro.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void
+int_array_create(struct int_array *arr)
+{
+	arr->data = NULL;
+	arr->size = 0;
+	arr->capacity = 0;
+}
+
+void
+int_array_destroy(struct int_array *arr)
+{
+	free(arr->data);
+	int_array_create(arr);
+}
+
+void
+int_array_reserve(struct int_array *arr, size_t capacity)
+{
+	if (capacity <= arr->capacity)
+		return;
+	arr->data = realloc(arr->data, capacity * sizeof(arr->data[0]));
+	arr->capacity = capacity;
+}
+
+static inline bool
+int_reader_is_digit(char c)
+{
+	return (unsigned char)(c - '0') < 10;
+}
+
+/** Number of digits at the beginning of [pos, end). */
+static inline size_t
+int_reader_scan_digits(const char *pos, const char *end)
+{
+	const char *p = pos;
+#ifdef __SSE2__
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+	while (end - p >= 16) {
+		__m128i t = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)p),
+					 zero);
+		/* Digits are the bytes, which are <= 9 after the subtraction. */
+		unsigned mask = _mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_min_epu8(t, nine), t));
+		if (mask != 0xffff)
+			return p - pos + __builtin_ctz(~mask);
+		p += 16;
+	}
+#endif
+	while (p < end && int_reader_is_digit(*p))
+		++p;
+	return p - pos;
+}
+
+/** Skip the separators - find the first digit or minus. */
+static inline const char *
+int_reader_skip(const char *pos, const char *end)
+{
+	/* Usually there is a single separator. */
+	for (int i = 0; i < 2 && pos < end; ++i, ++pos) {
+		if (int_reader_is_digit(*pos) || *pos == '-')
+			return pos;
+	}
+#ifdef __SSE2__
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i minus = _mm_set1_epi8('-');
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i t = _mm_sub_epi8(v, zero);
+		__m128i hit = _mm_or_si128(
+			_mm_cmpeq_epi8(_mm_min_epu8(t, nine), t),
+			_mm_cmpeq_epi8(v, minus));
+		unsigned mask = _mm_movemask_epi8(hit);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+	while (pos < end && ! int_reader_is_digit(*pos) && *pos != '-')
+		++pos;
+	return pos;
+}
+
+/** Append @a n digits to the value. */
+static inline uint64_t
+int_reader_parse_digits(uint64_t value, const char *pos, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		value = value * 10 + (pos[i] - '0');
+	return value;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define INT_READER_SWAR 1
+#else
+#define INT_READER_SWAR 0
+#endif
+
+#if INT_READER_SWAR
+/**
+ * Value of 1 <= n <= 8 digits, 8 bytes at @a pos are readable.
+ * The digits are converted in one 64-bit word, with no branches:
+ * pairs of digits, then quads, then the whole 8.
+ */
+static inline uint64_t
+int_reader_parse_8(const char *pos, size_t n)
+{
+	uint64_t v;
+	memcpy(&v, pos, sizeof(v));
+	/* The digits are the low bytes, shift out the rest. */
+	v = (v - 0x3030303030303030ULL) << (8 * (8 - n));
+	v = ((v & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+	v = ((v & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+	return ((v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
+#endif
+
+/** Value of @a n digits, which are followed by @a tail readable bytes. */
+static inline uint64_t
+int_reader_parse_number(const char *pos, size_t n, size_t tail)
+{
+#if INT_READER_SWAR
+	if (n > 8 && n <= 16) {
+		return int_reader_parse_8(pos, n - 8) * 100000000 +
+		       int_reader_parse_8(pos + n - 8, 8);
+	}
+	if (n > 0 && n + tail >= 8)
+		return int_reader_parse_8(pos, n);
+#else
+	(void)tail;
+#endif
+	return int_reader_parse_digits(0, pos, n);
+}
+
+static inline int
+int_reader_value(uint64_t value, bool is_negative)
+{
+	return (int)(int64_t)(is_negative ? 0 - value : value);
+}
+
+void
+int_parser_create(struct int_parser *p)
+{
+	p->in_number = false;
+	p->is_negative = false;
+	p->has_digits = false;
+	p->value = 0;
+}
+
+size_t
+int_parser_feed_max(struct int_parser *p, const char *buf, size_t len,
+		    struct int_array *arr, size_t max_size)
+{
+	const char *pos = buf;
+	const char *end = buf + len;
+	if (arr->size >= max_size)
+		return 0;
+	if (p->in_number) {
+		/* Continue the number, cut by the previous chunk. */
+		size_t n = int_reader_scan_digits(pos, end);
+		p->value = int_reader_parse_digits(p->value, pos, n);
+		p->has_digits = p->has_digits || n > 0;
+		pos += n;
+		if (pos == end)
+			return len;
+		int_parser_finish(p, arr);
+		if (arr->size >= max_size)
+			return pos - buf;
+	}
+	while (true) {
+		pos = int_reader_skip(pos, end);
+		if (pos == end)
+			return len;
+		bool is_negative = *pos == '-';
+		pos += is_negative;
+		size_t n = int_reader_scan_digits(pos, end);
+		uint64_t value = int_reader_parse_number(pos, n, end - pos - n);
+		pos += n;
+		if (pos == end) {
+			p->in_number = true;
+			p->is_negative = is_negative;
+			p->has_digits = n > 0;
+			p->value = value;
+			return len;
+		}
+		/* A lone minus is just a separator. */
+		if (n == 0)
+			continue;
+		int_array_push(arr, int_reader_value(value, is_negative));
+		if (arr->size >= max_size)
+			return pos - buf;
+	}
+}
+
+void
+int_parser_feed(struct int_parser *p, const char *buf, size_t len,
+		struct int_array *arr)
+{
+	int_parser_feed_max(p, buf, len, arr, SIZE_MAX);
+}
+
+void
+int_parser_finish(struct int_parser *p, struct int_array *arr)
+{
+	if (p->in_number && p->has_digits)
+		int_array_push(arr, int_reader_value(p->value, p->is_negative));
+	int_parser_create(p);
+}
+
+/**
+ * Move the offset past the digits of a number, which it cuts. Then
+ * the ranges of a file, split at any offsets, have each number in
+ * exactly one of them - in the one, where the number starts.
+ */
+static int
+int_reader_align(int fd, off_t *offset)
+{
+	if (*offset == 0)
+		return 0;
+	char buf[64];
+	off_t pos = *offset - 1;
+	/* The first byte is the one before the offset. */
+	size_t start = 1;
+	while (true) {
+		ssize_t n = coro_pread(fd, buf, sizeof(buf), pos);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		if (start == 1 && ! int_reader_is_digit(buf[0]) &&
+		    buf[0] != '-')
+			return 0;
+		size_t i = start + int_reader_scan_digits(buf + start,
+							   buf + n);
+		if (i < (size_t)n) {
+			pos += i;
+			break;
+		}
+		pos += n;
+		start = 0;
+	}
+	*offset = pos;
+	return 0;
+}
+
+int
+int_array_load(struct int_array *arr, const char *path)
+{
+	return int_array_load_range(arr, path, 0, -1);
+}
+
+/** Parse [from, to) of the file. */
+static int
+int_reader_parse_range(struct int_array *arr, int fd, off_t from, off_t to)
+{
+	int_array_reserve(arr, arr->size + (to - from) / 8 + 16);
+	char *buf = malloc(INT_READER_CHUNK_SIZE);
+	struct int_parser p;
+	int_parser_create(&p);
+	int rc = 0;
+	for (off_t offset = from; offset < to;) {
+		size_t len = INT_READER_CHUNK_SIZE;
+		if ((off_t)len > to - offset)
+			len = to - offset;
+		ssize_t n = coro_pread(fd, buf, len, offset);
+		if (n < 0) {
+			rc = -1;
+			break;
+		}
+		if (n == 0)
+			break;
+		int_parser_feed(&p, buf, n, arr);
+		offset += n;
+		coro_maybe_yield();
+	}
+	int_parser_finish(&p, arr);
+	int err = errno;
+	free(buf);
+	errno = err;
+	return rc;
+}
+
+int
+int_array_load_range(struct int_array *arr, const char *path, off_t from,
+		     off_t to)
+{
+	int fd = coro_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	int rc = -1;
+	struct stat st;
+	if (fstat(fd, &st) == 0) {
+		if (to < 0 || to > st.st_size)
+			to = st.st_size;
+		if (int_reader_align(fd, &from) == 0 &&
+		    (to == st.st_size || int_reader_align(fd, &to) == 0))
+			rc = from < to ?
+			     int_reader_parse_range(arr, fd, from, to) : 0;
+	}
+	int err = errno;
+	close(fd);
+	errno = err;
+	return rc;
+}
+
+int
+int_array_load_mmap(struct int_array *arr, const char *path)
+{
+	int fd = coro_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	size_t size = st.st_size;
+	if (size == 0) {
+		close(fd);
+		return 0;
+	}
+	const char *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	close(fd);
+	if (text == MAP_FAILED) {
+		errno = err;
+		return -1;
+	}
+	madvise((void *)text, size, MADV_SEQUENTIAL);
+	int_array_reserve(arr, arr->size + size / 8 + 16);
+	struct int_parser p;
+	int_parser_create(&p);
+	for (size_t offset = 0; offset < size; offset += INT_READER_CHUNK_SIZE) {
+		size_t len = size - offset;
+		if (len > INT_READER_CHUNK_SIZE)
+			len = INT_READER_CHUNK_SIZE;
+		int_parser_feed(&p, text + offset, len, arr);
+		coro_maybe_yield();
+	}
+	int_parser_finish(&p, arr);
+	munmap((void *)text, size);
+	return 0;
+}
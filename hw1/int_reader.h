@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Loader of text files with integers, separated by whitespace.
+ * The text is parsed in a single pass, chunk by chunk, so the
+ * whole file is never kept in memory. On x86-64 the digits and
+ * separators are found by SSE2 16 bytes at a time.
+ */
+
+/** Growable array of integers. */
+struct int_array {
+	int *data;
+	size_t size;
+	size_t capacity;
+};
+
+void
+int_array_create(struct int_array *arr);
+
+/** Free the data. */
+void
+int_array_destroy(struct int_array *arr);
+
+/** Make room for at least @a capacity integers. */
+void
+int_array_reserve(struct int_array *arr, size_t capacity);
+
+static inline void
+int_array_push(struct int_array *arr, int value)
+{
+	if (arr->size == arr->capacity)
+		int_array_reserve(arr, arr->capacity * 2 + 16);
+	arr->data[arr->size++] = value;
+}
+
+/**
+ * Parser state between chunks - a number can be cut by a chunk
+ * border.
+ */
+struct int_parser {
+	/** True, if a number is started and not finished yet. */
+	bool in_number;
+	bool is_negative;
+	bool has_digits;
+	int64_t value;
+};
+
+void
+int_parser_create(struct int_parser *p);
+
+/** Parse the next piece of text, append its numbers to @a arr. */
+void
+int_parser_feed(struct int_parser *p, const char *buf, size_t len,
+		struct int_array *arr);
+
+/**
+ * Same as int_parser_feed(), but stop, when @a arr has @a max_size
+ * values. The rest of the text should be fed next.
+ * @retval Number of bytes of @a buf, which are parsed.
+ */
+size_t
+int_parser_feed_max(struct int_parser *p, const char *buf, size_t len,
+		    struct int_array *arr, size_t max_size);
+
+/** Finish the text - a number at its very end is appended. */
+void
+int_parser_finish(struct int_parser *p, struct int_array *arr);
+
+enum {
+	/** Size of the pieces in which files are read and parsed. */
+	INT_READER_CHUNK_SIZE = 1 << 20,
+};
+
+/**
+ * Load all the integers of a file. It is read in chunks with
+ * coro_pread(), so in a coroutine the reads don't block the
+ * thread, and the coroutine yields between the chunks if its
+ * quantum has expired.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+int_array_load(struct int_array *arr, const char *path);
+
+/**
+ * Load the integers of a byte range [@a from, @a to) of a file, @a to
+ * -1 means the end of the file. A number belongs to the range, where
+ * it starts, so the ranges of one split file together give all of
+ * its numbers, each one once.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+int_array_load_range(struct int_array *arr, const char *path, off_t from,
+		     off_t to);
+
+/**
+ * Same as int_array_load(), but the file is mmap'ed. Faster for
+ * cached files, but page faults block the thread.
+ */
+int
+int_array_load_mmap(struct int_array *arr, const char *path);
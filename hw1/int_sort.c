@@ -0,0 +1,535 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "int_sort.h"
+
+/* INT_SORT_NO_AVX2 builds only the portable path, e.g. to test it. */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && \
+	!defined(INT_SORT_NO_AVX2)
+#include <immintrin.h>
+#define INT_SORT_HAVE_AVX2 1
+#define INT_SORT_AVX2 __attribute__((target("avx2")))
+#endif
+
+/** State of one sort. */
+struct int_sort {
+	int_sort_yield_f yield;
+	void *arg;
+	/** Steps left till the next yield hook call. */
+	size_t budget;
+	/** Ranges up to that size are sorted without partitioning. */
+	size_t small_max;
+	/** Whether the CPU has AVX2 for the sorting networks. */
+	bool has_avx2;
+};
+
+/** A range, which is not sorted yet. */
+struct int_sort_range {
+	int *begin;
+	int *end;
+	/** How many more bad partitions it may take before heapsort. */
+	int bad_allowed;
+};
+
+/** Call the hook and start counting the steps anew. */
+static void
+int_sort_yield(struct int_sort *s)
+{
+	s->budget = INT_SORT_YIELD_STEP;
+	if (s->yield != NULL)
+		s->yield(s->arg);
+}
+
+/** Account @a steps of work, call the hook once there are enough. */
+static inline void
+int_sort_step(struct int_sort *s, size_t steps)
+{
+	if (s->budget > steps)
+		s->budget -= steps;
+	else
+		int_sort_yield(s);
+}
+
+static inline void
+int_sort_swap(int *a, int *b)
+{
+	int tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+/** Put the three values in order. */
+static inline void
+int_sort3(int *a, int *b, int *c)
+{
+	if (*b < *a)
+		int_sort_swap(a, b);
+	if (*c < *b) {
+		int_sort_swap(b, c);
+		if (*b < *a)
+			int_sort_swap(a, b);
+	}
+}
+
+static void
+int_sort_insertion(struct int_sort *s, int *begin, int *end)
+{
+	for (int *cur = begin + 1; cur < end; ++cur) {
+		int value = *cur;
+		int *pos = cur;
+		for (; pos > begin && value < pos[-1]; --pos)
+			*pos = pos[-1];
+		*pos = value;
+	}
+	int_sort_step(s, end - begin);
+}
+
+#ifdef INT_SORT_HAVE_AVX2
+
+/** Compare-exchange the lanes with @a p, the lanes of @a mask take the max. */
+#define INT_SORT_AVX2_STEP(v, p, mask)						\
+	_mm256_blend_epi32(_mm256_min_epi32(v, p), _mm256_max_epi32(v, p), mask)
+
+/** Sort a bitonic vector. */
+static inline INT_SORT_AVX2 __m256i
+int_sort_avx2_clean8(__m256i v)
+{
+	__m256i p = _mm256_permute2x128_si256(v, v, 1);
+	v = INT_SORT_AVX2_STEP(v, p, 0xF0);
+	p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+	v = INT_SORT_AVX2_STEP(v, p, 0xCC);
+	p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+	return INT_SORT_AVX2_STEP(v, p, 0xAA);
+}
+
+/**
+ * Bitonic sort of a vector: pairs, then fours in alternating order,
+ * which makes the vector bitonic.
+ */
+static inline INT_SORT_AVX2 __m256i
+int_sort_avx2_sort8(__m256i v)
+{
+	__m256i p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+	v = INT_SORT_AVX2_STEP(v, p, 0x66);
+	p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+	v = INT_SORT_AVX2_STEP(v, p, 0x3C);
+	p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+	v = INT_SORT_AVX2_STEP(v, p, 0x5A);
+	return int_sort_avx2_clean8(v);
+}
+
+/** Sort a bitonic sequence of @a count vectors. */
+static inline INT_SORT_AVX2 void
+int_sort_avx2_clean(__m256i *v, int count)
+{
+	for (int d = count / 2; d > 0; d /= 2) {
+		for (int i = 0; i < count; ++i) {
+			if ((i & d) != 0)
+				continue;
+			__m256i lo = _mm256_min_epi32(v[i], v[i + d]);
+			v[i + d] = _mm256_max_epi32(v[i], v[i + d]);
+			v[i] = lo;
+		}
+	}
+	for (int i = 0; i < count; ++i)
+		v[i] = int_sort_avx2_clean8(v[i]);
+}
+
+/**
+ * Merge two sorted blocks of @a count / 2 vectors each: the first
+ * one and the reversed second one make a bitonic sequence, its
+ * halves are cleaned separately.
+ */
+static inline INT_SORT_AVX2 void
+int_sort_avx2_merge(__m256i *v, int count)
+{
+	const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i hi[4];
+	int half = count / 2;
+	for (int i = 0; i < half; ++i) {
+		__m256i b = _mm256_permutevar8x32_epi32(v[count - 1 - i],
+							reverse);
+		hi[i] = _mm256_max_epi32(v[i], b);
+		v[i] = _mm256_min_epi32(v[i], b);
+	}
+	for (int i = 0; i < half; ++i)
+		v[half + i] = hi[i];
+	int_sort_avx2_clean(v, half);
+	int_sort_avx2_clean(v + half, half);
+}
+
+/**
+ * Sort up to INT_SORT_NETWORK_MAX values in 1, 2, 4 or 8 vectors.
+ * The tail is padded with INT_MAX, which stays behind the values.
+ */
+static INT_SORT_AVX2 void
+int_sort_network_avx2(int *begin, int *end)
+{
+	size_t size = end - begin;
+	int count = size <= 8 ? 1 : size <= 16 ? 2 : size <= 32 ? 4 : 8;
+	int buf[INT_SORT_NETWORK_MAX];
+	memcpy(buf, begin, size * sizeof(buf[0]));
+	for (size_t i = size; i < (size_t)count * 8; ++i)
+		buf[i] = INT_MAX;
+	__m256i v[8];
+	for (int i = 0; i < count; ++i) {
+		v[i] = _mm256_loadu_si256((const __m256i *)&buf[i * 8]);
+		v[i] = int_sort_avx2_sort8(v[i]);
+	}
+	for (int width = 2; width <= count; width *= 2) {
+		for (int i = 0; i < count; i += width)
+			int_sort_avx2_merge(v + i, width);
+	}
+	for (int i = 0; i < count; ++i)
+		_mm256_storeu_si256((__m256i *)&buf[i * 8], v[i]);
+	memcpy(begin, buf, size * sizeof(buf[0]));
+}
+
+#endif /* INT_SORT_HAVE_AVX2 */
+
+/** Sort a range, which is too small to partition. */
+static inline void
+int_sort_small(struct int_sort *s, int *begin, int *end)
+{
+#ifdef INT_SORT_HAVE_AVX2
+	if (s->has_avx2) {
+		int_sort_network_avx2(begin, end);
+		int_sort_step(s, end - begin);
+		return;
+	}
+#endif
+	int_sort_insertion(s, begin, end);
+}
+
+/**
+ * Insertion sort, which gives up after a few moves. Finishes the
+ * ranges, which were sorted or almost sorted.
+ * @retval true The range is sorted.
+ */
+static bool
+int_sort_insertion_partial(struct int_sort *s, int *begin, int *end)
+{
+	size_t moves = 0;
+	for (int *cur = begin + 1; cur < end; ++cur) {
+		int value = *cur;
+		int *pos = cur;
+		for (; pos > begin && value < pos[-1]; --pos)
+			*pos = pos[-1];
+		*pos = value;
+		moves += cur - pos;
+		if (moves > 8)
+			return false;
+	}
+	int_sort_step(s, end - begin);
+	return true;
+}
+
+static void
+int_sort_sift_down(int *heap, size_t size, size_t i)
+{
+	int value = heap[i];
+	for (size_t child = 2 * i + 1; child < size; child = 2 * i + 1) {
+		if (child + 1 < size && heap[child] < heap[child + 1])
+			++child;
+		if (heap[child] <= value)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = value;
+}
+
+/** Guaranteed O(N log N) for the ranges, which defeat the pivots. */
+static void
+int_sort_heap(struct int_sort *s, int *begin, int *end)
+{
+	size_t size = end - begin;
+	for (size_t i = size / 2; i-- > 0;) {
+		int_sort_sift_down(begin, size, i);
+		int_sort_step(s, 1);
+	}
+	while (size > 1) {
+		int_sort_swap(&begin[0], &begin[--size]);
+		int_sort_sift_down(begin, size, 0);
+		int_sort_step(s, 1);
+	}
+}
+
+/** Take the pivot and put it to the range start. */
+static void
+int_sort_choose_pivot(int *begin, int *end)
+{
+	size_t size = end - begin;
+	int *mid = begin + size / 2;
+	int_sort3(begin, mid, end - 1);
+	if (size >= INT_SORT_NINTHER_MIN) {
+		int_sort3(begin + 1, mid - 1, end - 2);
+		int_sort3(begin + 2, mid + 1, end - 3);
+		int_sort3(mid - 1, mid, mid + 1);
+	}
+	int_sort_swap(begin, mid);
+}
+
+/** Swap two blocks of @a count values. */
+static inline void
+int_sort_swap_block(int *a, int *b, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		int_sort_swap(&a[i], &b[i]);
+}
+
+/**
+ * Three-way partition of Bentley and McIlroy around the value in
+ * the range start. The values equal to the pivot are gathered at
+ * both ends while scanning, then moved into the middle.
+ * @param[out] lt_end End of the values less than the pivot.
+ * @param[out] gt_begin Start of the values greater than the pivot.
+ * @return Number of swaps, 0 if the range was partitioned already.
+ */
+static size_t
+int_sort_partition(struct int_sort *s, int *begin, int *end, int **lt_end,
+		   int **gt_begin)
+{
+	int *a = begin;
+	const int pivot = a[0];
+	size_t n = end - begin;
+	/* a[0, p] == pivot, a[q, n) == pivot. */
+	size_t i = 0, j = n, p = 0, q = n;
+	size_t swaps = 0;
+	size_t budget = s->budget;
+	for (;;) {
+		while (a[++i] < pivot) {
+			if (i == n - 1)
+				break;
+			if (--budget == 0) {
+				int_sort_yield(s);
+				budget = s->budget;
+			}
+		}
+		while (pivot < a[--j]) {
+			if (--budget == 0) {
+				int_sort_yield(s);
+				budget = s->budget;
+			}
+		}
+		if (i >= j)
+			break;
+		int_sort_swap(&a[i], &a[j]);
+		++swaps;
+		if (a[i] == pivot)
+			int_sort_swap(&a[++p], &a[i]);
+		if (a[j] == pivot)
+			int_sort_swap(&a[--q], &a[j]);
+	}
+	s->budget = budget;
+	size_t lt, gt;
+	if (i > j) {
+		lt = gt = i;
+	} else if (a[i] < pivot) {
+		lt = gt = i + 1;
+	} else {
+		/* a[i] == pivot, it is in the middle already. */
+		lt = i;
+		gt = i + 1;
+	}
+	size_t left_eq = p + 1, right_eq = n - q;
+	size_t less = lt - left_eq, greater = q - gt;
+	size_t count = left_eq < less ? left_eq : less;
+	int_sort_swap_block(a, a + lt - count, count);
+	count = right_eq < greater ? right_eq : greater;
+	int_sort_swap_block(a + gt, a + n - count, count);
+	*lt_end = a + less;
+	*gt_begin = a + n - greater;
+	int_sort_step(s, n - greater - less);
+	return swaps;
+}
+
+/**
+ * Swap some values of a badly partitioned range, so that the next
+ * pivot does not hit the same pattern.
+ */
+static void
+int_sort_break_patterns(int *begin, int *end)
+{
+	size_t size = end - begin;
+	if (size < INT_SORT_INSERTION_MAX)
+		return;
+	size_t quarter = size / 4;
+	int_sort_swap(&begin[0], &begin[quarter]);
+	int_sort_swap(&end[-1], &end[-(ptrdiff_t)quarter]);
+	if (size >= INT_SORT_NINTHER_MIN) {
+		int_sort_swap(&begin[1], &begin[quarter + 1]);
+		int_sort_swap(&begin[2], &begin[quarter + 2]);
+		int_sort_swap(&end[-2], &end[-(ptrdiff_t)quarter - 1]);
+		int_sort_swap(&end[-3], &end[-(ptrdiff_t)quarter - 2]);
+	}
+}
+
+void
+int_sort(int *data, size_t size, int_sort_yield_f yield, void *arg)
+{
+	struct int_sort s = {
+		.yield = yield,
+		.arg = arg,
+		.budget = INT_SORT_YIELD_STEP,
+		.small_max = INT_SORT_INSERTION_MAX,
+		.has_avx2 = false,
+	};
+#ifdef INT_SORT_HAVE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		s.has_avx2 = true;
+		s.small_max = INT_SORT_NETWORK_MAX;
+	}
+#endif
+	/*
+	 * The bigger part of each partition is put aside and the
+	 * smaller one is sorted first, so every range in the stack is
+	 * at most half of the one below it.
+	 */
+	struct int_sort_range stack[sizeof(size_t) * 8];
+	int top = 0;
+	int bad_allowed = 0;
+	for (size_t n = size; n > 1; n /= 2)
+		++bad_allowed;
+	struct int_sort_range cur = {data, data + size, bad_allowed};
+	for (;;) {
+		size_t n = cur.end - cur.begin;
+		if (n <= s.small_max) {
+			if (n > 1)
+				int_sort_small(&s, cur.begin, cur.end);
+			if (top == 0)
+				break;
+			cur = stack[--top];
+			continue;
+		}
+		int_sort_choose_pivot(cur.begin, cur.end);
+		int *lt_end, *gt_begin;
+		size_t swaps = int_sort_partition(&s, cur.begin, cur.end,
+						  &lt_end, &gt_begin);
+		struct int_sort_range left = {cur.begin, lt_end, cur.bad_allowed};
+		struct int_sort_range right = {gt_begin, cur.end, cur.bad_allowed};
+		size_t left_size = left.end - left.begin;
+		size_t right_size = right.end - right.begin;
+		if (left_size > n - n / 8 || right_size > n - n / 8) {
+			if (--cur.bad_allowed == 0) {
+				int_sort_heap(&s, cur.begin, cur.end);
+				left.end = left.begin;
+				right.begin = right.end;
+			} else {
+				left.bad_allowed = right.bad_allowed =
+					cur.bad_allowed;
+				int_sort_break_patterns(left.begin, left.end);
+				int_sort_break_patterns(right.begin, right.end);
+			}
+		} else if (swaps == 0 &&
+			   int_sort_insertion_partial(&s, left.begin, left.end) &&
+			   int_sort_insertion_partial(&s, right.begin, right.end)) {
+			left.end = left.begin;
+			right.begin = right.end;
+		}
+		if (left_size < right_size) {
+			stack[top++] = right;
+			cur = left;
+		} else {
+			stack[top++] = left;
+			cur = right;
+		}
+	}
+}
+
+enum {
+	INT_SORT_RADIX_SIZE = 1 << INT_SORT_RADIX_BITS,
+	INT_SORT_RADIX_MASK = INT_SORT_RADIX_SIZE - 1,
+	/** Digits in a 32-bit key. */
+	INT_SORT_RADIX_PASSES = (32 + INT_SORT_RADIX_BITS - 1) /
+				INT_SORT_RADIX_BITS,
+};
+
+/** Key of the value, which orders as unsigned. */
+static inline uint32_t
+int_sort_radix_key(int value)
+{
+	return (uint32_t)value ^ 0x80000000U;
+}
+
+/** Move the values to their buckets by the digit at @a shift. */
+static void
+int_sort_radix_pass(struct int_sort *s, const int *src, int *dst,
+		    size_t size, size_t *offsets, int shift)
+{
+	for (size_t i = 0; i < size;) {
+		size_t block_end = size - i > INT_SORT_YIELD_STEP ?
+				   i + INT_SORT_YIELD_STEP : size;
+		for (; i < block_end; ++i) {
+			int value = src[i];
+			uint32_t digit = (int_sort_radix_key(value) >> shift) &
+					 INT_SORT_RADIX_MASK;
+			dst[offsets[digit]++] = value;
+		}
+		int_sort_step(s, INT_SORT_YIELD_STEP);
+	}
+}
+
+void
+int_sort_radix(int *data, size_t size, int_sort_yield_f yield, void *arg)
+{
+	int *buf = malloc(size * sizeof(data[0]));
+	size_t (*counts)[INT_SORT_RADIX_SIZE] =
+		calloc(INT_SORT_RADIX_PASSES, sizeof(*counts));
+	if (buf == NULL || counts == NULL) {
+		free(buf);
+		free(counts);
+		int_sort(data, size, yield, arg);
+		return;
+	}
+	struct int_sort s = {
+		.yield = yield,
+		.arg = arg,
+		.budget = INT_SORT_YIELD_STEP,
+	};
+	for (size_t i = 0; i < size; ++i) {
+		uint32_t key = int_sort_radix_key(data[i]);
+		for (int d = 0; d < INT_SORT_RADIX_PASSES; ++d)
+			++counts[d][(key >> (d * INT_SORT_RADIX_BITS)) &
+				    INT_SORT_RADIX_MASK];
+		if (((i + 1) & (INT_SORT_YIELD_STEP - 1)) == 0)
+			int_sort_step(&s, INT_SORT_YIELD_STEP);
+	}
+	int *src = data, *dst = buf;
+	for (int d = 0; d < INT_SORT_RADIX_PASSES; ++d) {
+		/* Counts turn into offsets of the buckets. */
+		size_t *offsets = counts[d];
+		size_t offset = 0;
+		bool is_trivial = false;
+		for (int b = 0; b < INT_SORT_RADIX_SIZE; ++b) {
+			size_t count = offsets[b];
+			if (count == size)
+				is_trivial = true;
+			offsets[b] = offset;
+			offset += count;
+		}
+		if (is_trivial)
+			continue;
+		int_sort_radix_pass(&s, src, dst, size, offsets,
+				    d * INT_SORT_RADIX_BITS);
+		int_sort_yield(&s);
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != data)
+		memcpy(data, src, size * sizeof(data[0]));
+	free(counts);
+	free(buf);
+}
+
+void
+int_sort_auto(int *data, size_t size, int_sort_yield_f yield, void *arg)
+{
+	if (size >= INT_SORT_RADIX_MIN)
+		int_sort_radix(data, size, yield, arg);
+	else
+		int_sort(data, size, yield, arg);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * In-place sort of integers - pattern-defeating quicksort. Pivots
+ * are medians of 3, or ninthers on big ranges, partitioning is
+ * three-way, so equal values are put aside at once. Ranges, which
+ * partition badly too many times, are heapsorted, small ones are
+ * insertion sorted, or by sorting networks on CPUs with AVX2. The
+ * sort is iterative, its stack is O(log N) and it is not on the
+ * coroutine stack.
+ */
+
+enum {
+	/** Ranges up to that size are insertion sorted. */
+	INT_SORT_INSERTION_MAX = 24,
+	/**
+	 * With AVX2 ranges up to that size are sorted by sorting
+	 * networks in vector registers instead.
+	 */
+	INT_SORT_NETWORK_MAX = 64,
+	/** Ranges from that size take the pivot by ninther. */
+	INT_SORT_NINTHER_MIN = 128,
+	/** The yield hook is called after about that many steps. */
+	INT_SORT_YIELD_STEP = 1 << 12,
+	/** Bits of a radix sort digit. */
+	INT_SORT_RADIX_BITS = 11,
+	/** int_sort_auto() uses radix sort from that size. */
+	INT_SORT_RADIX_MIN = 1 << 11,
+};
+
+/**
+ * Hook, which is called regularly by a long sort, for example to
+ * yield the coroutine.
+ */
+typedef void (*int_sort_yield_f)(void *arg);
+
+/**
+ * Sort @a size integers in ascending order. @a yield, if not
+ * NULL, is called with @a arg every INT_SORT_YIELD_STEP or so
+ * element moves and comparisons.
+ */
+void
+int_sort(int *data, size_t size, int_sort_yield_f yield, void *arg);
+
+/**
+ * LSD radix sort in three passes of 11-bit digits, the sign bit is
+ * flipped to order negative values first. The histograms of all
+ * the digits are counted in one pass over the data, and the passes,
+ * where all the values have the same digit, are skipped. Needs a
+ * buffer of @a size integers, without memory it falls back to
+ * int_sort(). @a yield is called between the passes and inside them
+ * as in int_sort().
+ */
+void
+int_sort_radix(int *data, size_t size, int_sort_yield_f yield, void *arg);
+
+/**
+ * Sort by radix sort or by int_sort(), whichever is faster for
+ * that size.
+ */
+void
+int_sort_auto(int *data, size_t size, int_sort_yield_f yield, void *arg);
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "int_writer.h"
+#include "coro_io.h"
+
+const char int_format_digits[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+size_t
+int_format_length(int value)
+{
+	uint32_t v = value < 0 ? 0U - (uint32_t)value : (uint32_t)value;
+	size_t len = 2 + (value < 0);
+	while (v >= 10) {
+		v /= 10;
+		++len;
+	}
+	return len;
+}
+
+void
+int_writer_create(struct int_writer *w, int fd,
+		  enum int_writer_format format, size_t buffer_size)
+{
+	if (buffer_size < INT_WRITER_NUMBER_MAX)
+		buffer_size = INT_WRITER_BUFFER_SIZE_DEFAULT;
+	w->fd = fd;
+	w->format = format;
+	w->buf = malloc(buffer_size);
+	w->size = 0;
+	w->capacity = buffer_size;
+	w->offset = -1;
+	w->written = 0;
+	w->error = 0;
+}
+
+void
+int_writer_set_offset(struct int_writer *w, off_t offset)
+{
+	int_writer_flush(w);
+	w->offset = offset;
+}
+
+/** Write the whole piece, retrying short writes. */
+static int
+int_writer_write(struct int_writer *w, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc;
+		if (w->offset >= 0)
+			rc = coro_pwrite(w->fd, data, size, w->offset);
+		else
+			rc = coro_write(w->fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			w->error = errno;
+			return -1;
+		}
+		if (w->offset >= 0)
+			w->offset += rc;
+		w->written += rc;
+		data += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+int
+int_writer_flush(struct int_writer *w)
+{
+	size_t size = w->size;
+	w->size = 0;
+	if (w->error == 0 && size > 0)
+		int_writer_write(w, w->buf, size);
+	if (w->error != 0) {
+		errno = w->error;
+		return -1;
+	}
+	return 0;
+}
+
+int
+int_writer_destroy(struct int_writer *w)
+{
+	int rc = int_writer_flush(w);
+	free(w->buf);
+	w->buf = NULL;
+	return rc;
+}
+
+void
+int_writer_put_array(struct int_writer *w, const int *values,
+		     size_t count)
+{
+	size_t bytes = count * sizeof(values[0]);
+	if (w->format == INT_WRITER_TEXT || bytes < w->capacity - w->size) {
+		for (size_t i = 0; i < count; ++i)
+			int_writer_put(w, values[i]);
+		return;
+	}
+	if (w->error != 0)
+		return;
+	if (w->offset >= 0) {
+		if (int_writer_flush(w) == 0)
+			int_writer_write(w, (const char *)values, bytes);
+		return;
+	}
+	struct iovec iov[2];
+	iov[0].iov_base = w->buf;
+	iov[0].iov_len = w->size;
+	iov[1].iov_base = (void *)values;
+	iov[1].iov_len = bytes;
+	ssize_t rc = coro_writev(w->fd, iov, 2);
+	if (rc < 0) {
+		w->error = errno;
+		return;
+	}
+	w->written += rc;
+	/* Whatever was not written in one go. */
+	size_t done = rc;
+	if (done < iov[0].iov_len) {
+		if (int_writer_write(w, w->buf + done, w->size - done) != 0)
+			return;
+		done = iov[0].iov_len;
+	}
+	w->size = 0;
+	int_writer_write(w, (const char *)values + (done - iov[0].iov_len),
+			 bytes - (done - iov[0].iov_len));
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+/**
+ * Buffered writer of integers. Numbers are formatted into a large
+ * buffer, two digits at a time, and the buffer is flushed with a
+ * single write. The writes go through coro_io, so a writer can be
+ * used in a coroutine without blocking its thread.
+ */
+
+enum int_writer_format {
+	/** Decimal numbers, each followed by a space. */
+	INT_WRITER_TEXT,
+	/** Raw int32 values in the host byte order. */
+	INT_WRITER_BINARY,
+};
+
+enum {
+	INT_WRITER_BUFFER_SIZE_DEFAULT = 1 << 20,
+	/** Longest formatted number: "-2147483648 ". */
+	INT_WRITER_NUMBER_MAX = 12,
+};
+
+struct int_writer {
+	int fd;
+	enum int_writer_format format;
+	char *buf;
+	size_t size;
+	size_t capacity;
+	/**
+	 * Where the next flush goes with pwrite(), or -1 to write at
+	 * the current file position.
+	 */
+	off_t offset;
+	/** Number of bytes written to the file. */
+	uint64_t written;
+	/** errno of the first failed write, 0 if none. */
+	int error;
+};
+
+/**
+ * Start writing to @a fd. The buffer size 0 means the default
+ * one. The descriptor is not closed by the writer.
+ */
+void
+int_writer_create(struct int_writer *w, int fd,
+		  enum int_writer_format format, size_t buffer_size);
+
+/**
+ * Write at @a offset of the file with pwrite() from now on, so
+ * several writers can fill their parts of one file.
+ */
+void
+int_writer_set_offset(struct int_writer *w, off_t offset);
+
+/**
+ * Flush the buffer.
+ * @retval 0 Success.
+ * @retval -1 A write has failed, errno is set.
+ */
+int
+int_writer_flush(struct int_writer *w);
+
+/** Flush and free the buffer. Returns like int_writer_flush(). */
+int
+int_writer_destroy(struct int_writer *w);
+
+/** "00" "01" ... "99" - the digit pairs. */
+extern const char int_format_digits[200];
+
+/**
+ * Format @a value into @a out with a space after it, return the
+ * length. @a out must have INT_WRITER_NUMBER_MAX bytes.
+ */
+static inline size_t
+int_format(char *out, int value)
+{
+	char tmp[INT_WRITER_NUMBER_MAX];
+	char *end = tmp + sizeof(tmp);
+	char *p = end;
+	*--p = ' ';
+	uint32_t v = value < 0 ? 0U - (uint32_t)value : (uint32_t)value;
+	while (v >= 100) {
+		uint32_t q = v / 100;
+		p -= 2;
+		memcpy(p, int_format_digits + (v - q * 100) * 2, 2);
+		v = q;
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, int_format_digits + v * 2, 2);
+	} else {
+		*--p = '0' + v;
+	}
+	if (value < 0)
+		*--p = '-';
+	size_t len = end - p;
+	memcpy(out, p, len);
+	return len;
+}
+
+static inline void
+int_writer_put(struct int_writer *w, int value)
+{
+	if (w->capacity - w->size < INT_WRITER_NUMBER_MAX)
+		int_writer_flush(w);
+	if (w->format == INT_WRITER_TEXT) {
+		w->size += int_format(w->buf + w->size, value);
+	} else {
+		memcpy(w->buf + w->size, &value, sizeof(value));
+		w->size += sizeof(value);
+	}
+}
+
+/**
+ * Write many numbers. In the binary format a long array is written
+ * together with the buffer by one writev(), without copying.
+ */
+void
+int_writer_put_array(struct int_writer *w, const int *values,
+		     size_t count);
+
+/** Length of the text of @a value with its space, as int_format() makes. */
+size_t
+int_format_length(int value);
@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "kmerge.h"
+
+/** Make sure the run has values, if it has any left. */
+static inline bool
+kmerge_run_fill(struct kmerge_run *run)
+{
+	if (run->cur == run->end && run->refill != NULL)
+		run->refill(run);
+	return run->cur != run->end;
+}
+
+/** True, if leaf a goes before leaf b. Exhausted runs go last. */
+static inline bool
+kmerge_less(const struct kmerge *m, int a, int b)
+{
+	const struct kmerge_run *ra = &m->runs[m->leaves[a]];
+	const struct kmerge_run *rb = &m->runs[m->leaves[b]];
+	if (ra->cur == ra->end)
+		return false;
+	if (rb->cur == rb->end)
+		return true;
+	if (*ra->cur != *rb->cur)
+		return *ra->cur < *rb->cur;
+	return a < b;
+}
+
+/** Play all the matches between the leaves from scratch. */
+static void
+kmerge_play(struct kmerge *m)
+{
+	int k = m->leaf_count;
+	m->active_count = k;
+	m->pending = -1;
+	m->tree[0] = 0;
+	if (k < 2)
+		return;
+	int *winners = malloc(2 * k * sizeof(winners[0]));
+	for (int i = 0; i < k; ++i)
+		winners[k + i] = i;
+	for (int n = k - 1; n > 0; --n) {
+		int a = winners[2 * n];
+		int b = winners[2 * n + 1];
+		if (kmerge_less(m, b, a)) {
+			winners[n] = b;
+			m->tree[n] = a;
+		} else {
+			winners[n] = a;
+			m->tree[n] = b;
+		}
+	}
+	m->tree[0] = winners[1];
+	free(winners);
+}
+
+/** Replay the matches on the way from the leaf to the root. */
+static inline void
+kmerge_replay(struct kmerge *m, int leaf)
+{
+	int winner = leaf;
+	for (int n = (leaf + m->leaf_count) / 2; n > 0; n /= 2) {
+		if (kmerge_less(m, m->tree[n], winner)) {
+			int loser = winner;
+			winner = m->tree[n];
+			m->tree[n] = loser;
+		}
+	}
+	m->tree[0] = winner;
+}
+
+/**
+ * The second best leaf. It has lost to the winner in one of the
+ * matches on the winner's way to the root.
+ */
+static inline int
+kmerge_runner_up(const struct kmerge *m)
+{
+	int winner = m->tree[0];
+	int best = -1;
+	for (int n = (winner + m->leaf_count) / 2; n > 0; n /= 2) {
+		if (best < 0 || kmerge_less(m, m->tree[n], best))
+			best = m->tree[n];
+	}
+	return best;
+}
+
+/** First value after @a cur, which is bigger than @a key. *cur <= key. */
+static inline const int *
+kmerge_upper_bound(const int *cur, const int *end, int key)
+{
+	/* Gallop - most blocks are short. */
+	size_t step = 1;
+	while (step < (size_t)(end - cur) && cur[step] <= key) {
+		cur += step;
+		step *= 2;
+	}
+	const int *hi = step < (size_t)(end - cur) ? cur + step : end;
+	const int *lo = cur + 1;
+	while (lo < hi) {
+		const int *mid = lo + (hi - lo) / 2;
+		if (*mid <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void
+kmerge_create(struct kmerge *m, struct kmerge_run *runs, int count)
+{
+	m->runs = runs;
+	m->leaves = malloc((count > 0 ? count : 1) * sizeof(m->leaves[0]));
+	m->tree = malloc((count > 0 ? count : 1) * sizeof(m->tree[0]));
+	m->leaf_count = 0;
+	for (int i = 0; i < count; ++i) {
+		if (kmerge_run_fill(&runs[i]))
+			m->leaves[m->leaf_count++] = i;
+	}
+	kmerge_play(m);
+}
+
+void
+kmerge_destroy(struct kmerge *m)
+{
+	free(m->leaves);
+	free(m->tree);
+}
+
+/** Bring the last winner's run back into the game. */
+static void
+kmerge_update(struct kmerge *m, int leaf)
+{
+	struct kmerge_run *run = &m->runs[m->leaves[leaf]];
+	if (! kmerge_run_fill(run) && --m->active_count > 0 &&
+	    m->active_count <= m->leaf_count / 2) {
+		/*
+		 * Half of the leaves are dead - rebuild the tree without
+		 * them, it becomes a level lower.
+		 */
+		int k = 0;
+		for (int i = 0; i < m->leaf_count; ++i) {
+			struct kmerge_run *r = &m->runs[m->leaves[i]];
+			if (r->cur != r->end)
+				m->leaves[k++] = m->leaves[i];
+		}
+		m->leaf_count = k;
+		kmerge_play(m);
+		return;
+	}
+	kmerge_replay(m, leaf);
+}
+
+size_t
+kmerge_next(struct kmerge *m, const int **block)
+{
+	if (m->pending >= 0) {
+		kmerge_update(m, m->pending);
+		m->pending = -1;
+	}
+	if (m->active_count == 0)
+		return 0;
+	int winner = m->tree[0];
+	struct kmerge_run *run = &m->runs[m->leaves[winner]];
+	const int *end = run->end;
+	if (m->active_count > 1) {
+		int r = kmerge_runner_up(m);
+		const struct kmerge_run *second = &m->runs[m->leaves[r]];
+		if (second->cur != second->end)
+			end = kmerge_upper_bound(run->cur, run->end, *second->cur);
+	}
+	*block = run->cur;
+	size_t len = end - run->cur;
+	run->cur = end;
+	m->pending = winner;
+	return len;
+}
+
+/** Number of values in the run, which are less than @a key. */
+static size_t
+kmerge_count_less(const struct kmerge_run *run, int64_t key)
+{
+	const int *lo = run->cur;
+	const int *hi = run->end;
+	while (lo < hi) {
+		const int *mid = lo + (hi - lo) / 2;
+		if (*mid < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - run->cur;
+}
+
+void
+kmerge_split(const struct kmerge_run *runs, int count, size_t rank,
+	     size_t *split)
+{
+	/*
+	 * Find the value v, on which the split point lies: less than
+	 * rank values are below v, but with the values equal to v it
+	 * is at least rank.
+	 */
+	int64_t lo = INT32_MIN;
+	int64_t hi = INT32_MAX;
+	while (lo < hi) {
+		int64_t mid = lo + (hi - lo) / 2;
+		size_t le = 0;
+		for (int i = 0; i < count; ++i)
+			le += kmerge_count_less(&runs[i], mid + 1);
+		if (le >= rank)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	size_t need = rank;
+	for (int i = 0; i < count; ++i) {
+		split[i] = kmerge_count_less(&runs[i], lo);
+		need -= split[i];
+	}
+	/* The values equal to v are taken from the first runs. */
+	for (int i = 0; i < count && need > 0; ++i) {
+		size_t equal = kmerge_count_less(&runs[i], lo + 1) - split[i];
+		size_t take = equal < need ? equal : need;
+		split[i] += take;
+		need -= take;
+	}
+}
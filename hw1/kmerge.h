@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * K-way merge of sorted runs on a loser tree. Each step costs
+ * O(log k) comparisons, exhausted runs are retired from the tree,
+ * and values which come from one run in a row are returned as a
+ * single block, without per-value tree updates.
+ */
+
+struct kmerge_run;
+
+/**
+ * Give the run its next portion of values - set cur and end. For
+ * runs which don't fit into memory. Leave cur == end, if the run
+ * is over.
+ */
+typedef void (*kmerge_refill_f)(struct kmerge_run *run);
+
+/** A sorted run, a source of the merge. */
+struct kmerge_run {
+	/** The values, not merged yet. */
+	const int *cur;
+	const int *end;
+	/** How to get more values when cur == end, or NULL. */
+	kmerge_refill_f refill;
+	/** Anything the refill needs. */
+	void *arg;
+};
+
+struct kmerge {
+	/** The runs, given by the user. */
+	struct kmerge_run *runs;
+	/** Indexes of the runs, which are still in the tree. */
+	int *leaves;
+	int leaf_count;
+	/**
+	 * Loser tree over the leaves: tree[n] is the leaf which has
+	 * lost the match in node n, tree[0] is the overall winner.
+	 * Children of node n are 2n and 2n + 1, leaf i is node
+	 * leaf_count + i.
+	 */
+	int *tree;
+	/** Leaves, which are not exhausted. */
+	int active_count;
+	/**
+	 * Leaf, which has given the last block, or -1. Its run is
+	 * refilled and its path is replayed in the next call, when
+	 * the block is not used by the caller anymore.
+	 */
+	int pending;
+};
+
+/**
+ * Start merging @a count runs. The array is used by the merge
+ * until it is destroyed.
+ */
+void
+kmerge_create(struct kmerge *m, struct kmerge_run *runs, int count);
+
+void
+kmerge_destroy(struct kmerge *m);
+
+/**
+ * Get the next block of the merged sequence - the smallest value
+ * and all the next values of the same run, which are not bigger
+ * than any other run's value. The block points into the run and
+ * is valid until the next call.
+ * @return Number of values in the block, 0 when all is merged.
+ */
+size_t
+kmerge_next(struct kmerge *m, const int **block);
+
+/**
+ * Find where the @a rank smallest values of the merge end in each
+ * run: split[i] values of run i go before the split point. The
+ * runs must be in memory, without refills. Splits of a bigger rank
+ * are never to the left of a smaller one's, so the runs can be cut
+ * into slices which are merged independently.
+ */
+void
+kmerge_split(const struct kmerge_run *runs, int count, size_t rank,
+	     size_t *split);
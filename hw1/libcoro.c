@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -5,74 +7,1410 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "libcoro.h"
 
+/*
+ * On x86-64 the coroutines are switched by a hand-written
+ * register swap, and their stacks are prepared directly. Other
+ * platforms (or a build with CORO_PORTABLE_SWITCH defined) use
+ * sigsetjmp/siglongjmp and sigaltstack-based stack bootstrap.
+ */
+#if defined(__x86_64__) && !defined(CORO_PORTABLE_SWITCH)
+#define CORO_ASM_SWITCH 1
+#else
+#define CORO_ASM_SWITCH 0
+#endif
+
+/* Not all libc versions name it. */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/** Signal of the per-thread quantum timers. */
+#define CORO_QUANTUM_SIGNAL SIGRTMIN
+
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+enum coro_state {
+	/** In a ready queue, waiting for its turn. */
+	CORO_STATE_READY,
+	/** Works right now. */
+	CORO_STATE_RUNNING,
+	/**
+	 * Called coro_park(), but is still on its stack - the
+	 * switch to another coroutine is not finished yet.
+	 */
+	CORO_STATE_PARKING,
+	/** Skipped by the scheduler until coro_wakeup(). */
+	CORO_STATE_PARKED,
+	/** In a finished queue, waiting for coro_sched_wait(). */
+	CORO_STATE_FINISHED,
+};
+
+struct coro_sched;
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
-	/** Stack, used by the coroutine. */
+	/**
+	 * Stack, used by the coroutine. It is the lowest usable
+	 * address, a guard page is mapped right below it.
+	 */
 	void *stack;
+	/** Usable size of the stack, without the guard page. */
+	size_t stack_size;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+#if CORO_ASM_SWITCH
+	/**
+	 * Last remembered stack pointer. All the callee-saved
+	 * registers are stored on the stack right below it.
+	 */
+	void *sp;
+#else
 	/** Last remembered coroutine context. */
 	sigjmp_buf ctx;
-	/** True, if the coroutine has finished. */
-	bool is_finished;
+#endif
+	/**
+	 * Where the coroutine is in its life cycle. Accessed
+	 * atomically, because wakeups can come from other threads.
+	 */
+	enum coro_state state;
+	/**
+	 * Set by coro_wakeup() which came when the coroutine was not
+	 * parked. The next coro_park() consumes it and returns
+	 * immediately, so a wakeup is never lost.
+	 */
+	bool wakeup_permit;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
-	struct coro *next, *prev;
+	/** Unique number of the coroutine, 0 for schedulers. */
+	unsigned id;
+	/** Statistics, collected when coro_stats_enable() is on. */
+	struct coro_stats stats;
+	/** When the coroutine started its current running slice. */
+	uint64_t run_start_ns;
+	/** When the coroutine was put into a ready queue. */
+	uint64_t ready_since_ns;
+	/** Scheduler, which runs the coroutine or has it queued. */
+	struct coro_sched *sched;
+	/** Deadline of coro_park_until(), while its timer is armed. */
+	uint64_t deadline_ns;
+	/**
+	 * Scheduler, which timer wheel has the coroutine, or NULL.
+	 * The coroutine can migrate to another thread, but its timer
+	 * stays in the wheel it was put into.
+	 */
+	struct coro_sched *timer_sched;
+	/** Wheel level of the timer. */
+	int timer_level;
+	/** Links in a timer wheel slot. */
+	struct coro *timer_next;
+	struct coro **timer_pprev;
+	/**
+	 * Link in a scheduler queue - ready or finished. A running
+	 * or parked coroutine is not in any queue.
+	 */
+	struct coro *next;
+};
+
+/** FIFO of coroutines, linked via coro.next. */
+struct coro_queue {
+	struct coro *head;
+	struct coro *tail;
+};
+
+enum {
+	/** Tick of the timer wheels is 2^16 ns, about 65 us. */
+	CORO_TIMER_TICK_SHIFT = 16,
+	CORO_TIMER_TICK_MASK = (1 << CORO_TIMER_TICK_SHIFT) - 1,
+	/** Each wheel level has 2^6 slots. */
+	CORO_TIMER_SLOT_BITS = 6,
+	CORO_TIMER_SLOTS = 1 << CORO_TIMER_SLOT_BITS,
+	/**
+	 * Level N slot covers 2^(6 * N) ticks, so 4 levels cover
+	 * 2^24 ticks, about 18 minutes. Longer timers wait in the
+	 * last level and are re-inserted when it comes around.
+	 */
+	CORO_TIMER_LEVELS = 4,
+};
+
+/**
+ * Scheduler of one thread. It is either created in a user thread
+ * by coro_sched_init() and then works inside coro_sched_wait(),
+ * or belongs to a worker thread of a coro_rt runtime.
+ */
+struct coro_sched {
+	/**
+	 * Context of the thread itself - it catches dead coroutines
+	 * and returns them to a user, or runs the worker loop.
+	 */
+	struct coro main;
+	/** Which coroutine works at this moment. */
+	struct coro *this;
+	/**
+	 * Coroutine which has just switched out. It is put where its
+	 * state says only once the switch is done - until then it is
+	 * still on its stack and must not be seen by other threads.
+	 */
+	struct coro *prev;
+	/** Coroutines ready to run, in the order they will be run. */
+	struct coro_queue ready;
+	/** Protects the ready queue from thieves. Only in a runtime. */
+	pthread_mutex_t ready_lock;
+	/**
+	 * Finished coroutines, not yet returned by coro_sched_wait().
+	 * In a runtime they go to the runtime's queue instead.
+	 */
+	struct coro_queue finished;
+	/**
+	 * Number of coroutines, not yet returned by coro_sched_wait()
+	 * - ready, running, parked and finished. Not used in a
+	 * runtime.
+	 */
+	int count;
+	/**
+	 * True, if in that moment the scheduler is waiting for a
+	 * coroutine finish.
+	 */
+	bool is_waiting;
+	/**
+	 * Coroutines, made ready by other threads. A lock-free stack,
+	 * which is moved into the ready queue by the owner thread.
+	 */
+	struct coro *inbox;
+	/** True, if the thread waits on cond for new coroutines. */
+	bool is_sleeping;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/** Runtime the scheduler works in, or NULL. */
+	struct coro_rt *rt;
+	/**
+	 * Timer which sets coro_quantum_expired in this thread when
+	 * the current coroutine has worked for a quantum.
+	 */
+	timer_t quantum_timer;
+	bool has_quantum_timer;
+	/** Quantum the timer was armed with last time. */
+	uint64_t quantum_armed_ns;
+	/** Created and not destroyed yet. */
+	bool is_live;
+	/**
+	 * Totals of all the coroutines ran by this scheduler since
+	 * the last statistics dump.
+	 */
+	struct coro_stats stats;
+	/** When the last switch in this thread has started. */
+	uint64_t switch_start_ns;
+	/**
+	 * Hierarchical timer wheel of the coroutines, parked with a
+	 * deadline. Level 0 slots are single ticks, and every time
+	 * level N has gone around, the next slot of level N + 1 is
+	 * spread over the lower levels.
+	 */
+	struct coro *timers[CORO_TIMER_LEVELS][CORO_TIMER_SLOTS];
+	/** Number of timers in each level. */
+	int timer_level_count[CORO_TIMER_LEVELS];
+	/** Number of timers in the wheel. */
+	int timer_count;
+	/** The first tick, which is not expired yet. */
+	uint64_t timer_tick;
+	/**
+	 * Protects the wheel from the coroutines which have moved to
+	 * other threads and cancel their timers. Only in a runtime.
+	 */
+	pthread_mutex_t timer_lock;
+};
+
+/** M:N runtime - worker threads, each with its own scheduler. */
+struct coro_rt {
+	/** Schedulers of the workers. */
+	struct coro_sched **scheds;
+	pthread_t *threads;
+	int thread_count;
+	/** Number of workers, which have created their schedulers. */
+	int started_count;
+	/** Worker to get the next spawned coroutine. */
+	unsigned next_sched;
+	/** True, when the workers should exit. */
+	bool is_stopping;
+	/** Finished coroutines, not yet returned by coro_rt_wait(). */
+	struct coro_queue finished;
+	/** Number of coroutines, not yet returned by coro_rt_wait(). */
+	int count;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+/** Argument of a worker thread. */
+struct coro_worker_arg {
+	struct coro_rt *rt;
+	int id;
+};
+
+enum {
+	/**
+	 * Stacks are reused through the pool, but no more than that
+	 * number of them are kept mapped while not in use.
+	 */
+	CORO_STACK_POOL_MAX = 64,
+	/**
+	 * How long an idle worker sleeps before it tries to steal
+	 * again, in nanoseconds.
+	 */
+	CORO_WORKER_IDLE_NS = 1000000,
+};
+
+/** A stack, not used by any coroutine at the moment. */
+struct coro_stack {
+	/** Lowest usable address, like coro.stack. */
+	void *base;
+	/** Usable size, like coro.stack_size. */
+	size_t size;
 };
 
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * Stack pool. Stacks are mmap'ed, so their pages are committed
+ * lazily on the first touch, and a finished coroutine returns its
+ * stack here instead of unmapping it. The next coroutine with the
+ * same stack size takes it without any syscalls.
  */
-static struct coro coro_sched;
+static struct coro_stack coro_stack_pool[CORO_STACK_POOL_MAX];
+/** Number of stacks in the pool. */
+static int coro_stack_pool_size = 0;
+/** Coroutines are created and deleted in any thread. */
+static pthread_mutex_t coro_stack_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Scheduler of the current thread. */
+static __thread struct coro_sched coro_sched_tls;
+
+/** Time quantum of the coroutines, 0 if it is not enforced. */
+static uint64_t coro_quantum_ns = 0;
+
+__thread volatile sig_atomic_t coro_quantum_expired = 0;
+
+/** How far coro_now_ns() is ahead of CLOCK_MONOTONIC. */
+static uint64_t coro_clock_shift_ns = 0;
+
+/** True, if the schedulers collect statistics. */
+static bool coro_stats_is_enabled = false;
+
+/** Last given coroutine id. */
+static unsigned coro_id_last = 0;
+
+enum coro_trace_type {
+	CORO_TRACE_CREATE,
+	CORO_TRACE_RESUME,
+	CORO_TRACE_YIELD,
+	CORO_TRACE_PARK,
+	CORO_TRACE_FINISH,
+	CORO_TRACE_BEGIN,
+	CORO_TRACE_END,
+};
+
+/** One event of the scheduling trace. */
+struct coro_trace_event {
+	/** CLOCK_MONOTONIC time. */
+	uint64_t ts_ns;
+	/** Id of the coroutine, 0 for the thread's own context. */
+	unsigned coro_id;
+	enum coro_trace_type type;
+	/** Span name of CORO_TRACE_BEGIN and CORO_TRACE_END. */
+	const char *name;
+};
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * Trace events of one thread. Only the owner thread writes into
+ * it, so recording needs neither locks nor atomic RMW. When full,
+ * the oldest events are overwritten.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+struct coro_trace_ring {
+	struct coro_trace_event *events;
+	/** Capacity - 1, capacity is a power of 2. */
+	uint64_t mask;
+	/** Number of events ever written. */
+	uint64_t head;
+	/** Number of the ring's thread in the trace. */
+	int thread_id;
+	/** Link in the list of all the rings. */
+	struct coro_trace_ring *next;
+};
+
+/** True, if the threads record trace events. */
+static bool coro_trace_is_enabled = false;
+/** Capacity of a new trace ring. */
+static uint64_t coro_trace_capacity = 0;
+/** Rings of all the threads which have recorded something. */
+static struct coro_trace_ring *coro_trace_rings = NULL;
+static int coro_trace_ring_count = 0;
 /**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * Incremented when the rings are freed, so the threads know that
+ * their cached rings are gone.
  */
-static sigjmp_buf start_point;
+static uint64_t coro_trace_generation = 1;
+static pthread_mutex_t coro_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Trace ring of the current thread, if its generation is current. */
+static __thread struct coro_trace_ring *coro_trace_ring_tls = NULL;
+static __thread uint64_t coro_trace_ring_generation = 0;
+/**
+ * Number of the schedulers, which exist. The trace rings may be
+ * freed only when no other thread can record into them.
+ */
+static int coro_sched_live_count = 0;
 
-/** Add a new coroutine to the beginning of the list. */
+/**
+ * Get the current thread's scheduler. A coroutine can continue in
+ * another thread after any switch, so the address of the
+ * thread-local scheduler must never be cached across one. Hence
+ * the function is not inlined, and the empty asm stops the
+ * compiler from treating it as a pure one.
+ */
+static __attribute__((noinline)) struct coro_sched *
+coro_sched_cur(void)
+{
+	struct coro_sched *s = &coro_sched_tls;
+	__asm__ volatile("" : "+r"(s));
+	return s;
+}
+
+/** Page size, used to round stacks and for the guard page. */
+static size_t
+coro_page_size(void)
+{
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+/**
+ * Give the coroutine a stack of at least @a size bytes. Take it
+ * from the pool, or map a new one with a PROT_NONE guard page
+ * below it, so an overflow crashes instead of corrupting memory.
+ */
+static void
+coro_stack_get(struct coro *c, size_t size)
+{
+	size_t page_size = coro_page_size();
+	size = (size + page_size - 1) & ~(page_size - 1);
+	c->stack_size = size;
+	pthread_mutex_lock(&coro_stack_pool_lock);
+	for (int i = coro_stack_pool_size - 1; i >= 0; --i) {
+		if (coro_stack_pool[i].size != size)
+			continue;
+		c->stack = coro_stack_pool[i].base;
+		coro_stack_pool[i] = coro_stack_pool[--coro_stack_pool_size];
+		pthread_mutex_unlock(&coro_stack_pool_lock);
+		return;
+	}
+	pthread_mutex_unlock(&coro_stack_pool_lock);
+	char *map = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	if (mprotect(map, page_size, PROT_NONE) != 0)
+		handle_error();
+	c->stack = map + page_size;
+}
+
+/** Return the coroutine's stack to the pool, or unmap it. */
+static void
+coro_stack_put(struct coro *c)
+{
+	pthread_mutex_lock(&coro_stack_pool_lock);
+	if (coro_stack_pool_size < CORO_STACK_POOL_MAX) {
+		struct coro_stack *s = &coro_stack_pool[coro_stack_pool_size++];
+		s->base = c->stack;
+		s->size = c->stack_size;
+		pthread_mutex_unlock(&coro_stack_pool_lock);
+		return;
+	}
+	pthread_mutex_unlock(&coro_stack_pool_lock);
+	size_t page_size = coro_page_size();
+	if (munmap((char *)c->stack - page_size,
+		   c->stack_size + page_size) != 0)
+		handle_error();
+}
+
+/** Add a coroutine to the end of the queue. */
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	if (q->tail != NULL)
+		q->tail->next = c;
+	else
+		q->head = c;
+	q->tail = c;
+}
+
+/** Take a coroutine from the beginning of the queue, or NULL. */
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->head;
+	if (c == NULL)
+		return NULL;
+	q->head = c->next;
+	if (q->head == NULL)
+		q->tail = NULL;
+	return c;
+}
+
+static inline enum coro_state
+coro_state_get(const struct coro *c)
+{
+	return __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+coro_state_set(struct coro *c, enum coro_state state)
+{
+	__atomic_store_n(&c->state, state, __ATOMIC_RELEASE);
+}
+
+/** Atomically change the state, if it is @a old. */
+static inline bool
+coro_state_cas(struct coro *c, enum coro_state old, enum coro_state state)
+{
+	return __atomic_compare_exchange_n(&c->state, &old, state, false,
+					   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/** Add a coroutine to the end of the scheduler's ready queue. */
+static inline void
+coro_sched_push(struct coro_sched *s, struct coro *c)
+{
+	if (s->rt == NULL) {
+		coro_queue_push(&s->ready, c);
+		return;
+	}
+	pthread_mutex_lock(&s->ready_lock);
+	coro_queue_push(&s->ready, c);
+	pthread_mutex_unlock(&s->ready_lock);
+}
+
+/** Take the first coroutine of the ready queue, or NULL. */
+static inline struct coro *
+coro_sched_pop(struct coro_sched *s)
+{
+	if (s->rt == NULL)
+		return coro_queue_pop(&s->ready);
+	pthread_mutex_lock(&s->ready_lock);
+	struct coro *c = coro_queue_pop(&s->ready);
+	pthread_mutex_unlock(&s->ready_lock);
+	return c;
+}
+
+/**
+ * Make the coroutine ready in a scheduler of another thread.
+ * The scheduler's thread is woken up if it sleeps.
+ */
 static void
-coro_list_add(struct coro *c)
+coro_sched_post(struct coro_sched *s, struct coro *c)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	struct coro *head = __atomic_load_n(&s->inbox, __ATOMIC_RELAXED);
+	do {
+		c->next = head;
+	} while (! __atomic_compare_exchange_n(&s->inbox, &head, c, true,
+					       __ATOMIC_SEQ_CST,
+					       __ATOMIC_RELAXED));
+	if (__atomic_load_n(&s->is_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&s->mutex);
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->mutex);
+	}
 }
 
-/** Remove a coroutine from the list. */
+/** Move the coroutines, posted by other threads, to the ready queue. */
 static void
-coro_list_delete(struct coro *c)
+coro_sched_drain(struct coro_sched *s)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	struct coro *c = __atomic_exchange_n(&s->inbox, NULL,
+					     __ATOMIC_ACQUIRE);
+	/* The inbox is a stack - restore the posting order. */
+	struct coro *list = NULL;
+	while (c != NULL) {
+		struct coro *next = c->next;
+		c->next = list;
+		list = c;
+		c = next;
+	}
+	for (c = list; c != NULL; c = list) {
+		list = c->next;
+		coro_sched_push(s, c);
+	}
+}
+
+uint64_t
+coro_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec +
+	       __atomic_load_n(&coro_clock_shift_ns, __ATOMIC_RELAXED);
+}
+
+void
+coro_clock_advance(uint64_t ns)
+{
+	__atomic_add_fetch(&coro_clock_shift_ns, ns, __ATOMIC_RELAXED);
+}
+
+/** CLOCK_MONOTONIC time of a coro_now_ns() deadline. */
+static void
+coro_deadline_to_timespec(uint64_t deadline_ns, struct timespec *ts)
+{
+	uint64_t shift = __atomic_load_n(&coro_clock_shift_ns,
+					 __ATOMIC_RELAXED);
+	deadline_ns = deadline_ns > shift ? deadline_ns - shift : 0;
+	ts->tv_sec = deadline_ns / 1000000000;
+	ts->tv_nsec = deadline_ns % 1000000000;
+}
+
+static inline void
+coro_timer_lock(struct coro_sched *s)
+{
+	if (s->rt != NULL)
+		pthread_mutex_lock(&s->timer_lock);
+}
+
+static inline void
+coro_timer_unlock(struct coro_sched *s)
+{
+	if (s->rt != NULL)
+		pthread_mutex_unlock(&s->timer_lock);
+}
+
+/**
+ * Put the timer into the slot of its deadline. The deadline is
+ * rounded up to a tick, so the timer never fires early.
+ */
+static void
+coro_timer_link(struct coro_sched *s, struct coro *c)
+{
+	/* Rounded up without an overflow, a far deadline must not wrap. */
+	uint64_t tick = (c->deadline_ns >> CORO_TIMER_TICK_SHIFT) +
+			((c->deadline_ns & CORO_TIMER_TICK_MASK) != 0);
+	if (tick < s->timer_tick)
+		tick = s->timer_tick;
+	uint64_t delta = tick - s->timer_tick;
+	int level = 0;
+	while (level < CORO_TIMER_LEVELS - 1 &&
+	       delta >> (CORO_TIMER_SLOT_BITS * (level + 1)) != 0)
+		++level;
+	uint64_t max_delta = 1ULL << (CORO_TIMER_SLOT_BITS * CORO_TIMER_LEVELS);
+	if (delta >= max_delta)
+		tick = s->timer_tick + max_delta - 1;
+	int idx = (tick >> (CORO_TIMER_SLOT_BITS * level)) &
+		  (CORO_TIMER_SLOTS - 1);
+	struct coro **slot = &s->timers[level][idx];
+	c->timer_next = *slot;
+	if (*slot != NULL)
+		(*slot)->timer_pprev = &c->timer_next;
+	c->timer_pprev = slot;
+	*slot = c;
+	c->timer_level = level;
+	++s->timer_level_count[level];
+}
+
+static void
+coro_timer_unlink(struct coro_sched *s, struct coro *c)
+{
+	*c->timer_pprev = c->timer_next;
+	if (c->timer_next != NULL)
+		c->timer_next->timer_pprev = c->timer_pprev;
+	c->timer_pprev = NULL;
+	--s->timer_level_count[c->timer_level];
+}
+
+/** Arm the timer of the current coroutine in its scheduler. */
+static void
+coro_timer_add(struct coro_sched *s, struct coro *c, uint64_t deadline_ns)
+{
+	coro_timer_lock(s);
+	c->deadline_ns = deadline_ns;
+	c->timer_sched = s;
+	coro_timer_link(s, c);
+	__atomic_store_n(&s->timer_count, s->timer_count + 1,
+			 __ATOMIC_RELAXED);
+	coro_timer_unlock(s);
+}
+
+/** Disarm the timer, unless it has fired already. */
+static void
+coro_timer_del(struct coro *c)
+{
+	struct coro_sched *s = __atomic_load_n(&c->timer_sched,
+					       __ATOMIC_ACQUIRE);
+	if (s == NULL)
+		return;
+	coro_timer_lock(s);
+	if (c->timer_sched == s) {
+		coro_timer_unlink(s, c);
+		__atomic_store_n(&s->timer_count, s->timer_count - 1,
+				 __ATOMIC_RELAXED);
+		c->timer_sched = NULL;
+	}
+	coro_timer_unlock(s);
+}
+
+/** Spread a slot of an upper level over the lower ones. */
+static void
+coro_timers_cascade(struct coro_sched *s, int level, uint64_t tick)
+{
+	int idx = (tick >> (CORO_TIMER_SLOT_BITS * level)) &
+		  (CORO_TIMER_SLOTS - 1);
+	struct coro *c = s->timers[level][idx];
+	s->timers[level][idx] = NULL;
+	while (c != NULL) {
+		struct coro *next = c->timer_next;
+		--s->timer_level_count[level];
+		coro_timer_link(s, c);
+		c = next;
+	}
+}
+
+/** Wake up the coroutines, which deadlines have come. */
+static void
+coro_timers_run(struct coro_sched *s)
+{
+	uint64_t now_tick = coro_now_ns() >> CORO_TIMER_TICK_SHIFT;
+	coro_timer_lock(s);
+	while (s->timer_tick <= now_tick) {
+		uint64_t tick = s->timer_tick;
+		if (s->timer_count == 0) {
+			s->timer_tick = now_tick + 1;
+			break;
+		}
+		/*
+		 * While the lower levels are empty, there is nothing to
+		 * do until the next slot of the first non-empty one.
+		 */
+		int level = 0;
+		while (s->timer_level_count[level] == 0)
+			++level;
+		uint64_t mask = (1ULL << (CORO_TIMER_SLOT_BITS * level)) - 1;
+		if ((tick & mask) != 0) {
+			uint64_t next = (tick | mask) + 1;
+			s->timer_tick = next <= now_tick ? next : now_tick + 1;
+			continue;
+		}
+		for (int l = CORO_TIMER_LEVELS - 1; l > 0; --l) {
+			mask = (1ULL << (CORO_TIMER_SLOT_BITS * l)) - 1;
+			if ((tick & mask) == 0)
+				coro_timers_cascade(s, l, tick);
+		}
+		struct coro **slot =
+			&s->timers[0][tick & (CORO_TIMER_SLOTS - 1)];
+		while (*slot != NULL) {
+			struct coro *c = *slot;
+			coro_timer_unlink(s, c);
+			__atomic_store_n(&s->timer_count, s->timer_count - 1,
+					 __ATOMIC_RELAXED);
+			coro_wakeup(c);
+			/*
+			 * Only now the coroutine may see the timer gone and
+			 * go on - it is not used here anymore.
+			 */
+			__atomic_store_n(&c->timer_sched, NULL,
+					 __ATOMIC_RELEASE);
+		}
+		s->timer_tick = tick + 1;
+	}
+	coro_timer_unlock(s);
+}
+
+/**
+ * When the timer wheel has to be run next, or UINT64_MAX if it
+ * is empty. It is the next non-empty slot of level 0, or of an
+ * upper level's, which is going to be cascaded.
+ */
+static uint64_t
+coro_timers_next_ns(struct coro_sched *s)
+{
+	if (__atomic_load_n(&s->timer_count, __ATOMIC_RELAXED) == 0)
+		return UINT64_MAX;
+	uint64_t best = UINT64_MAX;
+	coro_timer_lock(s);
+	for (int l = 0; l < CORO_TIMER_LEVELS; ++l) {
+		if (s->timer_level_count[l] == 0)
+			continue;
+		int shift = CORO_TIMER_SLOT_BITS * l;
+		uint64_t block = s->timer_tick >> shift;
+		/* A passed slot of the upper level was cascaded already. */
+		int k = l == 0 || (s->timer_tick & ((1ULL << shift) - 1)) == 0 ?
+			0 : 1;
+		for (; k <= CORO_TIMER_SLOTS; ++k) {
+			int idx = (block + k) & (CORO_TIMER_SLOTS - 1);
+			if (s->timers[l][idx] == NULL)
+				continue;
+			uint64_t tick = (block + k) << shift;
+			if (tick < best)
+				best = tick;
+			break;
+		}
+	}
+	coro_timer_unlock(s);
+	return best == UINT64_MAX ? best : best << CORO_TIMER_TICK_SHIFT;
+}
+
+/** Next coroutine to run in that scheduler, or NULL. */
+static inline struct coro *
+coro_sched_next(struct coro_sched *s)
+{
+	if (__atomic_load_n(&s->timer_count, __ATOMIC_RELAXED) > 0)
+		coro_timers_run(s);
+	if (__atomic_load_n(&s->inbox, __ATOMIC_RELAXED) != NULL)
+		coro_sched_drain(s);
+	return coro_sched_pop(s);
+}
+
+/**
+ * Block the scheduler's thread until another thread posts a
+ * coroutine to it, or until the next timer. Workers of a runtime
+ * sleep no longer than CORO_WORKER_IDLE_NS to retry stealing.
+ */
+static void
+coro_sched_sleep(struct coro_sched *s)
+{
+	uint64_t deadline = coro_timers_next_ns(s);
+	if (s->rt != NULL) {
+		uint64_t idle = coro_now_ns() + CORO_WORKER_IDLE_NS;
+		if (idle < deadline)
+			deadline = idle;
+	}
+	pthread_mutex_lock(&s->mutex);
+	__atomic_store_n(&s->is_sleeping, true, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->inbox, __ATOMIC_SEQ_CST) == NULL &&
+	    (s->rt == NULL ||
+	     ! __atomic_load_n(&s->rt->is_stopping, __ATOMIC_ACQUIRE))) {
+		if (deadline == UINT64_MAX) {
+			pthread_cond_wait(&s->cond, &s->mutex);
+		} else {
+			struct timespec ts;
+			coro_deadline_to_timespec(deadline, &ts);
+			pthread_cond_timedwait(&s->cond, &s->mutex, &ts);
+		}
+	}
+	__atomic_store_n(&s->is_sleeping, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+/** Hand a finished coroutine over to whoever waits for it. */
+static void
+coro_sched_retire(struct coro_sched *s, struct coro *c)
+{
+	struct coro_rt *rt = s->rt;
+	if (rt == NULL) {
+		coro_queue_push(&s->finished, c);
+		return;
+	}
+	pthread_mutex_lock(&rt->mutex);
+	coro_queue_push(&rt->finished, c);
+	pthread_cond_signal(&rt->cond);
+	pthread_mutex_unlock(&rt->mutex);
+}
+
+static void
+coro_quantum_handler(int signum)
+{
+	(void)signum;
+	coro_quantum_expired = 1;
+}
+
+void
+coro_quantum_set(uint64_t quantum_ns)
+{
+	if (quantum_ns == 0) {
+		coro_quantum_ns = 0;
+		return;
+	}
+	if (quantum_ns < CORO_QUANTUM_MIN_NS)
+		quantum_ns = CORO_QUANTUM_MIN_NS;
+	coro_quantum_ns = quantum_ns;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = coro_quantum_handler;
+	/* Interrupted reads and writes should just go on. */
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(CORO_QUANTUM_SIGNAL, &sa, NULL) != 0)
+		handle_error();
+}
+
+/**
+ * Start a new quantum in the scheduler's thread, if the previous
+ * one has expired. The timer is one-shot and is armed only then,
+ * or when the quantum has changed, so most switches cost no
+ * syscall. A context, switched to in the middle of a quantum,
+ * gets the rest of it.
+ */
+static inline void
+coro_quantum_restart(struct coro_sched *s)
+{
+	if (coro_quantum_expired == 0 && s->quantum_armed_ns == coro_quantum_ns)
+		return;
+	coro_quantum_expired = 0;
+	if (! s->has_quantum_timer)
+		return;
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = coro_quantum_ns / 1000000000;
+	its.it_value.tv_nsec = coro_quantum_ns % 1000000000;
+	if (timer_settime(s->quantum_timer, 0, &its, NULL) != 0)
+		handle_error();
+	s->quantum_armed_ns = coro_quantum_ns;
+}
+
+/** Create the quantum timer of the scheduler's thread, if needed. */
+static void
+coro_quantum_start(struct coro_sched *s)
+{
+	if (coro_quantum_ns == 0)
+		return;
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = CORO_QUANTUM_SIGNAL;
+	sev.sigev_notify_thread_id = gettid();
+	if (timer_create(CLOCK_MONOTONIC, &sev, &s->quantum_timer) != 0)
+		handle_error();
+	s->has_quantum_timer = true;
+	coro_quantum_restart(s);
+}
+
+static void
+coro_quantum_stop(struct coro_sched *s)
+{
+	if (! s->has_quantum_timer)
+		return;
+	timer_delete(s->quantum_timer);
+	s->has_quantum_timer = false;
+}
+
+/** Histogram bucket of a duration: floor(log2(ns)), capped. */
+static inline int
+coro_stats_bucket(uint64_t ns)
+{
+	if (ns == 0)
+		return 0;
+	int b = 63 - __builtin_clzll(ns);
+	return b < CORO_STATS_HIST_SIZE ? b : CORO_STATS_HIST_SIZE - 1;
+}
+
+/**
+ * Account the end of a running slice of the coroutine, which is
+ * being switched out at @a now.
+ */
+static void
+coro_stats_switch_out(struct coro_sched *s, struct coro *from, uint64_t now)
+{
+	s->switch_start_ns = now;
+	from->ready_since_ns = now;
+	if (from == &s->main)
+		return;
+	uint64_t slice = now - from->run_start_ns;
+	int b = coro_stats_bucket(slice);
+	from->stats.cpu_ns += slice;
+	++from->stats.slice_hist[b];
+	s->stats.cpu_ns += slice;
+	++s->stats.slice_hist[b];
+}
+
+/** Account the start of a running slice of the current coroutine. */
+static void
+coro_stats_switch_in(struct coro_sched *s)
+{
+	uint64_t now = coro_now_ns();
+	struct coro *c = s->this;
+	c->run_start_ns = now;
+	if (c == &s->main || s->switch_start_ns == 0)
+		return;
+	uint64_t wait = now - c->ready_since_ns;
+	int b = coro_stats_bucket(now - s->switch_start_ns);
+	c->stats.wait_ns += wait;
+	++c->stats.latency_hist[b];
+	++c->stats.switch_count;
+	s->stats.wait_ns += wait;
+	++s->stats.latency_hist[b];
+	++s->stats.switch_count;
+}
+
+void
+coro_stats_enable(bool enable)
+{
+	coro_stats_is_enabled = enable;
+}
+
+void
+coro_stats(const struct coro *c, struct coro_stats *stats)
+{
+	*stats = c->stats;
+	struct coro_sched *s = coro_sched_cur();
+	/* Include the slice which is not finished yet. */
+	if (coro_stats_is_enabled && c == s->this && c != &s->main)
+		stats->cpu_ns += coro_now_ns() - c->run_start_ns;
+}
+
+/** Add statistics @a src to @a dst. */
+static void
+coro_stats_add(struct coro_stats *dst, const struct coro_stats *src)
+{
+	dst->cpu_ns += src->cpu_ns;
+	dst->wait_ns += src->wait_ns;
+	dst->switch_count += src->switch_count;
+	for (int i = 0; i < CORO_STATS_HIST_SIZE; ++i) {
+		dst->slice_hist[i] += src->slice_hist[i];
+		dst->latency_hist[i] += src->latency_hist[i];
+	}
+}
+
+/** Print a duration of 2^@a log2 nanoseconds in short units. */
+static void
+coro_stats_print_pow2(int log2)
+{
+	static const char *units[] = {"ns", "us", "ms", "s"};
+	uint64_t v = (uint64_t)1 << log2;
+	int u = 0;
+	while (u < 3 && v >= 1000) {
+		v /= 1000;
+		++u;
+	}
+	printf("%4llu%-2s", (unsigned long long)v, units[u]);
+}
+
+/** Print non-empty buckets of a histogram with bars. */
+static void
+coro_stats_print_hist(const char *title, const uint64_t *hist)
+{
+	uint64_t max = 0;
+	for (int i = 0; i < CORO_STATS_HIST_SIZE; ++i) {
+		if (hist[i] > max)
+			max = hist[i];
+	}
+	printf("  %s:\n", title);
+	if (max == 0)
+		return;
+	for (int i = 0; i < CORO_STATS_HIST_SIZE; ++i) {
+		if (hist[i] == 0)
+			continue;
+		printf("    >= ");
+		coro_stats_print_pow2(i);
+		printf(" %10llu ", (unsigned long long)hist[i]);
+		for (uint64_t j = 0, n = hist[i] * 40 / max; j < n; ++j)
+			putchar('#');
+		putchar('\n');
+	}
+}
+
+void
+coro_stats_print(const char *title, const struct coro_stats *stats)
+{
+	printf("%s: switches %lld, on-CPU %llu us, waiting %llu us\n",
+	       title, stats->switch_count,
+	       (unsigned long long)(stats->cpu_ns / 1000),
+	       (unsigned long long)(stats->wait_ns / 1000));
+	coro_stats_print_hist("time slice length", stats->slice_hist);
+	coro_stats_print_hist("switch latency", stats->latency_hist);
+}
+
+/**
+ * Get the current thread's trace ring, create it on the first
+ * event. Not inlined for the same reason as coro_sched_cur().
+ */
+static __attribute__((noinline)) struct coro_trace_ring *
+coro_trace_ring_cur(void)
+{
+	__asm__ volatile("");
+	struct coro_trace_ring *r = coro_trace_ring_tls;
+	if (r != NULL && coro_trace_ring_generation ==
+	    __atomic_load_n(&coro_trace_generation, __ATOMIC_ACQUIRE))
+		return r;
+	/* Once per thread, the locking does not matter. */
+	pthread_mutex_lock(&coro_trace_lock);
+	r = malloc(sizeof(*r));
+	r->events = malloc(coro_trace_capacity * sizeof(r->events[0]));
+	r->mask = coro_trace_capacity - 1;
+	r->head = 0;
+	r->thread_id = coro_trace_ring_count++;
+	r->next = coro_trace_rings;
+	coro_trace_rings = r;
+	coro_trace_ring_tls = r;
+	coro_trace_ring_generation = coro_trace_generation;
+	pthread_mutex_unlock(&coro_trace_lock);
+	return r;
+}
+
+/** Record a trace event in the current thread. */
+static void
+coro_trace_record(enum coro_trace_type type, const struct coro *c,
+		  const char *name)
+{
+	struct coro_trace_ring *r = coro_trace_ring_cur();
+	struct coro_trace_event *e = &r->events[r->head & r->mask];
+	e->ts_ns = coro_now_ns();
+	e->coro_id = c != NULL ? c->id : 0;
+	e->type = type;
+	e->name = name;
+	/* Publish the event for an exporter. */
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void
+coro_trace_start(size_t events_per_thread)
+{
+	uint64_t capacity = 1024;
+	while (capacity < events_per_thread)
+		capacity *= 2;
+	pthread_mutex_lock(&coro_trace_lock);
+	if (coro_trace_rings == NULL)
+		coro_trace_capacity = capacity;
+	pthread_mutex_unlock(&coro_trace_lock);
+	__atomic_store_n(&coro_trace_is_enabled, true, __ATOMIC_RELEASE);
+}
+
+void
+coro_trace_stop(void)
+{
+	/* A scheduler of another thread could be recording right now. */
+	assert(__atomic_load_n(&coro_sched_live_count, __ATOMIC_ACQUIRE) <=
+	       (coro_sched_cur()->is_live ? 1 : 0));
+	__atomic_store_n(&coro_trace_is_enabled, false, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&coro_trace_lock);
+	struct coro_trace_ring *r = coro_trace_rings;
+	while (r != NULL) {
+		struct coro_trace_ring *next = r->next;
+		free(r->events);
+		free(r);
+		r = next;
+	}
+	coro_trace_rings = NULL;
+	coro_trace_ring_count = 0;
+	__atomic_add_fetch(&coro_trace_generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&coro_trace_lock);
+}
+
+void
+coro_trace_begin(const char *name)
+{
+	if (coro_trace_is_enabled)
+		coro_trace_record(CORO_TRACE_BEGIN, coro_this(), name);
+}
+
+void
+coro_trace_end(const char *name)
+{
+	if (coro_trace_is_enabled)
+		coro_trace_record(CORO_TRACE_END, coro_this(), name);
+}
+
+/**
+ * Track of a context in the trace: coroutines have their own
+ * tracks, the threads' own contexts are shown after them.
+ */
+static unsigned long
+coro_trace_tid(const struct coro_trace_ring *r,
+	       const struct coro_trace_event *e)
+{
+	if (e->coro_id != 0)
+		return e->coro_id;
+	return 1000000000ul + r->thread_id;
+}
+
+/** Print a string as a JSON string literal. */
+static void
+coro_trace_print_str(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str != 0; ++str) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', f);
+		if ((unsigned char)*str >= 0x20)
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+/** Print a trace event of a context on the track @a tid. */
+static void
+coro_trace_print_event(FILE *f, const struct coro_trace_event *e,
+		       const char *ph, const char *name, unsigned long tid)
+{
+	fprintf(f, ",\n{\"name\":");
+	coro_trace_print_str(f, name);
+	fprintf(f, ",\"ph\":\"%s\",\"ts\":%llu.%03llu,\"pid\":1,\"tid\":%lu",
+		ph, (unsigned long long)(e->ts_ns / 1000),
+		(unsigned long long)(e->ts_ns % 1000), tid);
+}
+
+/** A span event, taken out of its ring to be matched with its pair. */
+struct coro_trace_span {
+	const struct coro_trace_event *event;
+	/** Track of the context. */
+	unsigned long tid;
+	/** Order of the event in the rings, for equal times. */
+	uint64_t seq;
+};
+
+/** Order the span events by context, then by time. */
+static int
+coro_trace_span_cmp(const void *a, const void *b)
+{
+	const struct coro_trace_span *sa = a, *sb = b;
+	if (sa->tid != sb->tid)
+		return sa->tid < sb->tid ? -1 : 1;
+	if (sa->event->ts_ns != sb->event->ts_ns)
+		return sa->event->ts_ns < sb->event->ts_ns ? -1 : 1;
+	return sa->seq < sb->seq ? -1 : sa->seq > sb->seq;
+}
+
+/**
+ * Print the "run" slices and other switch events of a ring, and
+ * collect its span events into @a spans. A slice end is dropped,
+ * if its start was overwritten.
+ */
+static void
+coro_trace_export_ring(FILE *f, const struct coro_trace_ring *r,
+		       uint64_t since_ns, struct coro_trace_span *spans,
+		       size_t *span_count)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t i = head > r->mask + 1 ? head - r->mask - 1 : 0;
+	fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+		"\"pid\":1,\"tid\":%lu,\"args\":{\"name\":"
+		"\"thread %d\"}}", 1000000000ul + r->thread_id,
+		r->thread_id);
+	/* Track of the context, which runs since the last event. */
+	unsigned long run_tid = 0;
+	bool is_running = false;
+	for (; i < head; ++i) {
+		const struct coro_trace_event *e = &r->events[i & r->mask];
+		if (e->ts_ns < since_ns)
+			continue;
+		unsigned long tid = coro_trace_tid(r, e);
+		switch (e->type) {
+		case CORO_TRACE_CREATE:
+			coro_trace_print_event(f, e, "i", "create", tid);
+			fprintf(f, ",\"s\":\"t\"}");
+			break;
+		case CORO_TRACE_RESUME:
+			coro_trace_print_event(f, e, "B", "run", tid);
+			fprintf(f, ",\"args\":{\"thread\":%d}}",
+				r->thread_id);
+			run_tid = tid;
+			is_running = true;
+			break;
+		case CORO_TRACE_YIELD:
+		case CORO_TRACE_PARK:
+		case CORO_TRACE_FINISH:
+			if (!is_running || run_tid != tid)
+				break;
+			is_running = false;
+			coro_trace_print_event(f, e, "E", "run", tid);
+			fprintf(f, ",\"args\":{\"out\":\"%s\"}}",
+				e->type == CORO_TRACE_YIELD ? "yield" :
+				e->type == CORO_TRACE_PARK ? "park" : "finish");
+			break;
+		default:
+			spans[*span_count].event = e;
+			spans[*span_count].tid = tid;
+			spans[*span_count].seq = *span_count;
+			++*span_count;
+			break;
+		}
+	}
 }
 
+int
+coro_trace_export(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"args\":{\"name\":\"coroutines\"}}");
+	pthread_mutex_lock(&coro_trace_lock);
+	/*
+	 * The rings are overwritten at different rates. Only the
+	 * time since the oldest event of the busiest ring is there in
+	 * all of them, the events before it are dropped.
+	 */
+	uint64_t since_ns = 0;
+	size_t event_count = 0;
+	for (struct coro_trace_ring *r = coro_trace_rings; r != NULL;
+	     r = r->next) {
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (head <= r->mask + 1) {
+			event_count += head;
+			continue;
+		}
+		event_count += r->mask + 1;
+		uint64_t oldest_ns = r->events[head & r->mask].ts_ns;
+		if (oldest_ns > since_ns)
+			since_ns = oldest_ns;
+	}
+	struct coro_trace_span *spans = malloc((event_count + 1) *
+					       sizeof(spans[0]));
+	/* Names of the spans, which are open in a context. */
+	const char **open = malloc((event_count + 1) * sizeof(open[0]));
+	if (spans == NULL || open == NULL) {
+		pthread_mutex_unlock(&coro_trace_lock);
+		free(spans);
+		free(open);
+		fclose(f);
+		return -1;
+	}
+	size_t span_count = 0;
+	for (struct coro_trace_ring *r = coro_trace_rings; r != NULL;
+	     r = r->next)
+		coro_trace_export_ring(f, r, since_ns, spans, &span_count);
+	/*
+	 * A coroutine can begin a span on one thread and end it on
+	 * another, so the spans are matched across the rings. They
+	 * are async events, a span stays open while the coroutine is
+	 * switched out, and its slices don't have to nest into it.
+	 */
+	qsort(spans, span_count, sizeof(spans[0]), coro_trace_span_cmp);
+	size_t open_count = 0;
+	for (size_t i = 0; i < span_count; ++i) {
+		const struct coro_trace_event *e = spans[i].event;
+		if (i > 0 && spans[i].tid != spans[i - 1].tid)
+			open_count = 0;
+		if (e->type == CORO_TRACE_BEGIN) {
+			open[open_count++] = e->name;
+		} else if (open_count > 0 &&
+			   strcmp(open[open_count - 1], e->name) == 0) {
+			--open_count;
+		} else {
+			/* The span has begun before the oldest event. */
+			continue;
+		}
+		coro_trace_print_event(f, e, e->type == CORO_TRACE_BEGIN ?
+				       "b" : "e", e->name, spans[i].tid);
+		fprintf(f, ",\"cat\":\"span\",\"id\":%lu}", spans[i].tid);
+	}
+	pthread_mutex_unlock(&coro_trace_lock);
+	free(open);
+	free(spans);
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+/**
+ * Finish a switch in the context which has just been switched to:
+ * put the previous coroutine where its state says. Only now it is
+ * safe - the previous coroutine does not use its stack anymore.
+ */
+static void
+coro_switch_done(struct coro_sched *s)
+{
+	struct coro *prev = s->prev;
+	s->prev = NULL;
+	coro_quantum_restart(s);
+	if (coro_stats_is_enabled)
+		coro_stats_switch_in(s);
+	if (coro_trace_is_enabled)
+		coro_trace_record(CORO_TRACE_RESUME, s->this, NULL);
+	if (prev == NULL || prev == &s->main)
+		return;
+	switch (coro_state_get(prev)) {
+	case CORO_STATE_READY:
+		coro_sched_push(s, prev);
+		break;
+	case CORO_STATE_PARKING:
+		coro_state_set(prev, CORO_STATE_PARKED);
+		/*
+		 * A wakeup could come while the coroutine was parking.
+		 * Then only the permit is set, and the wakeup has to be
+		 * done here.
+		 */
+		if (__atomic_exchange_n(&prev->wakeup_permit, false,
+					__ATOMIC_SEQ_CST) &&
+		    coro_state_cas(prev, CORO_STATE_PARKED, CORO_STATE_READY)) {
+			if (coro_stats_is_enabled)
+				prev->ready_since_ns = coro_now_ns();
+			coro_sched_push(s, prev);
+		}
+		break;
+	case CORO_STATE_FINISHED:
+		coro_sched_retire(s, prev);
+		break;
+	default:
+		break;
+	}
+}
+
+#if CORO_ASM_SWITCH
+
+/**
+ * Save callee-saved registers of the current context on its
+ * stack, store the stack pointer into @a save_sp, then load
+ * @a load_sp and restore the registers of the target context.
+ * That is all the System V ABI requires to survive a function
+ * call, so nothing else is saved. Signal mask is not touched.
+ */
+void
+coro_switch(void **save_sp, void *load_sp) __asm__("coro_switch");
+
+/**
+ * First frame of each new coroutine. Its stack is prepared so as
+ * the first coro_switch() to it "returns" here with the coroutine
+ * in rbx and the entry function in r12.
+ */
+void
+coro_trampoline(void) __asm__("coro_trampoline");
+
+__asm__(
+	".pushsection .text\n"
+	".p2align 4\n"
+	".type coro_switch, @function\n"
+"coro_switch:\n"
+	"pushq %rbp\n"
+	"pushq %rbx\n"
+	"pushq %r12\n"
+	"pushq %r13\n"
+	"pushq %r14\n"
+	"pushq %r15\n"
+	"movq %rsp, (%rdi)\n"
+	"movq %rsi, %rsp\n"
+	"popq %r15\n"
+	"popq %r14\n"
+	"popq %r13\n"
+	"popq %r12\n"
+	"popq %rbx\n"
+	"popq %rbp\n"
+	"ret\n"
+	".size coro_switch, .-coro_switch\n"
+	".p2align 4\n"
+	".type coro_trampoline, @function\n"
+"coro_trampoline:\n"
+	"movq %rbx, %rdi\n"
+	"callq *%r12\n"
+	"ud2\n"
+	".size coro_trampoline, .-coro_trampoline\n"
+	".popsection\n"
+);
+
+#else
+
+/**
+ * Buffer, used by the coroutine constructor to escape from the
+ * signal handler back into the constructor to rollback
+ * sigaltstack etc.
+ */
+static sigjmp_buf start_point;
+
+#endif
+
 int
 coro_status(const struct coro *c)
 {
@@ -88,58 +1426,222 @@ coro_switch_count(struct coro *c)
 bool
 coro_is_finished(const struct coro *c)
 {
-	return c->is_finished;
+	return coro_state_get(c) == CORO_STATE_FINISHED;
 }
 
 void
 coro_delete(struct coro *c)
 {
-	free(c->stack);
+	coro_stack_put(c);
 	free(c);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
+/**
+ * Switch the current coroutine to an arbitrary one. The current
+ * coroutine's state must be already set - it defines where the
+ * coroutine goes when the switch is done.
+ */
 static void
-coro_yield_to(struct coro *to)
+coro_yield_to(struct coro_sched *s, struct coro *to)
 {
-	struct coro *from = coro_this_ptr;
+	struct coro *from = s->this;
 	++from->switch_count;
+	if (coro_stats_is_enabled)
+		coro_stats_switch_out(s, from, coro_now_ns());
+	if (coro_trace_is_enabled) {
+		enum coro_state state = coro_state_get(from);
+		enum coro_trace_type type = CORO_TRACE_YIELD;
+		if (state == CORO_STATE_PARKING)
+			type = CORO_TRACE_PARK;
+		else if (state == CORO_STATE_FINISHED)
+			type = CORO_TRACE_FINISH;
+		coro_trace_record(type, from, NULL);
+	}
+	s->prev = from;
+	s->this = to;
+	to->sched = s;
+	coro_state_set(to, CORO_STATE_RUNNING);
+#if CORO_ASM_SWITCH
+	coro_switch(&from->sp, to->sp);
+#else
 	if (sigsetjmp(from->ctx, 0) == 0)
 		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+#endif
+	/* Can be another thread now. */
+	coro_switch_done(coro_sched_cur());
 }
 
 void
 coro_yield(void)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
+	struct coro_sched *s = coro_sched_cur();
+	struct coro *from = s->this;
+	if (from == &s->main)
+		return;
+	struct coro *to = coro_sched_next(s);
+	/* Nobody else is ready - keep working, with a new quantum. */
+	if (to == NULL) {
+		if (coro_quantum_expired)
+			coro_quantum_restart(s);
+		return;
+	}
+	coro_state_set(from, CORO_STATE_READY);
+	coro_yield_to(s, to);
+}
+
+void
+coro_park(void)
+{
+	struct coro_sched *s = coro_sched_cur();
+	struct coro *from = s->this;
+	if (from == &s->main)
+		return;
+	if (__atomic_exchange_n(&from->wakeup_permit, false,
+				__ATOMIC_SEQ_CST))
+		return;
+	coro_state_set(from, CORO_STATE_PARKING);
+	/*
+	 * When nobody is ready the scheduler takes control to
+	 * decide what to do.
+	 */
+	struct coro *to = coro_sched_next(s);
 	if (to == NULL)
-		coro_yield_to(&coro_sched);
+		to = &s->main;
+	coro_yield_to(s, to);
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	__atomic_store_n(&c->wakeup_permit, true, __ATOMIC_SEQ_CST);
+	if (! coro_state_cas(c, CORO_STATE_PARKED, CORO_STATE_READY))
+		return;
+	/* It is going to run anyway, the permit is not needed. */
+	__atomic_store_n(&c->wakeup_permit, false, __ATOMIC_RELAXED);
+	if (coro_stats_is_enabled)
+		c->ready_since_ns = coro_now_ns();
+	struct coro_sched *s = coro_sched_cur();
+	if (c->sched == s)
+		coro_sched_push(s, c);
 	else
-		coro_yield_to(to);
+		coro_sched_post(c->sched, c);
+}
+
+bool
+coro_can_park(void)
+{
+	struct coro_sched *s = coro_sched_cur();
+	/* A thread without a scheduler has no coroutine to park. */
+	return s->this != NULL && s->this != &s->main;
+}
+
+void
+coro_park_until(uint64_t deadline_ns)
+{
+	if (! coro_can_park() || deadline_ns <= coro_now_ns())
+		return;
+	struct coro_sched *s = coro_sched_cur();
+	struct coro *c = s->this;
+	coro_timer_add(s, c, deadline_ns);
+	coro_park();
+	coro_timer_del(c);
+}
+
+void
+coro_sleep_until(uint64_t deadline_ns)
+{
+	if (coro_can_park()) {
+		while (coro_now_ns() < deadline_ns)
+			coro_park_until(deadline_ns);
+		return;
+	}
+	struct timespec ts;
+	coro_deadline_to_timespec(deadline_ns, &ts);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			       NULL) == EINTR)
+		;
+}
+
+void
+coro_sleep(uint64_t ns)
+{
+	coro_sleep_until(coro_now_ns() + ns);
+}
+
+/** Make a clean scheduler of the current thread. */
+static struct coro_sched *
+coro_sched_create(struct coro_rt *rt)
+{
+	struct coro_sched *s = coro_sched_cur();
+	coro_quantum_stop(s);
+	memset(s, 0, sizeof(*s));
+	s->main.state = CORO_STATE_RUNNING;
+	s->main.sched = s;
+	s->this = &s->main;
+	s->rt = rt;
+	s->timer_tick = coro_now_ns() >> CORO_TIMER_TICK_SHIFT;
+	pthread_mutex_init(&s->ready_lock, NULL);
+	pthread_mutex_init(&s->timer_lock, NULL);
+	pthread_mutex_init(&s->mutex, NULL);
+	/* Idle workers sleep with a monotonic timeout. */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	coro_quantum_start(s);
+	s->is_live = true;
+	__atomic_add_fetch(&coro_sched_live_count, 1, __ATOMIC_RELAXED);
+	return s;
+}
+
+static void
+coro_sched_destroy(struct coro_sched *s)
+{
+	s->is_live = false;
+	__atomic_sub_fetch(&coro_sched_live_count, 1, __ATOMIC_RELEASE);
+	coro_quantum_stop(s);
+	pthread_mutex_destroy(&s->ready_lock);
+	pthread_mutex_destroy(&s->timer_lock);
+	pthread_mutex_destroy(&s->mutex);
+	pthread_cond_destroy(&s->cond);
 }
 
 void
 coro_sched_init(void)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	coro_sched_create(NULL);
+}
+
+void
+coro_sched_free(void)
+{
+	coro_sched_destroy(coro_sched_cur());
 }
 
 struct coro *
 coro_sched_wait(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
+	struct coro_sched *s = coro_sched_cur();
+	while (s->count > 0) {
+		struct coro *c = coro_queue_pop(&s->finished);
+		if (c != NULL) {
+			--s->count;
+			return c;
+		}
+		c = coro_sched_next(s);
+		if (c == NULL) {
+			/* All are parked, wakeups can come from other threads. */
+			coro_sched_sleep(s);
+			continue;
 		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
+		s->is_waiting = true;
+		coro_yield_to(s, c);
+		s->is_waiting = false;
+	}
+	if (coro_stats_is_enabled && s->stats.switch_count > 0) {
+		coro_stats_print("coro scheduler stats", &s->stats);
+		memset(&s->stats, 0, sizeof(s->stats));
 	}
 	return NULL;
 }
@@ -147,9 +1649,77 @@ coro_sched_wait(void)
 struct coro *
 coro_this(void)
 {
-	return coro_this_ptr;
+	return coro_sched_cur()->this;
+}
+
+/**
+ * Leave the finished coroutine forever. In a single scheduler the
+ * control goes to coro_sched_wait() to return the coroutine. In a
+ * runtime the worker just takes the next ready one.
+ */
+static void
+coro_finish(struct coro *c)
+{
+	struct coro_sched *s = coro_sched_cur();
+	coro_state_set(c, CORO_STATE_FINISHED);
+	struct coro *to;
+	if (s->rt == NULL) {
+		/* Can not return - there is no caller frame on this stack. */
+		if (! s->is_waiting) {
+			printf("Critical error - no place to return!\n");
+			exit(-1);
+		}
+		to = &s->main;
+	} else {
+		to = coro_sched_next(s);
+		if (to == NULL)
+			to = &s->main;
+	}
+	coro_yield_to(s, to);
+	__builtin_unreachable();
+}
+
+#if CORO_ASM_SWITCH
+
+/**
+ * Coroutine entry point, called by coro_trampoline on the
+ * coroutine's own stack when it is switched to the first time.
+ */
+static void
+coro_body(struct coro *c)
+{
+	coro_switch_done(coro_sched_cur());
+	c->ret = c->func(c->func_arg);
+	coro_finish(c);
 }
 
+/**
+ * Lay out the initial frame of a new coroutine on its stack, as
+ * if it was switched out by coro_switch() right before entering
+ * coro_trampoline. No syscalls are needed for that.
+ */
+static void
+coro_stack_prepare(struct coro *c)
+{
+	uintptr_t top = ((uintptr_t)c->stack + c->stack_size) & ~(uintptr_t)15;
+	/*
+	 * Popped in this order: r15, r14, r13, r12, rbx, rbp, then
+	 * the return address. After 'ret' the stack pointer is 16
+	 * bytes aligned, so the trampoline can make a normal call.
+	 */
+	void **sp = (void **)top - 7;
+	sp[0] = NULL;
+	sp[1] = NULL;
+	sp[2] = NULL;
+	sp[3] = (void *)coro_body;
+	sp[4] = c;
+	sp[5] = NULL;
+	sp[6] = (void *)coro_trampoline;
+	c->sp = sp;
+}
+
+#else /* !CORO_ASM_SWITCH */
+
 /**
  * The core part of the coroutines creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
@@ -160,8 +1730,9 @@ static void
 coro_body(int signum)
 {
 	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
+	struct coro_sched *s = coro_sched_cur();
+	struct coro *c = s->this;
+	s->this = NULL;
 	/*
 	 * On an invokation jump back to the constructor right
 	 * after remembering the context.
@@ -172,30 +1743,20 @@ coro_body(int signum)
 	 * If the execution is here, then the coroutine should
 	 * finaly start work.
 	 */
-	coro_this_ptr = c;
+	coro_switch_done(coro_sched_cur());
 	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
 	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_finish(c);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+/**
+ * Make the coroutine's stack ready to be switched to: run a
+ * signal handler on it via sigaltstack and remember the context
+ * inside the handler.
+ */
+static void
+coro_stack_prepare(struct coro *c)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -219,20 +1780,21 @@ coro_new(coro_f func, void *func_arg)
 	/* Create that new stack. */
 	stack_t oldst, newst;
 	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_size = c->stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
+	struct coro_sched *s = coro_sched_cur();
+	struct coro *old_this = s->this;
+	s->this = c;
 	sigemptyset(&suss);
 	if (sigsetjmp(start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
+		while (s->this != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
+	s->this = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
@@ -251,8 +1813,213 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+}
+
+#endif /* !CORO_ASM_SWITCH */
 
+/** Allocate a coroutine with a stack, ready to be scheduled. */
+static struct coro *
+coro_create(coro_f func, void *func_arg, size_t stack_size)
+{
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	c->ret = 0;
+	if (stack_size == 0)
+		stack_size = CORO_STACK_SIZE_DEFAULT;
+#if ! CORO_ASM_SWITCH
+	if (stack_size < (size_t)SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+#endif
+	coro_stack_get(c, stack_size);
+	c->func = func;
+	c->func_arg = func_arg;
+	c->wakeup_permit = false;
+	c->switch_count = 0;
+	memset(&c->stats, 0, sizeof(c->stats));
+	c->run_start_ns = 0;
+	c->ready_since_ns = coro_stats_is_enabled ? coro_now_ns() : 0;
+	c->sched = NULL;
+	c->next = NULL;
+	c->id = __atomic_add_fetch(&coro_id_last, 1, __ATOMIC_RELAXED);
+	if (coro_trace_is_enabled)
+		coro_trace_record(CORO_TRACE_CREATE, c, NULL);
+	coro_stack_prepare(c);
+	c->state = CORO_STATE_READY;
+	return c;
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size)
+{
+	struct coro_sched *s = coro_sched_cur();
+	if (s->rt != NULL)
+		return coro_rt_spawn_ex(s->rt, func, func_arg, stack_size);
+	struct coro *c = coro_create(func, func_arg, stack_size);
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	c->sched = s;
+	coro_sched_push(s, c);
+	++s->count;
 	return c;
 }
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, 0);
+}
+
+/** Take a ready coroutine from another worker. */
+static struct coro *
+coro_rt_steal(struct coro_rt *rt, struct coro_sched *thief)
+{
+	for (int i = 0; i < rt->thread_count; ++i) {
+		struct coro_sched *s = rt->scheds[i];
+		if (s == thief ||
+		    __atomic_load_n(&s->ready.head, __ATOMIC_RELAXED) == NULL)
+			continue;
+		struct coro *c = coro_sched_pop(s);
+		if (c != NULL)
+			return c;
+	}
+	return NULL;
+}
+
+/**
+ * Worker thread of a runtime. Runs the coroutines of its own
+ * scheduler, and steals ready ones from other workers when has
+ * nothing to do.
+ */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker_arg *warg = arg;
+	struct coro_rt *rt = warg->rt;
+	int id = warg->id;
+	free(warg);
+	struct coro_sched *s = coro_sched_create(rt);
+	s->is_waiting = true;
+	/* Can not steal until all the workers are there. */
+	pthread_mutex_lock(&rt->mutex);
+	rt->scheds[id] = s;
+	++rt->started_count;
+	pthread_cond_broadcast(&rt->cond);
+	while (rt->started_count < rt->thread_count)
+		pthread_cond_wait(&rt->cond, &rt->mutex);
+	pthread_mutex_unlock(&rt->mutex);
+
+	while (true) {
+		struct coro *c = coro_sched_next(s);
+		if (c == NULL)
+			c = coro_rt_steal(rt, s);
+		if (c != NULL) {
+			coro_yield_to(s, c);
+			continue;
+		}
+		if (__atomic_load_n(&rt->is_stopping, __ATOMIC_ACQUIRE))
+			break;
+		coro_sched_sleep(s);
+	}
+	coro_sched_destroy(s);
+	return NULL;
+}
+
+struct coro_rt *
+coro_rt_new(int thread_count)
+{
+	if (thread_count < 1)
+		thread_count = 1;
+	struct coro_rt *rt = calloc(1, sizeof(*rt));
+	rt->thread_count = thread_count;
+	rt->scheds = calloc(thread_count, sizeof(rt->scheds[0]));
+	rt->threads = calloc(thread_count, sizeof(rt->threads[0]));
+	pthread_mutex_init(&rt->mutex, NULL);
+	pthread_cond_init(&rt->cond, NULL);
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker_arg *arg = malloc(sizeof(*arg));
+		arg->rt = rt;
+		arg->id = i;
+		errno = pthread_create(&rt->threads[i], NULL, coro_worker_f,
+				       arg);
+		if (errno != 0)
+			handle_error();
+	}
+	/* Coroutines can be spawned only when all workers are there. */
+	pthread_mutex_lock(&rt->mutex);
+	while (rt->started_count < thread_count)
+		pthread_cond_wait(&rt->cond, &rt->mutex);
+	pthread_mutex_unlock(&rt->mutex);
+	return rt;
+}
+
+int
+coro_rt_thread_count(const struct coro_rt *rt)
+{
+	return rt->thread_count;
+}
+
+struct coro *
+coro_rt_spawn_ex(struct coro_rt *rt, coro_f func, void *func_arg,
+		 size_t stack_size)
+{
+	struct coro *c = coro_create(func, func_arg, stack_size);
+	pthread_mutex_lock(&rt->mutex);
+	++rt->count;
+	pthread_mutex_unlock(&rt->mutex);
+	unsigned id = __atomic_fetch_add(&rt->next_sched, 1,
+					 __ATOMIC_RELAXED);
+	struct coro_sched *s = rt->scheds[id % rt->thread_count];
+	c->sched = s;
+	if (s == coro_sched_cur())
+		coro_sched_push(s, c);
+	else
+		coro_sched_post(s, c);
+	return c;
+}
+
+struct coro *
+coro_rt_spawn(struct coro_rt *rt, coro_f func, void *func_arg)
+{
+	return coro_rt_spawn_ex(rt, func, func_arg, 0);
+}
+
+struct coro *
+coro_rt_wait(struct coro_rt *rt)
+{
+	pthread_mutex_lock(&rt->mutex);
+	while (rt->finished.head == NULL && rt->count > 0)
+		pthread_cond_wait(&rt->cond, &rt->mutex);
+	struct coro *c = coro_queue_pop(&rt->finished);
+	if (c != NULL)
+		--rt->count;
+	pthread_mutex_unlock(&rt->mutex);
+	if (c == NULL && coro_stats_is_enabled) {
+		/* All the workers are idle, their totals are stable. */
+		struct coro_stats total;
+		memset(&total, 0, sizeof(total));
+		for (int i = 0; i < rt->thread_count; ++i) {
+			coro_stats_add(&total, &rt->scheds[i]->stats);
+			memset(&rt->scheds[i]->stats, 0, sizeof(total));
+		}
+		if (total.switch_count > 0)
+			coro_stats_print("coro runtime stats", &total);
+	}
+	return c;
+}
+
+void
+coro_rt_delete(struct coro_rt *rt)
+{
+	__atomic_store_n(&rt->is_stopping, true, __ATOMIC_RELEASE);
+	for (int i = 0; i < rt->thread_count; ++i) {
+		struct coro_sched *s = rt->scheds[i];
+		pthread_mutex_lock(&s->mutex);
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->mutex);
+	}
+	for (int i = 0; i < rt->thread_count; ++i)
+		pthread_join(rt->threads[i], NULL);
+	pthread_mutex_destroy(&rt->mutex);
+	pthread_cond_destroy(&rt->cond);
+	free(rt->threads);
+	free(rt->scheds);
+	free(rt);
+}
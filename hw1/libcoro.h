@@ -1,17 +1,66 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+
+enum {
+	/** Stack size of coroutines, created by coro_new(). */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** Number of log2 buckets in coro_stats histograms. */
+	CORO_STATS_HIST_SIZE = 32,
+	/**
+	 * Shortest time quantum. A shorter one would have the threads
+	 * do nothing but handle the timer signals.
+	 */
+	CORO_QUANTUM_MIN_NS = 50000,
+};
+
+/**
+ * Scheduling statistics of a coroutine, or totals of a scheduler.
+ * Durations are in nanoseconds. Histogram bucket i counts values
+ * in [2^i, 2^(i+1)) ns, the last one counts everything bigger.
+ */
+struct coro_stats {
+	/** Time the coroutine was running. */
+	uint64_t cpu_ns;
+	/** Time the coroutine was ready, but waited for its turn. */
+	uint64_t wait_ns;
+	/** Number of times the coroutine was switched to. */
+	long long switch_count;
+	/** Lengths of running slices - from a switch in to a switch out. */
+	uint64_t slice_hist[CORO_STATS_HIST_SIZE];
+	/**
+	 * Switch latencies - from the moment the previous context
+	 * started a switch till the coroutine got the CPU.
+	 */
+	uint64_t latency_hist[CORO_STATS_HIST_SIZE];
+};
 
 struct coro;
+struct coro_rt;
 typedef int (*coro_f)(void *);
 
-/** Make current context scheduler. */
+/**
+ * Make current context scheduler. Each thread can have its own
+ * scheduler with its own coroutines.
+ */
 void
 coro_sched_init(void);
 
 /**
- * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * Free the current thread's scheduler, made by coro_sched_init().
+ * It must have no coroutines left. For threads, which run a
+ * scheduler only for a while, like workers of a thread pool.
+ */
+void
+coro_sched_free(void);
+
+/**
+ * Block until any coroutine has finished. It is returned. NULL,
+ * if no coroutines. Finished coroutines are returned in the order
+ * they finished.
  */
 struct coro *
 coro_sched_wait(void);
@@ -22,11 +71,20 @@ coro_this(void);
 
 /**
  * Create a new coroutine. It is not started, just added to the
- * scheduler.
+ * scheduler. Inside a coroutine of a runtime it is spawned in the
+ * same runtime.
  */
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but the stack is @a stack_size bytes,
+ * rounded up to a page. 0 means CORO_STACK_SIZE_DEFAULT. Only the
+ * touched pages of a stack consume memory.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -34,14 +92,214 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(struct coro *c);
 
+/**
+ * Turn statistics collection on or off for all the schedulers.
+ * It costs two clock reads per switch, so it is off by default.
+ * When it is on, coro_sched_wait() and coro_rt_wait() print the
+ * totals when there are no coroutines left.
+ */
+void
+coro_stats_enable(bool enable);
+
+/**
+ * Get statistics of the coroutine. For the current coroutine the
+ * running time includes the current slice.
+ */
+void
+coro_stats(const struct coro *c, struct coro_stats *stats);
+
+/** Print statistics with histograms to stdout. */
+void
+coro_stats_print(const char *title, const struct coro_stats *stats);
+
+/**
+ * Start recording a scheduling trace: coroutine creation, every
+ * switch in and out, and spans of coro_trace_begin/end(). Each
+ * thread writes into its own ring of @a events_per_thread events
+ * (rounded up to a power of 2), the oldest ones are overwritten.
+ * Recording takes a clock read and a few stores, no locks.
+ */
+void
+coro_trace_start(size_t events_per_thread);
+
+/**
+ * Stop recording and free the recorded events. No other thread may
+ * record at that time: the runtimes must be deleted and the other
+ * threads' schedulers must be done with coro_sched_wait().
+ */
+void
+coro_trace_stop(void);
+
+/**
+ * Mark start of a named span in the current coroutine, such as
+ * "parse" or "sort". @a name should live until the export. Spans
+ * of a coroutine must nest, and they stay open while it is
+ * switched out.
+ */
+void
+coro_trace_begin(const char *name);
+
+/** Mark end of a span, started by coro_trace_begin(). */
+void
+coro_trace_end(const char *name);
+
+/**
+ * Write the recorded events to @a path in Chrome trace JSON
+ * format, which can be opened in chrome://tracing or Perfetto.
+ * Each coroutine is a separate track of "run" slices, and its
+ * spans are async events with the coroutine id. Only the time,
+ * which all the rings still have, is exported, and the ends of
+ * slices and spans, whose starts were overwritten, are dropped.
+ * Should be called when the coroutines are not running.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_trace_export(const char *path);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
 
-/** Free coroutine stack and it itself. */
+/**
+ * Free the coroutine. Its stack goes back to the stack pool to be
+ * reused by the next coroutines.
+ */
 void
 coro_delete(struct coro *c);
 
-/** Switch to another not finished coroutine. */
+/**
+ * Switch to the next ready coroutine. The current one goes to the
+ * end of the ready queue. If nobody else is ready, it is a no-op.
+ */
 void
 coro_yield(void);
+
+/**
+ * Suspend the current coroutine until somebody calls
+ * coro_wakeup() on it. Parked coroutines are not scheduled. A
+ * wakeup which came before the park is not lost - then the park
+ * returns immediately. So the return does not guarantee that the
+ * awaited event has happened, the caller should check it again.
+ */
+void
+coro_park(void);
+
+/**
+ * Put a parked coroutine back into its scheduler's ready queue.
+ * If the coroutine is not parked, its next coro_park() returns
+ * immediately. Can be called from any thread.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * True, if the current context is a coroutine, which can be
+ * parked - not the main context of a thread.
+ */
+bool
+coro_can_park(void);
+
+/** CLOCK_MONOTONIC time in nanoseconds - the clock of deadlines. */
+uint64_t
+coro_now_ns(void);
+
+/**
+ * Move the clock of coro_now_ns() @a ns nanoseconds forward, as if
+ * that much time has passed. The timers, which deadlines are
+ * passed, fire at the next switch. It is for tests of long
+ * timeouts and never goes back.
+ */
+void
+coro_clock_advance(uint64_t ns);
+
+/**
+ * Same as coro_park(), but the coroutine is woken up by its
+ * scheduler's timer wheel at @a deadline_ns at the latest. The
+ * caller tells a timeout from a wakeup by checking the time.
+ */
+void
+coro_park_until(uint64_t deadline_ns);
+
+/**
+ * Sleep until @a deadline_ns. A coroutine is parked and costs
+ * nothing; the main coroutine of a thread blocks the thread.
+ */
+void
+coro_sleep_until(uint64_t deadline_ns);
+
+/** Sleep for @a ns nanoseconds, like coro_sleep_until(). */
+void
+coro_sleep(uint64_t ns);
+
+/**
+ * Set by the current thread's quantum timer, when the running
+ * coroutine has worked for its time quantum. Reset by the next
+ * switch, which also starts a new quantum. Use
+ * coro_quantum_is_expired() and coro_maybe_yield().
+ */
+extern __thread volatile sig_atomic_t coro_quantum_expired;
+
+/**
+ * Enforce a time quantum of @a quantum_ns nanoseconds for all the
+ * coroutines, 0 to disable. It is at least CORO_QUANTUM_MIN_NS.
+ * Each scheduler thread gets its own timer which sets a flag, so
+ * checking the quantum costs a single memory load. The quanta are
+ * of the thread, not of a coroutine: a coroutine which is switched
+ * to before the quantum has expired gets the rest of it. Should be
+ * called before coro_sched_init() or coro_rt_new() - the timers
+ * are created along with schedulers.
+ */
+void
+coro_quantum_set(uint64_t quantum_ns);
+
+/** Check if the current coroutine has used up its quantum. */
+static inline bool
+coro_quantum_is_expired(void)
+{
+	return coro_quantum_expired != 0;
+}
+
+/** Yield, if the current coroutine has used up its quantum. */
+static inline void
+coro_maybe_yield(void)
+{
+	if (coro_quantum_expired != 0)
+		coro_yield();
+}
+
+/**
+ * Start an M:N runtime: @a thread_count worker threads, each with
+ * its own scheduler. Workers steal ready coroutines from each
+ * other, so a coroutine can continue in another thread after any
+ * yield. coro_this(), coro_yield() and other functions work in
+ * the coroutines as usual.
+ */
+struct coro_rt *
+coro_rt_new(int thread_count);
+
+int
+coro_rt_thread_count(const struct coro_rt *rt);
+
+/** Create a new coroutine in the runtime. Any thread can do it. */
+struct coro *
+coro_rt_spawn(struct coro_rt *rt, coro_f func, void *func_arg);
+
+/** Same as coro_rt_spawn(), with a stack size like coro_new_ex(). */
+struct coro *
+coro_rt_spawn_ex(struct coro_rt *rt, coro_f func, void *func_arg,
+		 size_t stack_size);
+
+/**
+ * Block until any coroutine of the runtime has finished. It is
+ * returned. NULL, if no coroutines.
+ */
+struct coro *
+coro_rt_wait(struct coro_rt *rt);
+
+/**
+ * Stop the workers and free the runtime. All its coroutines
+ * should be returned by coro_rt_wait() before.
+ */
+void
+coro_rt_delete(struct coro_rt *rt);
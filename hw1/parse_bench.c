@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "int_reader.h"
+
+/**
+ * Throughput benchmark of the input parsing. Compares the old
+ * two-pass fscanf() loading with the single-pass chunked and
+ * mmap loaders of int_reader, and checks that all of them get the
+ * same numbers. Each loader is run several times, the best time is
+ * taken, so the file is in the page cache.
+ *
+ * Build with -DCMAKE_BUILD_TYPE=Release to get meaningful numbers.
+ *
+ * $> python3 generator.py -f big.txt -c 10000000
+ * $> ./parse_bench big.txt [trials]
+ */
+
+static int64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** The loading, which was used before: count, rewind, parse. */
+static int
+bench_load_fscanf(struct int_array *arr, const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	size_t count = 0;
+	int tmp;
+	while (fscanf(fp, "%d", &tmp) == 1)
+		++count;
+	rewind(fp);
+	int_array_reserve(arr, count);
+	for (size_t i = 0; i < count; ++i) {
+		if (fscanf(fp, "%d", &arr->data[i]) != 1)
+			break;
+	}
+	arr->size = count;
+	fclose(fp);
+	return 0;
+}
+
+typedef int (*bench_load_f)(struct int_array *arr, const char *path);
+
+static void
+bench_run(const char *name, bench_load_f load, const char *path,
+	  size_t file_size, int trials, const struct int_array *expected)
+{
+	int64_t best = INT64_MAX;
+	struct int_array arr;
+	for (int i = 0; i < trials; ++i) {
+		int_array_create(&arr);
+		int64_t start = bench_now_ns();
+		if (load(&arr, path) != 0) {
+			perror("Error loading file");
+			exit(1);
+		}
+		int64_t ns = bench_now_ns() - start;
+		if (ns < best)
+			best = ns;
+		if (expected != NULL &&
+		    (arr.size != expected->size ||
+		     memcmp(arr.data, expected->data,
+			    arr.size * sizeof(arr.data[0])) != 0)) {
+			printf("%s: the numbers differ from fscanf\n", name);
+			exit(1);
+		}
+		int_array_destroy(&arr);
+	}
+	printf("%-8s %8.1f MB/s %8.1f ms\n", name,
+	       (double)file_size / best * 1000, (double)best / 1000000);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		printf("Usage: %s <file> [trials]\n", argv[0]);
+		return 1;
+	}
+	const char *path = argv[1];
+	int trials = argc > 2 ? atoi(argv[2]) : 5;
+	if (trials < 1)
+		trials = 1;
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		perror("Error opening file");
+		return 1;
+	}
+	struct int_array expected;
+	int_array_create(&expected);
+	if (bench_load_fscanf(&expected, path) != 0) {
+		perror("Error loading file");
+		return 1;
+	}
+	printf("%s: %lld bytes, %zu integers\n", path,
+	       (long long)st.st_size, expected.size);
+	bench_run("fscanf", bench_load_fscanf, path, st.st_size, trials,
+		  NULL);
+	bench_run("chunked", int_array_load, path, st.st_size, trials,
+		  &expected);
+	bench_run("mmap", int_array_load_mmap, path, st.st_size, trials,
+		  &expected);
+	int_array_destroy(&expected);
+	return 0;
+}
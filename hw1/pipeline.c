@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "pipeline.h"
+#include "coro_io.h"
+#include "coro_sync.h"
+#include "int_reader.h"
+#include "int_sort.h"
+#include "kmerge.h"
+#include "libcoro.h"
+
+void
+pipeline_create(struct pipeline *pl, size_t chunk_size, int parser_count,
+		int sorter_count, size_t queue_size, int fd,
+		enum int_writer_format format)
+{
+	pl->chunk_size = chunk_size;
+	pl->parsed = coro_chan_new(queue_size);
+	pl->sorted = coro_chan_new(queue_size);
+	pl->parsers_left = parser_count;
+	pl->sorters_left = sorter_count;
+	for (int i = 0; i < PIPELINE_LEVELS; ++i)
+		pl->level_sizes[i] = 0;
+	pl->fd = fd;
+	pl->format = format;
+	pl->error = 0;
+}
+
+void
+pipeline_destroy(struct pipeline *pl)
+{
+	coro_chan_delete(pl->parsed);
+	coro_chan_delete(pl->sorted);
+}
+
+static struct int_array *
+pipeline_chunk_new(struct pipeline *pl)
+{
+	struct int_array *chunk = malloc(sizeof(*chunk));
+	int_array_create(chunk);
+	int_array_reserve(chunk, pl->chunk_size);
+	return chunk;
+}
+
+static void
+pipeline_chunk_delete(struct int_array *chunk)
+{
+	int_array_destroy(chunk);
+	free(chunk);
+}
+
+int
+pipeline_parse_file(struct pipeline *pl, const char *path)
+{
+	int fd = coro_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	char *text = malloc(INT_READER_CHUNK_SIZE);
+	struct int_array *chunk = pipeline_chunk_new(pl);
+	struct int_parser p;
+	int_parser_create(&p);
+	off_t offset = 0;
+	int rc = 0;
+	while (true) {
+		ssize_t n = coro_pread(fd, text, INT_READER_CHUNK_SIZE, offset);
+		if (n < 0) {
+			rc = -1;
+			break;
+		}
+		if (n == 0)
+			break;
+		offset += n;
+		/* A piece can end several chunks, each is cut exactly. */
+		size_t pos = int_parser_feed_max(&p, text, n, chunk,
+						 pl->chunk_size);
+		while (chunk->size >= pl->chunk_size) {
+			coro_chan_send(pl->parsed, chunk);
+			chunk = pipeline_chunk_new(pl);
+			pos += int_parser_feed_max(&p, text + pos, n - pos,
+						   chunk, pl->chunk_size);
+		}
+		coro_maybe_yield();
+	}
+	int err = errno;
+	int_parser_finish(&p, chunk);
+	if (rc == 0 && chunk->size > 0)
+		coro_chan_send(pl->parsed, chunk);
+	else
+		pipeline_chunk_delete(chunk);
+	free(text);
+	close(fd);
+	errno = err;
+	return rc;
+}
+
+void
+pipeline_parser_done(struct pipeline *pl)
+{
+	if (__atomic_sub_fetch(&pl->parsers_left, 1, __ATOMIC_ACQ_REL) == 0)
+		coro_chan_close(pl->parsed);
+}
+
+static void
+pipeline_sort_yield(void *arg)
+{
+	(void)arg;
+	coro_maybe_yield();
+}
+
+int
+pipeline_sorter_f(void *arg)
+{
+	struct pipeline *pl = arg;
+	void *msg;
+	while (coro_chan_recv(pl->parsed, &msg) == 0) {
+		struct int_array *chunk = msg;
+		coro_trace_begin("sort");
+		int_sort_auto(chunk->data, chunk->size, pipeline_sort_yield,
+			      NULL);
+		coro_trace_end("sort");
+		coro_chan_send(pl->sorted, chunk);
+	}
+	if (__atomic_sub_fetch(&pl->sorters_left, 1, __ATOMIC_ACQ_REL) == 0)
+		coro_chan_close(pl->sorted);
+	return 0;
+}
+
+/** Set up merge sources over the runs. */
+static struct kmerge_run *
+pipeline_sources(struct int_array **runs, int count)
+{
+	struct kmerge_run *sources = calloc(count > 0 ? count : 1,
+					    sizeof(sources[0]));
+	for (int i = 0; i < count; ++i) {
+		sources[i].cur = runs[i]->data;
+		sources[i].end = runs[i]->data + runs[i]->size;
+	}
+	return sources;
+}
+
+/** Merge the runs of a full level into one run. */
+static struct int_array *
+pipeline_merge_level(struct int_array **runs, int count)
+{
+	size_t size = 0;
+	for (int i = 0; i < count; ++i)
+		size += runs[i]->size;
+	struct int_array *result = malloc(sizeof(*result));
+	int_array_create(result);
+	int_array_reserve(result, size);
+	struct kmerge_run *sources = pipeline_sources(runs, count);
+	struct kmerge m;
+	kmerge_create(&m, sources, count);
+	const int *block;
+	size_t len;
+	int *out = result->data;
+	while ((len = kmerge_next(&m, &block)) != 0) {
+		for (size_t i = 0; i < len; ++i)
+			out[i] = block[i];
+		out += len;
+		coro_maybe_yield();
+	}
+	result->size = size;
+	kmerge_destroy(&m);
+	free(sources);
+	for (int i = 0; i < count; ++i)
+		pipeline_chunk_delete(runs[i]);
+	return result;
+}
+
+/** Put the run to its level, merge the levels, which get full. */
+static void
+pipeline_add_run(struct pipeline *pl, struct int_array *run, int level)
+{
+	while (level < PIPELINE_LEVELS - 1 &&
+	       pl->level_sizes[level] == PIPELINE_FAN_IN - 1) {
+		pl->levels[level][PIPELINE_FAN_IN - 1] = run;
+		coro_trace_begin("merge");
+		run = pipeline_merge_level(pl->levels[level], PIPELINE_FAN_IN);
+		coro_trace_end("merge");
+		pl->level_sizes[level] = 0;
+		++level;
+	}
+	if (pl->level_sizes[level] == PIPELINE_FAN_IN) {
+		/* The last level is full - the input is really big. */
+		pl->levels[level][0] = pipeline_merge_level(pl->levels[level],
+							    PIPELINE_FAN_IN);
+		pl->level_sizes[level] = 1;
+	}
+	pl->levels[level][pl->level_sizes[level]++] = run;
+}
+
+int
+pipeline_merger_f(void *arg)
+{
+	struct pipeline *pl = arg;
+	void *msg;
+	while (coro_chan_recv(pl->sorted, &msg) == 0)
+		pipeline_add_run(pl, msg, 0);
+
+	/* The input is over, merge what is left into the output. */
+	coro_trace_begin("merge");
+	struct int_array *runs[PIPELINE_LEVELS * PIPELINE_FAN_IN];
+	int count = 0;
+	for (int level = 0; level < PIPELINE_LEVELS; ++level) {
+		for (int i = 0; i < pl->level_sizes[level]; ++i)
+			runs[count++] = pl->levels[level][i];
+		pl->level_sizes[level] = 0;
+	}
+	struct kmerge_run *sources = pipeline_sources(runs, count);
+	struct kmerge m;
+	kmerge_create(&m, sources, count);
+	struct int_writer w;
+	int_writer_create(&w, pl->fd, pl->format, 0);
+	const int *block;
+	size_t len;
+	while ((len = kmerge_next(&m, &block)) != 0) {
+		int_writer_put_array(&w, block, len);
+		coro_maybe_yield();
+	}
+	if (int_writer_destroy(&w) != 0)
+		pl->error = errno;
+	kmerge_destroy(&m);
+	free(sources);
+	for (int i = 0; i < count; ++i)
+		pipeline_chunk_delete(runs[i]);
+	coro_trace_end("merge");
+	return 0;
+}
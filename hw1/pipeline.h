@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include "int_writer.h"
+
+/**
+ * Pipelined sort of files: parse -> sort -> merge. Parsers cut the
+ * files into chunks and send them to the sorters, the sorted chunks
+ * go to the merger. The stages are connected by bounded channels,
+ * so a fast stage waits for a slow one instead of piling up chunks.
+ *
+ * The merger does not wait for the end of the input: runs are
+ * gathered into levels, and PIPELINE_FAN_IN runs of one level are
+ * merged into one run of the next level as soon as they are there.
+ * When the input is over, the few runs left are merged into the
+ * output.
+ */
+
+enum {
+	/** Default number of values in a chunk. */
+	PIPELINE_CHUNK_SIZE_DEFAULT = 1 << 18,
+	/** Runs of a level, which are merged together. */
+	PIPELINE_FAN_IN = 8,
+	/** Levels of runs, the last one is never merged early. */
+	PIPELINE_LEVELS = 16,
+};
+
+struct coro_chan;
+struct int_array;
+
+struct pipeline {
+	/** Values in a chunk. */
+	size_t chunk_size;
+	/** Parsed chunks, struct int_array. */
+	struct coro_chan *parsed;
+	/** Sorted runs, struct int_array. */
+	struct coro_chan *sorted;
+	/** The last parser and sorter close their output channels. */
+	int parsers_left;
+	int sorters_left;
+	/** Runs of the merger by levels. */
+	struct int_array *levels[PIPELINE_LEVELS][PIPELINE_FAN_IN];
+	int level_sizes[PIPELINE_LEVELS];
+	/** Where the merger writes the result. */
+	int fd;
+	enum int_writer_format format;
+	/** errno of a failed write of the merger, 0 if none. */
+	int error;
+};
+
+/**
+ * Create a pipeline, which writes into @a fd. Each channel takes up
+ * to @a queue_size chunks.
+ */
+void
+pipeline_create(struct pipeline *pl, size_t chunk_size, int parser_count,
+		int sorter_count, size_t queue_size, int fd,
+		enum int_writer_format format);
+
+void
+pipeline_destroy(struct pipeline *pl);
+
+/**
+ * Parse the file and send its chunks to the sorters. Called by the
+ * parser coroutines.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+pipeline_parse_file(struct pipeline *pl, const char *path);
+
+/** A parser has no more files. */
+void
+pipeline_parser_done(struct pipeline *pl);
+
+/** Coroutine body of a sorter, the argument is the pipeline. */
+int
+pipeline_sorter_f(void *arg);
+
+/** Coroutine body of the merger, the argument is the pipeline. */
+int
+pipeline_merger_f(void *arg);
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "pmerge.h"
+
+/** A part of the output, merged by one thread. */
+struct pmerge_slice {
+	const struct kmerge_run *runs;
+	int count;
+	/** Bounds of the slice in each run. */
+	const size_t *from;
+	const size_t *to;
+	int fd;
+	enum int_writer_format format;
+	/** Where the slice goes in the file, -1 for the file position. */
+	off_t offset;
+	/** Size of the slice in the file. */
+	uint64_t size;
+	/** errno of a failed write, 0 if none. */
+	int error;
+	pthread_t thread;
+};
+
+/** Count how many bytes the slice takes in the file. */
+static void *
+pmerge_measure_f(void *arg)
+{
+	struct pmerge_slice *s = arg;
+	s->size = 0;
+	for (int i = 0; i < s->count; ++i) {
+		const int *values = s->runs[i].cur;
+		if (s->format == INT_WRITER_BINARY) {
+			s->size += (s->to[i] - s->from[i]) * sizeof(int);
+			continue;
+		}
+		for (size_t j = s->from[i]; j < s->to[i]; ++j)
+			s->size += int_format_length(values[j]);
+	}
+	return NULL;
+}
+
+static void *
+pmerge_write_f(void *arg)
+{
+	struct pmerge_slice *s = arg;
+	struct kmerge_run *runs = calloc(s->count > 0 ? s->count : 1,
+					 sizeof(runs[0]));
+	for (int i = 0; i < s->count; ++i) {
+		runs[i].cur = s->runs[i].cur + s->from[i];
+		runs[i].end = s->runs[i].cur + s->to[i];
+	}
+	struct kmerge m;
+	kmerge_create(&m, runs, s->count);
+	struct int_writer w;
+	int_writer_create(&w, s->fd, s->format, 0);
+	if (s->offset >= 0)
+		int_writer_set_offset(&w, s->offset);
+	const int *block;
+	size_t len;
+	while ((len = kmerge_next(&m, &block)) != 0)
+		int_writer_put_array(&w, block, len);
+	s->error = int_writer_destroy(&w) == 0 ? 0 : errno;
+	kmerge_destroy(&m);
+	free(runs);
+	return NULL;
+}
+
+/** Run the function for all the slices, each in its own thread. */
+static void
+pmerge_run(struct pmerge_slice *slices, int slice_count,
+	   void *(*func)(void *))
+{
+	for (int i = 1; i < slice_count; ++i) {
+		errno = pthread_create(&slices[i].thread, NULL, func,
+				       &slices[i]);
+		if (errno != 0) {
+			printf("Error %s\n", strerror(errno));
+			exit(-1);
+		}
+	}
+	func(&slices[0]);
+	for (int i = 1; i < slice_count; ++i)
+		pthread_join(slices[i].thread, NULL);
+}
+
+int
+pmerge_write(const struct kmerge_run *runs, int count, int thread_count,
+	     int fd, enum int_writer_format format)
+{
+	size_t total = 0;
+	for (int i = 0; i < count; ++i)
+		total += runs[i].end - runs[i].cur;
+	int slice_count = thread_count;
+	if ((size_t)slice_count > total / PMERGE_SLICE_MIN)
+		slice_count = total / PMERGE_SLICE_MIN;
+	if (slice_count < 1)
+		slice_count = 1;
+
+	/* Slice j of the output is between the splits j and j + 1. */
+	size_t *splits = malloc((slice_count + 1) * (count > 0 ? count : 1) *
+				sizeof(splits[0]));
+	for (int j = 0; j <= slice_count; ++j) {
+		size_t *split = &splits[j * count];
+		if (j == 0) {
+			for (int i = 0; i < count; ++i)
+				split[i] = 0;
+		} else if (j == slice_count) {
+			for (int i = 0; i < count; ++i)
+				split[i] = runs[i].end - runs[i].cur;
+		} else {
+			kmerge_split(runs, count, total / slice_count * j,
+				     split);
+		}
+	}
+	struct pmerge_slice *slices = calloc(slice_count, sizeof(slices[0]));
+	for (int j = 0; j < slice_count; ++j) {
+		slices[j].runs = runs;
+		slices[j].count = count;
+		slices[j].from = &splits[j * count];
+		slices[j].to = &splits[(j + 1) * count];
+		slices[j].fd = fd;
+		slices[j].format = format;
+		slices[j].offset = -1;
+	}
+	if (slice_count > 1) {
+		if (format == INT_WRITER_TEXT) {
+			pmerge_run(slices, slice_count, pmerge_measure_f);
+		} else {
+			for (int j = 0; j < slice_count; ++j)
+				pmerge_measure_f(&slices[j]);
+		}
+		off_t offset = 0;
+		for (int j = 0; j < slice_count; ++j) {
+			slices[j].offset = offset;
+			offset += slices[j].size;
+		}
+	}
+	pmerge_run(slices, slice_count, pmerge_write_f);
+
+	int error = 0;
+	for (int j = 0; j < slice_count && error == 0; ++j)
+		error = slices[j].error;
+	free(slices);
+	free(splits);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
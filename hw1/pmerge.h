@@ -0,0 +1,28 @@
+#pragma once
+
+#include "int_writer.h"
+#include "kmerge.h"
+
+/**
+ * Parallel merge into a file. The output is cut into equal slices
+ * by kmerge_split(), each slice is merged by its own thread and
+ * written with pwrite() at its offset. In the binary format the
+ * offsets are known right away, for text each thread counts the
+ * size of its slice first.
+ */
+
+enum {
+	/** Slices are not made smaller than that number of values. */
+	PMERGE_SLICE_MIN = 1 << 16,
+};
+
+/**
+ * Merge in-memory runs into @a fd by @a thread_count threads.
+ * With one thread, or a small input, everything is done in the
+ * calling thread.
+ * @retval 0 Success.
+ * @retval -1 A write has failed, errno is set.
+ */
+int
+pmerge_write(const struct kmerge_run *runs, int count, int thread_count,
+	     int fd, enum int_writer_format format);
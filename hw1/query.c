@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <string.h>
+#include "query.h"
+#include "kmerge.h"
+
+size_t
+query_size(const struct kmerge_run *runs, int count)
+{
+	size_t size = 0;
+	for (int i = 0; i < count; ++i)
+		size += runs[i].end - runs[i].cur;
+	return size;
+}
+
+size_t
+query_top_k(const struct kmerge_run *runs, int count, size_t k, int *out)
+{
+	size_t size = query_size(runs, count);
+	if (k > size)
+		k = size;
+	if (k == 0)
+		return 0;
+	/* Merge only the prefixes, which go before the rank k. */
+	size_t *split = malloc(count * sizeof(split[0]));
+	kmerge_split(runs, count, k, split);
+	struct kmerge_run *prefixes = calloc(count, sizeof(prefixes[0]));
+	for (int i = 0; i < count; ++i) {
+		prefixes[i].cur = runs[i].cur;
+		prefixes[i].end = runs[i].cur + split[i];
+	}
+	struct kmerge m;
+	kmerge_create(&m, prefixes, count);
+	const int *block;
+	size_t len;
+	size_t done = 0;
+	while ((len = kmerge_next(&m, &block)) != 0) {
+		memcpy(out + done, block, len * sizeof(int));
+		done += len;
+	}
+	kmerge_destroy(&m);
+	free(prefixes);
+	free(split);
+	return done;
+}
+
+int
+query_select(const struct kmerge_run *runs, int count, size_t rank)
+{
+	size_t *split = malloc(count * sizeof(split[0]));
+	kmerge_split(runs, count, rank, split);
+	/* The value is the biggest one before the split point. */
+	int value = 0;
+	bool is_found = false;
+	for (int i = 0; i < count; ++i) {
+		if (split[i] == 0)
+			continue;
+		int last = runs[i].cur[split[i] - 1];
+		if (!is_found || last > value)
+			value = last;
+		is_found = true;
+	}
+	free(split);
+	return value;
+}
+
+int
+query_percentile(const struct kmerge_run *runs, int count, double percent)
+{
+	size_t size = query_size(runs, count);
+	/*
+	 * Percents like 99.9 are not exact in binary, so the product
+	 * can be a bit above an integer rank, which it really is.
+	 */
+	double exact = percent * size / 100 * (1 - 1e-12);
+	size_t rank = (size_t)exact;
+	if (rank < exact)
+		++rank;
+	if (rank < 1)
+		rank = 1;
+	if (rank > size)
+		rank = size;
+	return query_select(runs, count, rank);
+}
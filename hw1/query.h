@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Queries over sorted runs in memory, which don't merge them. The
+ * rank of a value is found by kmerge_split() - a binary search over
+ * the value range, which takes O(k log N) per step for k runs, so
+ * a percentile costs about the same for any size of the input, and
+ * the smallest values are merged only from the prefixes of the runs,
+ * where they are.
+ */
+
+struct kmerge_run;
+
+/** Number of values in the runs. */
+size_t
+query_size(const struct kmerge_run *runs, int count);
+
+/**
+ * Put the @a k smallest values into @a out in ascending order.
+ * @return Number of values put, less than @a k if there are less.
+ */
+size_t
+query_top_k(const struct kmerge_run *runs, int count, size_t k, int *out);
+
+/** The value of the @a rank-th smallest, 1 <= @a rank <= size. */
+int
+query_select(const struct kmerge_run *runs, int count, size_t rank);
+
+/**
+ * The nearest-rank percentile, 0 <= @a percent <= 100, the runs
+ * must not be empty.
+ */
+int
+query_percentile(const struct kmerge_run *runs, int count, double percent);
@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "run_cache.h"
+#include "run_file.h"
+#include "coro_io.h"
+#include "int_reader.h"
+#include "libcoro.h"
+
+#define RUN_CACHE_MANIFEST "manifest"
+#define RUN_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+#define RUN_CACHE_HASH_PRIME 0x100000001b3ULL
+
+static int64_t
+run_cache_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** FNV-1a over 64-bit words, the tail is taken as one more word. */
+static uint64_t
+run_cache_hash(uint64_t hash, const void *buf, size_t size)
+{
+	const char *pos = buf;
+	for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, pos, sizeof(word));
+		hash = (hash ^ word) * RUN_CACHE_HASH_PRIME;
+		pos += sizeof(word);
+	}
+	if (size > 0) {
+		uint64_t word = 0;
+		memcpy(&word, pos, size);
+		hash = (hash ^ word) * RUN_CACHE_HASH_PRIME;
+	}
+	return hash;
+}
+
+/** Hash of the content of the file. */
+static int
+run_cache_hash_file(const char *path, uint64_t *result)
+{
+	int fd = coro_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	/* The pieces are whole words, only the last one has a tail. */
+	char *buf = malloc(INT_READER_CHUNK_SIZE);
+	uint64_t hash = RUN_CACHE_HASH_INIT;
+	uint64_t size = 0;
+	int rc = 0;
+	while (true) {
+		ssize_t n = coro_pread(fd, buf, INT_READER_CHUNK_SIZE, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			rc = -1;
+			break;
+		}
+		if (n == 0)
+			break;
+		hash = run_cache_hash(hash, buf, n);
+		size += n;
+		coro_maybe_yield();
+	}
+	int err = errno;
+	free(buf);
+	close(fd);
+	errno = err;
+	*result = (hash ^ size) * RUN_CACHE_HASH_PRIME;
+	return rc;
+}
+
+/** Path of a file of the cache directory, to be freed. */
+static char *
+run_cache_path(const struct run_cache *c, const char *name)
+{
+	size_t len = strlen(c->dir) + strlen(name) + 2;
+	char *path = malloc(len);
+	snprintf(path, len, "%s/%s", c->dir, name);
+	return path;
+}
+
+/** Path of the run of the content with that hash, to be freed. */
+static char *
+run_cache_run_path(const struct run_cache *c, uint64_t hash)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016" PRIx64 ".run", hash);
+	return run_cache_path(c, name);
+}
+
+/** Entry of the input path, NULL if there is none. */
+static struct run_cache_key *
+run_cache_find(struct run_cache *c, const char *path)
+{
+	for (int i = 0; i < c->entry_count; ++i) {
+		if (strcmp(c->entries[i].path, path) == 0)
+			return &c->entries[i];
+	}
+	return NULL;
+}
+
+/** Add the entry of the input or replace the old one. */
+static void
+run_cache_add_entry(struct run_cache *c, const struct run_cache_key *key)
+{
+	pthread_mutex_lock(&c->lock);
+	struct run_cache_key *entry = run_cache_find(c, key->path);
+	if (entry == NULL) {
+		if (c->entry_count == c->entry_capacity) {
+			c->entry_capacity = c->entry_capacity * 2 + 8;
+			c->entries = realloc(c->entries, c->entry_capacity *
+					     sizeof(c->entries[0]));
+		}
+		entry = &c->entries[c->entry_count++];
+		entry->path = strdup(key->path);
+	}
+	entry->size = key->size;
+	entry->mtime_ns = key->mtime_ns;
+	entry->hash = key->hash;
+	entry->time_ns = key->time_ns;
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void
+run_cache_clear(struct run_cache *c)
+{
+	for (int i = 0; i < c->entry_count; ++i)
+		free(c->entries[i].path);
+	c->entry_count = 0;
+	free(c->output.path);
+	c->output.path = NULL;
+}
+
+/**
+ * Parse a record of the manifest:
+ *
+ *   file <size> <mtime> <hash> <time> <path>
+ *   output <size> <mtime> <inputs hash> <time> <path>
+ */
+static int
+run_cache_parse_record(struct run_cache *c, const char *line)
+{
+	char kind[8];
+	struct run_cache_key key;
+	int pos = -1;
+	if (sscanf(line, "%7s %" SCNu64 " %" SCNd64 " %" SCNx64 " %" SCNd64
+		   " %n", kind, &key.size, &key.mtime_ns, &key.hash,
+		   &key.time_ns, &pos) != 5 || pos < 0 || line[pos] == 0)
+		return -1;
+	key.path = (char *)line + pos;
+	if (strcmp(kind, "file") == 0) {
+		run_cache_add_entry(c, &key);
+		return 0;
+	}
+	if (strcmp(kind, "output") != 0)
+		return -1;
+	free(c->output.path);
+	c->output = key;
+	c->output.path = strdup(key.path);
+	c->output_inputs = key.hash;
+	return 0;
+}
+
+/** Load the manifest, if there is a good one. */
+static void
+run_cache_load(struct run_cache *c)
+{
+	char *path = run_cache_path(c, RUN_CACHE_MANIFEST);
+	FILE *f = fopen(path, "r");
+	free(path);
+	if (f == NULL)
+		return;
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t len;
+	int version = 0;
+	if (getline(&line, &capacity, f) < 0 ||
+	    sscanf(line, "run_cache %d", &version) != 1)
+		version = 0;
+	while (version == RUN_CACHE_VERSION &&
+	       (len = getline(&line, &capacity, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = 0;
+		if (run_cache_parse_record(c, line) != 0) {
+			/* A broken manifest - start from scratch. */
+			run_cache_clear(c);
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+int
+run_cache_open(struct run_cache *c, const char *dir)
+{
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		return -1;
+	c->dir = strdup(dir);
+	c->entries = NULL;
+	c->entry_count = 0;
+	c->entry_capacity = 0;
+	c->output.path = NULL;
+	c->output_inputs = 0;
+	pthread_mutex_init(&c->lock, NULL);
+	run_cache_load(c);
+	return 0;
+}
+
+void
+run_cache_close(struct run_cache *c)
+{
+	run_cache_clear(c);
+	free(c->entries);
+	free(c->dir);
+	pthread_mutex_destroy(&c->lock);
+}
+
+static bool
+run_cache_is_used(const struct run_cache *c, uint64_t hash)
+{
+	for (int i = 0; i < c->entry_count; ++i) {
+		if (c->entries[i].hash == hash)
+			return true;
+	}
+	return false;
+}
+
+/** Remove the runs of the contents, which no input has anymore. */
+static void
+run_cache_collect(struct run_cache *c)
+{
+	DIR *d = opendir(c->dir);
+	if (d == NULL)
+		return;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		uint64_t hash;
+		int len = -1;
+		if (sscanf(de->d_name, "%16" SCNx64 ".run%n", &hash, &len) != 1 ||
+		    len != 20 || de->d_name[len] != 0 ||
+		    run_cache_is_used(c, hash))
+			continue;
+		char *path = run_cache_path(c, de->d_name);
+		unlink(path);
+		free(path);
+	}
+	closedir(d);
+}
+
+static void
+run_cache_write_record(FILE *f, const char *kind,
+		       const struct run_cache_key *key, uint64_t hash)
+{
+	/* The records are lines, such a path can't be stored. */
+	if (strchr(key->path, '\n') != NULL)
+		return;
+	fprintf(f, "%s %" PRIu64 " %" PRId64 " %016" PRIx64 " %" PRId64
+		" %s\n", kind, key->size, key->mtime_ns, hash, key->time_ns,
+		key->path);
+}
+
+/** Write the manifest into the file. */
+static int
+run_cache_write(struct run_cache *c, int fd)
+{
+	FILE *f = fdopen(fd, "w");
+	if (f == NULL) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	fprintf(f, "run_cache %d\n", RUN_CACHE_VERSION);
+	for (int i = 0; i < c->entry_count; ++i) {
+		run_cache_write_record(f, "file", &c->entries[i],
+				       c->entries[i].hash);
+	}
+	if (c->output.path != NULL) {
+		run_cache_write_record(f, "output", &c->output,
+				       c->output_inputs);
+	}
+	bool is_failed = ferror(f);
+	if (fclose(f) != 0 || is_failed)
+		return -1;
+	return 0;
+}
+
+int
+run_cache_save(struct run_cache *c)
+{
+	/* The new manifest replaces the old one at once. */
+	char *tmp = run_cache_path(c, RUN_CACHE_MANIFEST ".XXXXXX");
+	char *path = run_cache_path(c, RUN_CACHE_MANIFEST);
+	int fd = mkstemp(tmp);
+	int rc = fd < 0 ? -1 : run_cache_write(c, fd);
+	if (rc == 0)
+		rc = rename(tmp, path);
+	int err = errno;
+	if (fd >= 0 && rc != 0)
+		unlink(tmp);
+	free(tmp);
+	free(path);
+	errno = err;
+	if (rc == 0)
+		run_cache_collect(c);
+	return rc;
+}
+
+/** Take the stat part of the identity, the path is taken already. */
+static int
+run_cache_stat(struct run_cache_key *key)
+{
+	/* The time goes first, a change after the stat must be newer. */
+	key->time_ns = run_cache_now_ns();
+	struct stat st;
+	if (stat(key->path, &st) != 0)
+		return -1;
+	key->size = st.st_size;
+	key->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+			st.st_mtim.tv_nsec;
+	return 0;
+}
+
+/** True, if the record can vouch for the content by size and mtime. */
+static bool
+run_cache_is_same(const struct run_cache_key *record,
+		  const struct run_cache_key *key)
+{
+	return record->size == key->size &&
+	       record->mtime_ns == key->mtime_ns &&
+	       record->time_ns - record->mtime_ns >= RUN_CACHE_RACY_NS;
+}
+
+int
+run_cache_key_create(struct run_cache *c, struct run_cache_key *key,
+		     const char *path)
+{
+	key->path = realpath(path, NULL);
+	if (key->path == NULL)
+		return -1;
+	if (run_cache_stat(key) == 0) {
+		pthread_mutex_lock(&c->lock);
+		struct run_cache_key *entry = run_cache_find(c, key->path);
+		bool is_same = entry != NULL && run_cache_is_same(entry, key);
+		if (is_same)
+			key->hash = entry->hash;
+		pthread_mutex_unlock(&c->lock);
+		if (is_same || run_cache_hash_file(key->path, &key->hash) == 0)
+			return 0;
+	}
+	int err = errno;
+	free(key->path);
+	key->path = NULL;
+	errno = err;
+	return -1;
+}
+
+void
+run_cache_key_destroy(struct run_cache_key *key)
+{
+	free(key->path);
+}
+
+int
+run_cache_get(struct run_cache *c, const struct run_cache_key *key,
+	      struct run_file *rf)
+{
+	char *path = run_cache_run_path(c, key->hash);
+	int rc = run_file_open(rf, path);
+	free(path);
+	if (rc != 0)
+		return -1;
+	if (!run_file_check(rf)) {
+		run_file_close(rf);
+		return -1;
+	}
+	/* The run may be of another file with the same content. */
+	run_cache_add_entry(c, key);
+	return 0;
+}
+
+/** Write the values into a run file. */
+static int
+run_cache_write_run(int fd, const int *values, size_t count)
+{
+	struct run_file_writer wr;
+	run_file_writer_create(&wr, fd, 0);
+	run_file_writer_put_array(&wr, values, count);
+	int rc = run_file_writer_destroy(&wr);
+	int err = errno;
+	close(fd);
+	errno = err;
+	return rc;
+}
+
+int
+run_cache_put(struct run_cache *c, const struct run_cache_key *key,
+	      const int *values, size_t count)
+{
+	/* The run appears under its name only when it is complete. */
+	char *tmp = run_cache_path(c, "run.XXXXXX");
+	char *path = run_cache_run_path(c, key->hash);
+	int fd = mkstemp(tmp);
+	int rc = fd < 0 ? -1 : run_cache_write_run(fd, values, count);
+	if (rc == 0)
+		rc = rename(tmp, path);
+	int err = errno;
+	if (fd >= 0 && rc != 0)
+		unlink(tmp);
+	free(tmp);
+	free(path);
+	errno = err;
+	if (rc == 0)
+		run_cache_add_entry(c, key);
+	return rc;
+}
+
+/** Hash of the identities of the inputs, in their order. */
+static int
+run_cache_hash_inputs(struct run_cache *c, char **paths, int count,
+		      uint64_t *result)
+{
+	uint64_t hash = RUN_CACHE_HASH_INIT;
+	for (int i = 0; i < count; ++i) {
+		struct run_cache_key key;
+		if (run_cache_key_create(c, &key, paths[i]) != 0)
+			return -1;
+		hash = run_cache_hash(hash, &key.hash, sizeof(key.hash));
+		hash = run_cache_hash(hash, key.path, strlen(key.path) + 1);
+		run_cache_key_destroy(&key);
+	}
+	*result = hash;
+	return 0;
+}
+
+bool
+run_cache_output_is_fresh(struct run_cache *c, char **paths, int count,
+			  const char *output)
+{
+	if (c->output.path == NULL)
+		return false;
+	struct run_cache_key key;
+	key.path = realpath(output, NULL);
+	if (key.path == NULL)
+		return false;
+	/*
+	 * The output is stat'ed right after it is written, and only
+	 * this program writes it, so its mtime is enough.
+	 */
+	bool is_fresh = strcmp(key.path, c->output.path) == 0 &&
+			run_cache_stat(&key) == 0 &&
+			key.size == c->output.size &&
+			key.mtime_ns == c->output.mtime_ns;
+	run_cache_key_destroy(&key);
+	uint64_t inputs;
+	return is_fresh && run_cache_hash_inputs(c, paths, count, &inputs) == 0 &&
+	       inputs == c->output_inputs;
+}
+
+int
+run_cache_set_output(struct run_cache *c, char **paths, int count,
+		     const char *output)
+{
+	uint64_t inputs;
+	if (run_cache_hash_inputs(c, paths, count, &inputs) != 0)
+		return -1;
+	struct run_cache_key key;
+	key.path = realpath(output, NULL);
+	if (key.path == NULL)
+		return -1;
+	if (run_cache_stat(&key) != 0) {
+		int err = errno;
+		run_cache_key_destroy(&key);
+		errno = err;
+		return -1;
+	}
+	key.hash = 0;
+	free(c->output.path);
+	c->output = key;
+	c->output_inputs = inputs;
+	return 0;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Persistent cache of sorted runs between runs of the program. The
+ * sorted values of each input file are kept in the cache directory
+ * as a run file (see run_file.h), named by the content hash of the
+ * input. The manifest file of the directory maps the input paths to
+ * their size, mtime and content hash, and remembers the last merged
+ * output with the inputs it was merged from.
+ *
+ * An input is taken as unchanged by its size and mtime, like make
+ * does, and its content is hashed only when they differ or are too
+ * close to the time they were recorded - a file could be changed
+ * within one tick of the clock and keep its mtime.
+ */
+
+enum {
+	RUN_CACHE_VERSION = 1,
+};
+
+/** Changes within this time of the record are not seen by mtime. */
+#define RUN_CACHE_RACY_NS 1000000000LL
+
+/** Identity of an input file. */
+struct run_cache_key {
+	/** The real path. */
+	char *path;
+	uint64_t size;
+	int64_t mtime_ns;
+	/** Hash of the content. */
+	uint64_t hash;
+	/** When the identity was taken. */
+	int64_t time_ns;
+};
+
+struct run_cache {
+	char *dir;
+	/** Inputs, which have a run in the cache. */
+	struct run_cache_key *entries;
+	int entry_count;
+	int entry_capacity;
+	/** The last merged output, path is NULL if there is none. */
+	struct run_cache_key output;
+	/** Hash of the inputs of the output. */
+	uint64_t output_inputs;
+	/** Files are looked up and added from several threads. */
+	pthread_mutex_t lock;
+};
+
+/**
+ * Open the cache in @a dir, create the directory if there is none.
+ * A missing or malformed manifest gives an empty cache.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+run_cache_open(struct run_cache *c, const char *dir);
+
+void
+run_cache_close(struct run_cache *c);
+
+/**
+ * Write the manifest and remove the runs, which are not used by
+ * any entry.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+run_cache_save(struct run_cache *c);
+
+/**
+ * Take the identity of the file. The content is read only when the
+ * entry of the file can't vouch for it.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+run_cache_key_create(struct run_cache *c, struct run_cache_key *key,
+		     const char *path);
+
+void
+run_cache_key_destroy(struct run_cache_key *key);
+
+struct run_file;
+
+/**
+ * Map the cached run of the file with that identity and check it.
+ * @retval 0 Found.
+ * @retval -1 No valid run in the cache.
+ */
+int
+run_cache_get(struct run_cache *c, const struct run_cache_key *key,
+	      struct run_file *rf);
+
+/**
+ * Store the sorted values of the file with that identity.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+run_cache_put(struct run_cache *c, const struct run_cache_key *key,
+	      const int *values, size_t count);
+
+/**
+ * True, if the file at @a output is the last merged output, it was
+ * not changed since then, and it was merged from these inputs, which
+ * were not changed either.
+ */
+bool
+run_cache_output_is_fresh(struct run_cache *c, char **paths, int count,
+			  const char *output);
+
+/**
+ * Remember the file at @a output as merged from these inputs.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+run_cache_set_output(struct run_cache *c, char **paths, int count,
+		     const char *output);
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "run_file.h"
+#include "coro_io.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Run files are mapped as they are, only little-endian hosts are supported"
+#endif
+
+_Static_assert(sizeof(struct run_file_header) == 64,
+	       "The header is a part of the file format");
+
+uint64_t
+run_file_checksum(uint64_t checksum, const int *values, size_t count)
+{
+	/* FNV-1a over 32-bit words. */
+	for (size_t i = 0; i < count; ++i) {
+		checksum ^= (uint32_t)values[i];
+		checksum *= 0x100000001b3ULL;
+	}
+	return checksum;
+}
+
+void
+run_file_writer_create(struct run_file_writer *wr, int fd,
+		       size_t index_step)
+{
+	memset(&wr->header, 0, sizeof(wr->header));
+	wr->header.magic = RUN_FILE_MAGIC;
+	wr->header.version = RUN_FILE_VERSION;
+	wr->header.checksum = RUN_FILE_CHECKSUM_INIT;
+	wr->header.index_step = index_step != 0 ? index_step :
+				RUN_FILE_INDEX_STEP_DEFAULT;
+	wr->index = NULL;
+	wr->index_capacity = 0;
+	int_writer_create(&wr->w, fd, INT_WRITER_BINARY, 0);
+	/* The header is written at the end, when it is known. */
+	int_writer_set_offset(&wr->w, sizeof(wr->header));
+}
+
+void
+run_file_writer_put_array(struct run_file_writer *wr, const int *values,
+			  size_t count)
+{
+	if (count == 0)
+		return;
+	struct run_file_header *h = &wr->header;
+	if (h->count == 0)
+		h->min = values[0];
+	h->max = values[count - 1];
+	h->checksum = run_file_checksum(h->checksum, values, count);
+	/* The index takes the values at multiples of the step. */
+	uint64_t pos = (h->count + h->index_step - 1) / h->index_step *
+		       h->index_step;
+	for (; pos < h->count + count; pos += h->index_step) {
+		if (h->index_count == wr->index_capacity) {
+			wr->index_capacity = wr->index_capacity * 2 + 64;
+			wr->index = realloc(wr->index, wr->index_capacity *
+					    sizeof(wr->index[0]));
+		}
+		wr->index[h->index_count++] = values[pos - h->count];
+	}
+	h->count += count;
+	int_writer_put_array(&wr->w, values, count);
+}
+
+int
+run_file_writer_destroy(struct run_file_writer *wr)
+{
+	struct run_file_header *h = &wr->header;
+	h->index_offset = sizeof(*h) + h->count * sizeof(int);
+	int_writer_put_array(&wr->w, wr->index, h->index_count);
+	int fd = wr->w.fd;
+	int rc = int_writer_destroy(&wr->w);
+	free(wr->index);
+	if (rc != 0)
+		return -1;
+	const char *pos = (const char *)h;
+	size_t size = sizeof(*h);
+	off_t offset = 0;
+	while (size > 0) {
+		ssize_t n = coro_pwrite(fd, pos, size, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		pos += n;
+		size -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+int
+run_file_open(struct run_file *rf, const char *path)
+{
+	int fd = coro_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	size_t size = st.st_size;
+	if (size < sizeof(struct run_file_header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno = err;
+		return -1;
+	}
+	const struct run_file_header *h = map;
+	size_t payload_end = sizeof(*h) + h->count * sizeof(int);
+	if (h->magic != RUN_FILE_MAGIC || h->version != RUN_FILE_VERSION ||
+	    h->index_step == 0 || h->count > size / sizeof(int) ||
+	    h->index_offset != payload_end ||
+	    h->index_count != (h->count + h->index_step - 1) / h->index_step ||
+	    size != payload_end + h->index_count * sizeof(int)) {
+		munmap(map, size);
+		errno = EINVAL;
+		return -1;
+	}
+	rf->header = h;
+	rf->data = (const int *)(h + 1);
+	rf->count = h->count;
+	rf->index = (const int *)((const char *)map + h->index_offset);
+	rf->index_count = h->index_count;
+	rf->index_step = h->index_step;
+	rf->map = map;
+	rf->map_size = size;
+	return 0;
+}
+
+void
+run_file_close(struct run_file *rf)
+{
+	munmap(rf->map, rf->map_size);
+}
+
+bool
+run_file_check(const struct run_file *rf)
+{
+	uint64_t checksum = run_file_checksum(RUN_FILE_CHECKSUM_INIT, rf->data,
+					      rf->count);
+	return checksum == rf->header->checksum;
+}
+
+/**
+ * First position in [lo, hi), where the value is not less than
+ * @a key, or greater than it, if @a is_upper.
+ */
+static size_t
+run_file_search(const int *values, size_t lo, size_t hi, int key,
+		bool is_upper)
+{
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (values[mid] < key || (is_upper && values[mid] == key))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/** Search the index for the block, then the block for the value. */
+static size_t
+run_file_bound(const struct run_file *rf, int key, bool is_upper)
+{
+	size_t block = run_file_search(rf->index, 0, rf->index_count, key,
+				       is_upper);
+	/* The position is after the previous indexed value. */
+	size_t lo = block > 0 ? (block - 1) * rf->index_step + 1 : 0;
+	size_t hi = block * rf->index_step;
+	if (hi > rf->count)
+		hi = rf->count;
+	return run_file_search(rf->data, lo, hi, key, is_upper);
+}
+
+size_t
+run_file_lower_bound(const struct run_file *rf, int key)
+{
+	return run_file_bound(rf, key, false);
+}
+
+size_t
+run_file_upper_bound(const struct run_file *rf, int key)
+{
+	return run_file_bound(rf, key, true);
+}
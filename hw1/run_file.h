@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "int_writer.h"
+
+/**
+ * File format of a sorted run:
+ *
+ *   header    64 bytes, struct run_file_header
+ *   payload   count values, little-endian int32
+ *   index     every index_step-th value of the payload
+ *
+ * The file is used by mmap() as it is: the payload is a sorted
+ * array, which can be merged right away, and a lookup searches the
+ * index first, so only one index_step block of the payload is
+ * touched.
+ */
+
+enum {
+	/** "SRUN" in the file. */
+	RUN_FILE_MAGIC = 0x4e555253,
+	RUN_FILE_VERSION = 1,
+	/** Default distance between the values of the index. */
+	RUN_FILE_INDEX_STEP_DEFAULT = 1 << 10,
+};
+
+/** Checksum of no values. */
+#define RUN_FILE_CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+struct run_file_header {
+	uint32_t magic;
+	uint32_t version;
+	/** Number of values. */
+	uint64_t count;
+	/** The first and the last value, 0 if there are none. */
+	int32_t min;
+	int32_t max;
+	/** run_file_checksum() of the payload. */
+	uint64_t checksum;
+	uint32_t index_step;
+	uint32_t reserved;
+	/** Where the index starts in the file. */
+	uint64_t index_offset;
+	uint64_t index_count;
+	uint64_t padding;
+};
+
+/** Writer of a run file, the values come in blocks. */
+struct run_file_writer {
+	struct int_writer w;
+	struct run_file_header header;
+	int *index;
+	size_t index_capacity;
+};
+
+/** A run file, opened for reading. */
+struct run_file {
+	const struct run_file_header *header;
+	const int *data;
+	size_t count;
+	const int *index;
+	size_t index_count;
+	size_t index_step;
+	/** The mapping of the whole file. */
+	void *map;
+	size_t map_size;
+};
+
+/**
+ * Checksum of @a count values, continued from @a checksum of the
+ * previous ones, or from RUN_FILE_CHECKSUM_INIT.
+ */
+uint64_t
+run_file_checksum(uint64_t checksum, const int *values, size_t count);
+
+/**
+ * Start writing a run into @a fd from the file start. @a index_step
+ * 0 means the default.
+ */
+void
+run_file_writer_create(struct run_file_writer *wr, int fd,
+		       size_t index_step);
+
+/** Append sorted values. */
+void
+run_file_writer_put_array(struct run_file_writer *wr, const int *values,
+			  size_t count);
+
+/**
+ * Write the index and the header.
+ * @retval 0 Success.
+ * @retval -1 Error of any write, errno is set.
+ */
+int
+run_file_writer_destroy(struct run_file_writer *wr);
+
+/**
+ * Map a run file and check its header.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. EINVAL - not a run file.
+ */
+int
+run_file_open(struct run_file *rf, const char *path);
+
+void
+run_file_close(struct run_file *rf);
+
+/** True, if the payload matches the checksum of the header. */
+bool
+run_file_check(const struct run_file *rf);
+
+/** Position of the first value, which is not less than @a key. */
+size_t
+run_file_lower_bound(const struct run_file *rf, int key);
+
+/** Position of the first value, which is greater than @a key. */
+size_t
+run_file_upper_bound(const struct run_file *rf, int key);
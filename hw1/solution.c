@@ -2,11 +2,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include "libcoro.h"
+#include "coro_io.h"
+#include "int_reader.h"
+#include "int_writer.h"
+#include "int_sort.h"
+#include "kmerge.h"
+#include "pmerge.h"
+#include "extsort.h"
+#include "pipeline.h"
+#include "run_file.h"
+#include "run_cache.h"
+#include "query.h"
+#include "thread_pool.h"
 #include <time.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 //DEBUG
 //_________________________
@@ -29,7 +45,7 @@
  * WITH CHECK_LEAKS = 1
  * You can compile and run this code using the commands:
  *
- * $> gcc ./utils/heap_help/heap_help.c libcoro.c solution.c
+ * $> gcc ./utils/heap_help/heap_help.c libcoro.c coro_sync.c coro_io.c int_reader.c int_writer.c int_sort.c kmerge.c pmerge.c extsort.c pipeline.c run_file.c run_cache.c query.c ../hw4/thread_pool.c solution.c -I../hw4 -pthread
  * $> HHREPORT=v ./a.out 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
  * $> HHREPORT=l ./a.out 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
  */
@@ -38,11 +54,123 @@
  * Base running
  * You can compile and run this code using the commands:
  *
- * $> gcc libcoro.c solution.c
+ * $> gcc libcoro.c coro_sync.c coro_io.c int_reader.c int_writer.c int_sort.c kmerge.c pmerge.c extsort.c pipeline.c run_file.c run_cache.c query.c ../hw4/thread_pool.c solution.c -I../hw4 -pthread
  * $> ./a.out 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
  * $> ./a.out 100 6 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
  */
 
+/**
+ * Multithreaded running
+ * With -j <threads> the coroutines are run by an M:N runtime of libcoro
+ * on several threads, which steal coroutines from each other:
+ *
+ * $> ./a.out -j 4 100 8 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ *
+ * With -T <pool_threads> the files are sorted on the thread pool of hw4 instead.
+ * Each thread of the pool runs its own scheduler with <coroutines_num> coroutines,
+ * which take the files one by one, so there are threads x coroutines in total:
+ *
+ * $> ./a.out -T 4 100 2 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ *
+ * The files are taken the biggest first. With several threads a file much bigger
+ * than the others is split into byte ranges, which are sorted by different
+ * coroutines, so the threads get about the same amount of work.
+ *
+ * The final merge is done by the same number of threads, each merges its own
+ * slice of the output. With -p <merge_threads> it can be set separately:
+ *
+ * $> ./a.out -p 4 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ */
+
+/**
+ * Time quantum
+ * Each coroutine works for target_latency / coroutines_num, then yields.
+ * libcoro does not make a quantum shorter than CORO_QUANTUM_MIN_NS (50 us),
+ * the threads would do nothing but handle the timer signals. A smaller
+ * quantum is raised to it with a warning, and the latency becomes
+ * coroutines_num * 50 us - for example 150 us instead of 100 us with 3
+ * coroutines:
+ *
+ * $> ./a.out 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ * Warning: time quantum 33 us is below the minimum, 50 us is used
+ */
+
+/**
+ * Statistics
+ * With -s libcoro accounts every switch: the work time of the coroutines is
+ * taken from it, along with the time they waited for their turn, and the
+ * histograms of the time slices and the switch latencies are printed at the
+ * end. It reads the clock on each switch, so it is off by default:
+ *
+ * $> ./a.out -s 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ */
+
+/**
+ * Tracing
+ * With -t <trace.json> the scheduling timeline of all coroutines, and parse/sort/merge
+ * spans, are saved in Chrome trace format. Open it in chrome://tracing or ui.perfetto.dev.
+ *
+ * $> ./a.out -t trace.json 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ */
+
+/**
+ * Binary output
+ * With -b the merged numbers are written to output.bin as raw int32 values
+ * instead of output.txt text.
+ *
+ * $> ./a.out -b 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ */
+
+/**
+ * External sort
+ * With -m <memory_mb> the files don't have to fit into memory. They are sorted
+ * chunk by chunk, the chunks are spilled into $TMPDIR (or /tmp) and merged from
+ * there, all within the given memory.
+ *
+ * $> ./a.out -m 64 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ */
+
+/**
+ * Pipelined sort
+ * With -c <chunk_size> the files are cut into chunks of that many numbers. The
+ * coroutines only parse them, the chunks are sorted by sorter coroutines (one per
+ * thread) and merged by a merger coroutine at the same time, so the merge mostly
+ * happens while the input is still being read.
+ *
+ * $> ./a.out -c 262144 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ */
+
+/**
+ * Sorted run files
+ * With -r the result is written to output.run - a binary sorted run with a header
+ * and a sparse index (see run_file.h). Input files with the .run suffix are mapped
+ * as they are, without parsing and sorting, so sorted runs can be merged again:
+ *
+ * $> ./a.out -r 100 3 test1.txt test2.txt test3.txt
+ * $> mv output.run first.run
+ * $> ./a.out 100 3 first.run test4.txt test5.txt test6.txt
+ */
+
+/**
+ * Sort cache
+ * With -C <cache_dir> the sorted numbers of each file are kept in the directory
+ * between runs, as run files. On the next run only the files, which were changed,
+ * are parsed and sorted again, and if none of them was, and the output is the one
+ * merged last time, the output is left as it is:
+ *
+ * $> ./a.out -C .sort_cache 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ */
+
+/**
+ * Queries
+ * With -k <K> the K smallest numbers of all the files are printed, and with
+ * -q <percentiles> the percentiles, like -q 50,99,99.9. The sorted files are not
+ * merged, and no output file is written - the numbers are found right in the
+ * sorted files:
+ *
+ * $> ./a.out -k 10 -q 50,90,99 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+ */
+
 #if CHECK_LEAKS == 1
 #include "utils/heap_help/heap_help.h"
 #endif
@@ -63,13 +191,27 @@ void print(const char *format, ...) {
 struct file{
     int *data;
     long size;
+    struct run_file *run; // the mapped run file of data, NULL if data is allocated
+};
+
+
+// A file is split into parts of at least this many bytes
+#define FILE_PART_MIN (1 << 20)
+
+// part of an input file, which is read and sorted by one coroutine as a run of its own
+struct file_part {
+    int path;       // index of the file path
+    off_t from, to; // byte range of the file, to = -1 is the end of the file
+    off_t size;     // size of the range, to order the parts
 };
 
 
 // file_storage structure
 struct file_storage {
     char **paths;
-    struct file **filesData;
+    struct file **filesData; // sorted data of each part
+    struct file_part *parts; // the parts in the order they are taken, the biggest first
+    int part_count;
     int cur_unsorted;
     int count;
     int capacity; // all memory capacity
@@ -82,6 +224,8 @@ file_storage_new(void) {
     struct file_storage *list = malloc(sizeof(struct file_storage));
     list->paths = (char **) malloc(10 * sizeof(char *));
     list->capacity = 10;
+    list->parts = NULL;
+    list->part_count = 0;
     list->cur_unsorted = 0;
     list->count = 0;
     return list;
@@ -98,19 +242,82 @@ void addPath(struct file_storage *list, const char *path) {
     list->count++;
 }
 
+// checking that the file is a sorted run, by its suffix
+static bool is_run_file(const char *path) {
+    size_t len = strlen(path);
+    return len >= 4 && strcmp(path + len - 4, ".run") == 0;
+}
+
+// Comparator of the parts: the biggest first, then in the order of the arguments
+static int compare_parts(const void *a, const void *b) {
+    const struct file_part *pa = a;
+    const struct file_part *pb = b;
+    if (pa->size != pb->size)
+        return pa->size > pb->size ? -1 : 1;
+    if (pa->path != pb->path)
+        return pa->path - pb->path;
+    return pa->from < pb->from ? -1 : pa->from > pb->from;
+}
+
+// Plan the parts of the files for <workers> parallel workers.
+// The files are taken the biggest first (LPT), so a big file given last doesn't
+// start when the others are done. With split, the files bigger than a half of
+// a worker's share are cut into byte ranges, so no single file determines the
+// total time - the ranges are sorted by different workers and merged as runs.
+void planFileParts(struct file_storage *list, int workers, bool split) {
+    off_t *sizes = malloc(list->count * sizeof(off_t));
+    off_t total = 0;
+    for (int i = 0; i < list->count; i++) {
+        struct stat st;
+        if (stat(list->paths[i], &st) != 0) {
+            perror("Error reading file");
+            exit(1);
+        }
+        sizes[i] = st.st_size;
+        total += st.st_size;
+    }
+    off_t part_max = total / (2 * workers);
+    if (part_max < FILE_PART_MIN)
+        part_max = FILE_PART_MIN;
+    int capacity = list->count;
+    list->parts = malloc(capacity * sizeof(struct file_part));
+    list->part_count = 0;
+    for (int i = 0; i < list->count; i++) {
+        int count = 1;
+        if (split && workers > 1 && sizes[i] > part_max && !is_run_file(list->paths[i]))
+            count = (sizes[i] + part_max - 1) / part_max;
+        if (list->part_count + count > capacity) {
+            capacity = (list->part_count + count) * 2;
+            list->parts = realloc(list->parts, capacity * sizeof(struct file_part));
+        }
+        for (int j = 0; j < count; j++) {
+            struct file_part *part = &list->parts[list->part_count++];
+            part->path = i;
+            part->from = sizes[i] * j / count;
+            part->to = j == count - 1 ? -1 : sizes[i] * (j + 1) / count;
+            part->size = (j == count - 1 ? sizes[i] : part->to) - part->from;
+        }
+        if (count > 1)
+            print("Split %s into %d parts\n", list->paths[i], count);
+    }
+    qsort(list->parts, list->part_count, sizeof(struct file_part), compare_parts);
+    free(sizes);
+}
+
 // checking that we have files unsorted in file_storage
 int haveFiles(struct file_storage *list) {
-    if (list->cur_unsorted < list->count)
+    if (list->cur_unsorted < list->part_count)
         return list->cur_unsorted;
     else
         return -1;
 }
 
 
-// getting last unsorted index in file_storage
-char *getLastUnsortFile(struct file_storage *list) {
-    list->cur_unsorted++;
-    return list->paths[list->cur_unsorted - 1];
+// taking next unsorted part index in file_storage, -1 if all parts are taken
+// coroutines can work in several threads, so the index is taken atomically
+int takeUnsortFile(struct file_storage *list) {
+    int ind = __atomic_fetch_add(&list->cur_unsorted, 1, __ATOMIC_RELAXED);
+    return ind < list->part_count ? ind : -1;
 }
 
 // cleaning file_storage to have no memory leaks
@@ -119,13 +326,17 @@ void fileStorageCleanup(struct file_storage *list) {
         free(list->paths[i]);
     }
     free(list->paths);
+    free(list->parts);
     free(list);
 }
 
 
 // cleaning file to have no memory leaks
 void fileFree(struct file *fileInfo) {
-    if(fileInfo->data)
+    if (fileInfo->run != NULL) {
+        run_file_close(fileInfo->run);
+        free(fileInfo->run);
+    } else if(fileInfo->data)
         free(fileInfo->data);
     free(fileInfo);
 }
@@ -137,9 +348,13 @@ file_new() {
     struct file *fileInfo = malloc(sizeof(struct file));
     fileInfo->data = NULL;
     fileInfo->size = 0;
+    fileInfo->run = NULL;
     return fileInfo;
 }
 
+// With -s the work time is taken from libcoro statistics, which read the clock on each switch
+static bool stats_enabled = false;
+
 // Data structure for holding coroutine state
 struct my_context {
     char *name;
@@ -147,9 +362,13 @@ struct my_context {
     char *filename;
     struct file *curData;
     int64_t work_time; // in nanoseconds
+    int64_t wait_time; // in nanoseconds, time in the ready queue, only with -s
     long time_quantum;
     struct timespec start_time;
     struct timespec end_time;
+    struct extsort *ext; // external sort of the files, NULL if they are sorted in memory
+    struct pipeline *pipe; // pipelined sort of the files, NULL if not used
+    struct run_cache *cache; // cache of the sorted files, NULL if not used
 };
 
 //creating basic my_context which will store information about coroutine
@@ -163,6 +382,11 @@ my_context_new(const char *name, long time_quantum, struct file_storage *f_stor)
     ctx->filename = "";
     ctx->time_quantum = time_quantum;
     ctx->curData = NULL;
+    ctx->work_time = 0;
+    ctx->wait_time = 0;
+    ctx->ext = NULL;
+    ctx->pipe = NULL;
+    ctx->cache = NULL;
     return ctx;
 }
 
@@ -179,43 +403,67 @@ int min(int a, int b) {
     return a < b ? a : b;
 }
 
+// Function to map a sorted run file, its numbers are used right from the mapping
+void read_run_file(struct my_context *fdata, int dataInd) {
+    struct run_file *run = malloc(sizeof(struct run_file));
+    if (run_file_open(run, fdata->filename) != 0) {
+        perror("Error reading run file");
+        exit(1);
+    }
+    if (!run_file_check(run)) {
+        fprintf(stderr, "Error reading run file: %s is corrupted\n", fdata->filename);
+        exit(1);
+    }
+    struct file *tempFile = file_new();
+    tempFile->data = (int *) run->data;
+    tempFile->size = run->count;
+    tempFile->run = run;
+    fdata->curData = tempFile;
+    fdata->files->filesData[dataInd] = tempFile;
+}
+
+// Function to map the cached run of a file, which was not changed since it was cached
+// returns false if there is no such run
+bool read_cached_file(struct my_context *fdata, int dataInd, const struct run_cache_key *key) {
+    struct run_file *run = malloc(sizeof(struct run_file));
+    if (run_cache_get(fdata->cache, key, run) != 0) {
+        free(run);
+        return false;
+    }
+    print("Found %s in the cache\n", fdata->filename);
+    struct file *tempFile = file_new();
+    tempFile->data = (int *) run->data;
+    tempFile->size = run->count;
+    tempFile->run = run;
+    fdata->curData = tempFile;
+    fdata->files->filesData[dataInd] = tempFile;
+    return true;
+}
+
 // Function to read file content into an array
+// the file part is parsed in one pass, and is read through libcoro I/O helpers,
+// so other coroutines sort their files meanwhile
 void read_file_content(struct my_context *fdata, int dataInd) {
+    struct file_part *part = &fdata->files->parts[dataInd];
     print("%s\n", fdata->filename);
-    FILE *fp = fopen(fdata->filename, "r");
-    if (!fp) {
-        perror("Error opening file");
-        exit(1);
+    if (is_run_file(fdata->filename)) {
+        read_run_file(fdata, dataInd);
+        return;
     }
-
-    // Count number of integers in the file
-    int count = 0;
-    int tmp;
-    while (fscanf(fp, "%d", &tmp) == 1) {
-        count++;
+    struct int_array arr;
+    int_array_create(&arr);
+    if (int_array_load_range(&arr, fdata->filename, part->from, part->to) != 0) {
+        perror("Error reading file");
+        exit(1);
     }
-    rewind(fp);  // Reset file pointer to the beginning
 
-    // Allocate memory for data and read integers into the array
     struct file *tempFile = file_new();
-    tempFile->data = (int *) malloc(count * sizeof(int));
-    tempFile->size = count;
-    print("Counted %d integers in file: %s\n", count, fdata->filename);
-    for (int i = 0; i < count; i++) {
-        fscanf(fp, "%d", &(tempFile->data[i]));
-    }
+    tempFile->data = arr.data;
+    tempFile->size = arr.size;
+    print("Counted %ld integers in file: %s\n", tempFile->size, fdata->filename);
     fdata->curData = tempFile;
     fdata->files->filesData[dataInd] = tempFile;
     print("Setting size to %zu for file: %s\n", fdata->files->filesData[dataInd]->size, fdata->filename);
-
-    fclose(fp);
-}
-
-// Swap function for integers
-void swap(int *a, int *b) {
-    int temp = *a;
-    *a = *b;
-    *b = temp;
 }
 
 // Calculating coroutine time from last yield or from start of coroutine
@@ -225,12 +473,9 @@ void calculate_coroutine_time(struct my_context *ctx) {
 }
 
 // yield function for making appropriate coroutine interruptions and time calculating
+// the quantum is enforced by libcoro timer, so checking it is just a flag load
 void yield(struct coro *temp_ctx, char *name, struct my_context *ctx) {
-    clock_gettime(CLOCK_MONOTONIC, &(ctx->end_time));
-    int64_t elapsed_time = calculate_time_difference(ctx->start_time, ctx->end_time);
-    print("Elapsed time of %s is: %" PRId64 ", start_time: %ld, end_time: %ld\n", name, elapsed_time,
-         ctx->start_time.tv_nsec, ctx->end_time.tv_nsec);
-    if (elapsed_time < ctx->time_quantum) {
+    if (!coro_quantum_is_expired()) {
         return;
     }
     print("%s: switch count %lld\n", name, coro_switch_count(temp_ctx));
@@ -241,23 +486,6 @@ void yield(struct coro *temp_ctx, char *name, struct my_context *ctx) {
 }
 
 
-// Partition function for quicksort
-int partition(int arr[], int low, int high, struct coro *temp_ctx, char *name, struct my_context *ctx) {
-    int pivot = arr[high];
-    int i = (low - 1);
-
-    for (int j = low; j <= high - 1; j++) {
-        if (arr[j] < pivot) {
-            i++;
-            swap(&arr[i], &arr[j]);
-        }
-        // Yield after each iteration
-        yield(temp_ctx, name, ctx);
-    }
-    swap(&arr[i + 1], &arr[high]);
-    return (i + 1);
-}
-
 // Function for printing array
 void printArray(int arr[], int size) {
     print("Sorted array: ");
@@ -266,61 +494,136 @@ void printArray(int arr[], int size) {
     print("\n");
 }
 
-// Quicksort function
-void quicksort(int arr[], int low, int high, struct coro *temp_ctx, char *name, struct my_context *ctx) {
-    if (low < high) {
-        int pi = partition(arr, low, high, temp_ctx, name, ctx);
-        quicksort(arr, low, pi - 1, temp_ctx, name, ctx);
-        quicksort(arr, pi + 1, high, temp_ctx, name, ctx);
-
-    }
+// Hook of the sort, it is called every few thousand steps of sorting
+// to let the other coroutines work, when the quantum is over
+static void sort_yield(void *arg) {
+    struct my_context *ctx = arg;
+    yield(coro_this(), ctx->name, ctx);
 }
 
 
 // Merge sorted files into a single file
+// the loser tree merge is cut into slices by the merge-path splits, each slice
+// is merged by its own thread and written at its offset of the output file
 void merge_sorted_files(struct my_context **file_data_list, int num_files,
-                        const char *output_filename) {
+                        const char *output_filename, enum int_writer_format format, int merge_threads) {
 
-    FILE *output_file = fopen(output_filename, "w");
-    if (!output_file) {
+    int output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
         perror("Error opening output file");
         exit(1);
     }
 
-    // Temporary array to keep track of current indices in all sorted arrays
-    long *indices = (long *) malloc(num_files * sizeof(long));
+    // Each sorted file is a run of the merge
+    struct file **files = file_data_list[0]->files->filesData;
+    struct kmerge_run *runs = (struct kmerge_run *) calloc(num_files, sizeof(struct kmerge_run));
     for (int i = 0; i < num_files; i++) {
-        indices[i] = 0;
-    }
-
-    print("Final array: ");
-    int done = 0;
-    while (!done) {
-        done = 1;
-        int min_val = INT_MAX;
-        int min_ind = -1;
-
-        for (int i = 0; i < num_files; i++) {
-            if (indices[i] < file_data_list[0]->files->filesData[i]->size) {
-                done = 0;  // There's still some data to merge
-                if (file_data_list[0]->files->filesData[i]->data[indices[i]] < min_val) {
-                    min_val = file_data_list[0]->files->filesData[i]->data[indices[i]];
-                    min_ind = i;
-                }
-            }
-        }
+        runs[i].cur = files[i]->data;
+        runs[i].end = files[i]->data + files[i]->size;
+    }
+    if (pmerge_write(runs, num_files, merge_threads, output_fd, format) != 0) {
+        perror("Error writing output file");
+        exit(1);
+    }
+    free(runs);
+    close(output_fd);
+}
 
-        // Write the minimum value to the output file and update the index
-        if (!done) {
-            print("%d ", min_val);
-            fprintf(output_file, "%d ", min_val);
-            indices[min_ind]++;
-        }
+// Merge sorted files into a single run file, with its index
+void merge_to_run_file(struct my_context **file_data_list, int num_files, const char *output_filename) {
+    int output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        perror("Error opening output file");
+        exit(1);
     }
-    print("\n");
 
-    free(indices);
-    fclose(output_file);
+    struct file **files = file_data_list[0]->files->filesData;
+    struct kmerge_run *runs = (struct kmerge_run *) calloc(num_files, sizeof(struct kmerge_run));
+    for (int i = 0; i < num_files; i++) {
+        runs[i].cur = files[i]->data;
+        runs[i].end = files[i]->data + files[i]->size;
+    }
+    struct kmerge merge;
+    kmerge_create(&merge, runs, num_files);
+    struct run_file_writer writer;
+    run_file_writer_create(&writer, output_fd, 0);
+    const int *block;
+    size_t len;
+    while ((len = kmerge_next(&merge, &block)) != 0)
+        run_file_writer_put_array(&writer, block, len);
+    kmerge_destroy(&merge);
+    if (run_file_writer_destroy(&writer) != 0) {
+        perror("Error writing output file");
+        exit(1);
+    }
+    free(runs);
+    close(output_fd);
+}
+
+// Answer the queries over the sorted files, without merging them
+void answer_queries(struct my_context **file_data_list, int num_files, long top_k,
+                    const double *percentiles, int percentile_count) {
+    struct file **files = file_data_list[0]->files->filesData;
+    struct kmerge_run *runs = (struct kmerge_run *) calloc(num_files, sizeof(struct kmerge_run));
+    for (int i = 0; i < num_files; i++) {
+        runs[i].cur = files[i]->data;
+        runs[i].end = files[i]->data + files[i]->size;
+    }
+    size_t size = query_size(runs, num_files);
+    if (top_k > 0) {
+        size_t k = size < (size_t) top_k ? size : (size_t) top_k;
+        int *values = malloc((k > 0 ? k : 1) * sizeof(int));
+        size_t count = query_top_k(runs, num_files, k, values);
+        printf("Smallest %zu of %zu numbers:", count, size);
+        for (size_t i = 0; i < count; i++)
+            printf(" %d", values[i]);
+        printf("\n");
+        free(values);
+    }
+    for (int i = 0; i < percentile_count; i++) {
+        if (size == 0)
+            printf("p%g: no numbers\n", percentiles[i]);
+        else
+            printf("p%g: %d\n", percentiles[i], query_percentile(runs, num_files, percentiles[i]));
+    }
+    free(runs);
+}
+
+// Parse the comma separated percentiles, returns their count, -1 if some is wrong
+int parse_percentiles(char *list, double **percentiles) {
+    int count = 0;
+    *percentiles = NULL;
+    for (char *str = strtok(list, ","); str != NULL; str = strtok(NULL, ",")) {
+        char *end;
+        double percent = strtod(str, &end);
+        if (*end != '\0' || end == str || !(percent >= 0 && percent <= 100))
+            return -1;
+        *percentiles = realloc(*percentiles, (count + 1) * sizeof(double));
+        (*percentiles)[count++] = percent;
+    }
+    return count;
+}
+
+// Merge the runs of the external sort into a single file
+void merge_external(struct extsort *ext, const char *output_filename, enum int_writer_format format) {
+    int output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        perror("Error opening output file");
+        exit(1);
+    }
+    if (extsort_merge(ext, output_fd, format) != 0) {
+        perror("Error writing output file");
+        exit(1);
+    }
+    close(output_fd);
+}
+
+// Start a coroutine in the single thread scheduler, or in the runtime
+static void start_coroutine(struct coro_rt *rt, coro_f func, void *arg) {
+    if (rt != NULL)
+        coro_rt_spawn(rt, func, arg);
+    else
+        coro_new(func, arg);
 }
 
 /**
@@ -332,23 +635,75 @@ coroutine_func_f(void *context) {
     struct coro *this = coro_this();
     struct my_context *ctx = context;
     char *name = ctx->name;
-    int curInd = haveFiles(ctx->files);
+    int curInd = takeUnsortFile(ctx->files);
     while (curInd != -1) {
-        char *filename = getLastUnsortFile(ctx->files);
+        char *filename = ctx->files->paths[ctx->files->parts[curInd].path];
         ctx->filename = filename;
 
         clock_gettime(CLOCK_MONOTONIC, &(ctx->start_time));
         print("Started coroutine %s with file %s\n", name, filename);
 
+        // In the external sort the file is sorted chunk by chunk into runs on disk
+        if (ctx->ext != NULL) {
+            coro_trace_begin("spill");
+            if (extsort_add_file(ctx->ext, filename, sort_yield, ctx) != 0) {
+                perror("Error sorting file");
+                exit(1);
+            }
+            coro_trace_end("spill");
+            curInd = takeUnsortFile(ctx->files);
+            continue;
+        }
+
+        // In the pipelined sort the file is only parsed, its chunks are sorted by the sorters
+        if (ctx->pipe != NULL) {
+            coro_trace_begin("parse");
+            if (pipeline_parse_file(ctx->pipe, filename) != 0) {
+                perror("Error reading file");
+                exit(1);
+            }
+            coro_trace_end("parse");
+            curInd = takeUnsortFile(ctx->files);
+            continue;
+        }
+
+        // A file, which was not changed since the last run, is taken from the cache
+        bool use_cache = ctx->cache != NULL && !is_run_file(filename);
+        struct run_cache_key key;
+        if (use_cache) {
+            if (run_cache_key_create(ctx->cache, &key, filename) != 0) {
+                perror("Error reading file");
+                exit(1);
+            }
+            if (read_cached_file(ctx, curInd, &key)) {
+                run_cache_key_destroy(&key);
+                curInd = takeUnsortFile(ctx->files);
+                continue;
+            }
+        }
+
         // Read file content
+        coro_trace_begin("parse");
         read_file_content(ctx, curInd);
+        coro_trace_end("parse");
 
 
-        // Sort the content
-        quicksort(ctx->curData->data, 0, ctx->curData->size - 1, this, name, ctx);
+        // Sort the content, big files by radix sort, small ones by quicksort
+        // run files are sorted already
+        coro_trace_begin("sort");
+        if (ctx->curData->run == NULL)
+            int_sort_auto(ctx->curData->data, ctx->curData->size, sort_yield, ctx);
+        coro_trace_end("sort");
 
         printArray(ctx->curData->data, ctx->curData->size);
 
+        // A failed write of the cache is not fatal, the file is just sorted again next time
+        if (use_cache) {
+            if (run_cache_put(ctx->cache, &key, ctx->curData->data, ctx->curData->size) != 0)
+                perror("Error writing cache");
+            run_cache_key_destroy(&key);
+        }
+
         // Save the sorted data back to the file
         //FILE *fp = fopen(ctx->filename, "w");
         //if (!fp) {
@@ -359,24 +714,154 @@ coroutine_func_f(void *context) {
         //    fprintf(fp, "%d ", ctx->curData->data[i]);
         //}
         //fclose(fp);
-        curInd = haveFiles(ctx->files);
+        curInd = takeUnsortFile(ctx->files);
     }
 
+    if (ctx->pipe != NULL)
+        pipeline_parser_done(ctx->pipe);
+
     printf("Total switch count for coroutine %s: %lld\n", name, coro_switch_count(this));
     calculate_coroutine_time(ctx);
+    if (stats_enabled) {
+        // libcoro counts only the time the coroutine was on the CPU
+        struct coro_stats stats;
+        coro_stats(this, &stats);
+        ctx->work_time = stats.cpu_ns;
+        ctx->wait_time = stats.wait_ns;
+    }
 
     return 0;
 }
 
+// Group of coroutines, run by one thread of the pool
+struct pool_worker {
+    struct my_context **ctxs;
+    int count;
+};
+
+// Task of the thread pool: the thread runs its own scheduler with the group of coroutines
+static void *pool_worker_f(void *arg) {
+    struct pool_worker *worker = arg;
+    coro_sched_init();
+    for (int i = 0; i < worker->count; i++)
+        coro_new(coroutine_func_f, worker->ctxs[i]);
+    struct coro *c;
+    while ((c = coro_sched_wait()) != NULL) {
+        print("Finished status: %d\n", coro_status(c));
+        coro_delete(c);
+    }
+    coro_sched_free();
+    return NULL;
+}
+
+// Sort the files on a thread pool, each thread runs up to coroutines_per_thread coroutines
+void sort_on_thread_pool(struct my_context **ctxs, int count, int pool_threads, int coroutines_per_thread) {
+    struct thread_pool *pool;
+    if (thread_pool_new(pool_threads, &pool) != 0) {
+        fprintf(stderr, "Error creating thread pool\n");
+        exit(1);
+    }
+    int task_count = (count + coroutines_per_thread - 1) / coroutines_per_thread;
+    struct thread_task **tasks = malloc(task_count * sizeof(struct thread_task *));
+    struct pool_worker *workers = malloc(task_count * sizeof(struct pool_worker));
+    for (int i = 0; i < task_count; i++) {
+        workers[i].ctxs = ctxs + i * coroutines_per_thread;
+        workers[i].count = min(coroutines_per_thread, count - i * coroutines_per_thread);
+        thread_task_new(&tasks[i], pool_worker_f, &workers[i]);
+        if (thread_pool_push_task(pool, tasks[i]) != 0) {
+            fprintf(stderr, "Error pushing task to thread pool\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < task_count; i++) {
+        void *result;
+        thread_task_join(tasks[i], &result);
+        thread_task_delete(tasks[i]);
+    }
+    thread_pool_delete(pool);
+    free(tasks);
+    free(workers);
+}
+
 int main(int argc, char **argv) {
 #if CHECK_LEAKS == 1
     heaph_get_alloc_count();
 #endif
+    int threads_num = 1;
+    int merge_threads = 0;
+    long memory_mb = 0;
+    long chunk_size = 0;
+    bool run_output = false;
+    int pool_threads = 0;
+    const char *trace_path = NULL;
+    const char *cache_dir = NULL;
+    long top_k = 0;
+    double *percentiles = NULL;
+    int percentile_count = 0;
+    enum int_writer_format output_format = INT_WRITER_TEXT;
+    int opt;
+    while ((opt = getopt(argc, argv, "+j:st:bp:m:c:rT:C:k:q:")) != -1) {
+        switch (opt) {
+            case 'k':
+                top_k = atol(optarg);
+                if (top_k <= 0)
+                    argc = 0;
+                break;
+            case 'q':
+                free(percentiles);
+                percentile_count = parse_percentiles(optarg, &percentiles);
+                if (percentile_count <= 0)
+                    argc = 0;
+                break;
+            case 'C':
+                cache_dir = optarg;
+                break;
+            case 'T':
+                pool_threads = atoi(optarg);
+                break;
+            case 'r':
+                run_output = true;
+                break;
+            case 'c':
+                chunk_size = atol(optarg);
+                break;
+            case 'm':
+                memory_mb = atol(optarg);
+                break;
+            case 'p':
+                merge_threads = atoi(optarg);
+                break;
+            case 'b':
+                output_format = INT_WRITER_BINARY;
+                break;
+            case 'j':
+                threads_num = atoi(optarg);
+                break;
+            case 's':
+                stats_enabled = true;
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+    // By default the files are merged by as many threads as sorted them, -j or -T
+    if (merge_threads == 0)
+        merge_threads = pool_threads > threads_num ? pool_threads : threads_num;
+    // Queries are answered over the sorted files, there is no output file
+    bool query = top_k > 0 || percentile_count > 0;
     // Check for minimum number of arguments
-    if (argc < 4) {
-        printf("Usage: %s <target_latency> <coroutines_num> <files...>\n", argv[0]);
+    if (argc - optind < 3 || threads_num < 1 || merge_threads < 1 || memory_mb < 0 || chunk_size < 0 ||
+        ((run_output || cache_dir != NULL || query) && (memory_mb > 0 || chunk_size > 0)) || (query && run_output) || pool_threads < 0 || pool_threads > TPOOL_MAX_THREADS ||
+        (pool_threads > 0 && (threads_num > 1 || chunk_size > 0))) {
+        printf("Usage: %s [-j threads] [-s] [-t trace.json] [-b] [-p merge_threads] [-m memory_mb] [-c chunk_size] [-r] [-T pool_threads] [-C cache_dir] [-k top_k] [-q percentiles] <target_latency> <coroutines_num> <files...>\n", argv[0]);
         return 1;
     }
+    argc -= optind - 1;
+    argv += optind - 1;
 
 
     struct file_storage *f_stor;
@@ -384,8 +869,11 @@ int main(int argc, char **argv) {
 
     long target_latency = atol(argv[1]) * 1000;
     int coroutines_num = atoi(argv[2]);
-    int num_files = argc - 3;
     long time_quantum = target_latency / coroutines_num;
+    if (time_quantum > 0 && time_quantum < CORO_QUANTUM_MIN_NS) {
+        fprintf(stderr, "Warning: time quantum %ld us is below the minimum, %d us is used\n",
+                time_quantum / 1000, CORO_QUANTUM_MIN_NS / 1000);
+    }
 
 
     for (int i = 3; i < argc; i++) {
@@ -396,34 +884,112 @@ int main(int argc, char **argv) {
     print("Number of files: %d, All capacity of Files Storage: %d, Current Unsorted index: %d\n", f_stor->count,
           f_stor->capacity, f_stor->cur_unsorted);
 
-    f_stor->filesData = (struct file **) malloc(f_stor->count * sizeof(struct file*));
+    const char *output_filename = output_format == INT_WRITER_BINARY ? "output.bin" : "output.txt";
+    if (run_output)
+        output_filename = "output.run";
+
+    // With a cache only the changed files are sorted, and if none was, the last output is kept
+    struct run_cache cache;
+    if (cache_dir != NULL) {
+        if (run_cache_open(&cache, cache_dir) != 0) {
+            perror("Error opening cache");
+            exit(1);
+        }
+        if (!query && run_cache_output_is_fresh(&cache, f_stor->paths, f_stor->count, output_filename)) {
+            printf("Output %s is up to date\n", output_filename);
+            run_cache_close(&cache);
+            fileStorageCleanup(f_stor);
+            return 0;
+        }
+    }
+
+    // The parts are split for the threads, the coroutines of one thread don't run in parallel.
+    // The external and pipelined sorts cut the files into chunks themselves.
+    // The cache keeps whole files, so they are not split with it.
+    planFileParts(f_stor, pool_threads > 0 ? pool_threads : threads_num,
+                  memory_mb == 0 && chunk_size == 0 && cache_dir == NULL);
+    // Each part is a sorted run of its own
+    int num_files = f_stor->part_count;
+    f_stor->filesData = (struct file **) calloc(num_files, sizeof(struct file*));
 
     struct timespec total_start_time, total_end_time;
     clock_gettime(CLOCK_MONOTONIC, &total_start_time);
 
-    /* Initialize our coroutine global cooperative scheduler. */
-    coro_sched_init();
+    if (trace_path != NULL)
+        coro_trace_start(1 << 18);
+    /* Each coroutine works for a quantum, then yields. */
+    coro_quantum_set(time_quantum);
+    /* With -s libcoro accounts every switch and prints its statistics at the end. */
+    coro_stats_enable(stats_enabled);
+    /* Initialize our coroutine global cooperative scheduler, or a runtime of several threads. */
+    /* On the thread pool each thread makes its own scheduler. */
+    struct coro_rt *rt = NULL;
+    if (threads_num > 1)
+        rt = coro_rt_new(threads_num);
+    else if (pool_threads == 0)
+        coro_sched_init();
+    int coro_count = min(pool_threads > 0 ? pool_threads * coroutines_num : coroutines_num, num_files);
+
+    // With a memory limit the files are sorted externally, the memory is shared by the coroutines
+    struct extsort ext;
+    if (memory_mb > 0) {
+        const char *tmp_dir = getenv("TMPDIR");
+        extsort_create(&ext, tmp_dir != NULL ? tmp_dir : "/tmp", (size_t) memory_mb << 20,
+                       coro_count);
+    }
+
+    // In the pipelined sort the merger writes the output, while the files are still parsed
+    struct pipeline pl;
+    int pipeline_fd = -1;
+    if (chunk_size > 0 && memory_mb == 0) {
+        pipeline_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (pipeline_fd < 0) {
+            perror("Error opening output file");
+            exit(1);
+        }
+        pipeline_create(&pl, chunk_size, coro_count, threads_num, 2 * threads_num,
+                        pipeline_fd, output_format);
+    }
 
-    struct my_context **m_ctxs = (struct my_context **) malloc(num_files * sizeof(struct my_context *));
+    struct my_context **m_ctxs = (struct my_context **) malloc(coro_count * sizeof(struct my_context *));
     /* Start several coroutines. */
-    for (int i = 0; i < min(coroutines_num, f_stor->count); ++i) {
+    for (int i = 0; i < coro_count; ++i) {
         if (haveFiles(f_stor) != -1) {
             struct my_context *m_ctx;
             char name[30];
             sprintf(name, "coro_%d", i);
             m_ctx = my_context_new(name, time_quantum, f_stor);
+            if (memory_mb > 0)
+                m_ctx->ext = &ext;
+            if (pipeline_fd >= 0)
+                m_ctx->pipe = &pl;
+            if (cache_dir != NULL)
+                m_ctx->cache = &cache;
             m_ctxs[i] = m_ctx;
             print("coro_%d is starting\n", i);
-            coro_new(coroutine_func_f, m_ctx);
+            if (pool_threads == 0)
+                start_coroutine(rt, coroutine_func_f, m_ctx);
             //print("Size of file %s: %zu\n", m_ctx->name, m_ctx->size);
         }
     }
+    if (pipeline_fd >= 0) {
+        for (int i = 0; i < threads_num; ++i)
+            start_coroutine(rt, pipeline_sorter_f, &pl);
+        start_coroutine(rt, pipeline_merger_f, &pl);
+    }
     /* Wait for all the coroutines to end. */
-    struct coro *c;
-    while ((c = coro_sched_wait()) != NULL) {
-        print("Finished status: %d\n", coro_status(c));
-        coro_delete(c);
+    if (pool_threads > 0) {
+        sort_on_thread_pool(m_ctxs, coro_count, pool_threads, coroutines_num);
+    } else {
+        struct coro *c;
+        while ((c = rt != NULL ? coro_rt_wait(rt) : coro_sched_wait()) != NULL) {
+            print("Finished status: %d\n", coro_status(c));
+            coro_delete(c);
+        }
     }
+    if (rt != NULL)
+        coro_rt_delete(rt);
+    coro_io_shutdown();
     /* All coroutines have finished. */
     clock_gettime(CLOCK_MONOTONIC, &total_end_time);
     int64_t total_time = calculate_time_difference(total_start_time, total_end_time) / 1000;
@@ -431,12 +997,49 @@ int main(int argc, char **argv) {
 
 
     // Merge sorted files
-    merge_sorted_files(m_ctxs, num_files, "output.txt");
+    coro_trace_begin("merge");
+    if (pipeline_fd >= 0) {
+        // Already merged by the pipeline
+        close(pipeline_fd);
+        if (pl.error != 0) {
+            errno = pl.error;
+            perror("Error writing output file");
+            exit(1);
+        }
+        pipeline_destroy(&pl);
+    } else if (memory_mb > 0) {
+        merge_external(&ext, output_filename, output_format);
+        extsort_destroy(&ext);
+    } else if (query) {
+        answer_queries(m_ctxs, num_files, top_k, percentiles, percentile_count);
+    } else if (run_output) {
+        merge_to_run_file(m_ctxs, num_files, output_filename);
+    } else {
+        merge_sorted_files(m_ctxs, num_files, output_filename, output_format, merge_threads);
+    }
+    coro_trace_end("merge");
+    if (cache_dir != NULL) {
+        // Queries write no output, the last one is still up to date
+        if ((!query && run_cache_set_output(&cache, f_stor->paths, f_stor->count, output_filename) != 0) ||
+            run_cache_save(&cache) != 0)
+            perror("Error writing cache");
+        run_cache_close(&cache);
+    }
+    if (trace_path != NULL) {
+        if (coro_trace_export(trace_path) != 0)
+            perror("Error writing trace");
+        coro_trace_stop();
+    }
 
     //Print time for each coroutine
-    for (int i = 0; i < min(coroutines_num, f_stor->count); ++i) {
-        printf("Total execution time for coroutine %s: %" PRId64 " microseconds\n", m_ctxs[i]->name,
-               m_ctxs[i]->work_time / 1000);
+    for (int i = 0; i < coro_count; ++i) {
+        if (stats_enabled) {
+            printf("Total execution time for coroutine %s: %" PRId64 " microseconds, waited for %" PRId64
+                   " microseconds\n", m_ctxs[i]->name, m_ctxs[i]->work_time / 1000, m_ctxs[i]->wait_time / 1000);
+        } else {
+            printf("Total execution time for coroutine %s: %" PRId64 " microseconds\n", m_ctxs[i]->name,
+                   m_ctxs[i]->work_time / 1000);
+        }
     }
 
     clock_gettime(CLOCK_MONOTONIC, &total_end_time);
@@ -444,16 +1047,19 @@ int main(int argc, char **argv) {
     printf("Total execution time: %" PRId64 " microseconds\n", total_time);
 
     // Cleanup
-    for (int i = 0; i < min(coroutines_num, f_stor->count); i++) {
+    for (int i = 0; i < coro_count; i++) {
         //fileFree(m_ctxs[i]->curData);
         free(m_ctxs[i]->name);
         free(m_ctxs[i]);
     }
     free(m_ctxs);
-    for(int i = 0;i<num_files;i++)
-        fileFree(f_stor->filesData[i]);
+    for(int i = 0;i<num_files;i++) {
+        if (f_stor->filesData[i] != NULL)
+            fileFree(f_stor->filesData[i]);
+    }
     free(f_stor->filesData);
     fileStorageCleanup(f_stor);
+    free(percentiles);
 
     fflush(stdout);
 #if CHECK_LEAKS == 1
@@ -0,0 +1,538 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "int_reader.h"
+#include "int_writer.h"
+#include "int_sort.h"
+#include "kmerge.h"
+
+/**
+ * Benchmark of the sort stages on data of different shapes. For
+ * each dataset and size the stages are timed separately:
+ *
+ *   parse  int_array_load() of the dataset, written as text;
+ *   sort   int_sort_auto() of the dataset, as the files are sorted;
+ *   merge  kmerge of the dataset, cut into sorted runs, as the
+ *          final merge of the files.
+ *
+ * Each stage is run several times, and the median and the 99th
+ * percentile of the time are printed as CSV, with the throughput
+ * in millions of values per second. The results are checked, so a
+ * broken change is not taken for a fast one.
+ *
+ * Build with -DCMAKE_BUILD_TYPE=Release to get meaningful numbers.
+ *
+ * $> ./sort_bench > before.csv
+ * $> ./sort_bench -d zipf,organ -s 1M,100M -t 20 -S sort
+ */
+
+enum {
+	/** Runs, into which the dataset is cut for the merge. */
+	BENCH_RUNS_DEFAULT = 8,
+	/** Trials are chosen to take about that many values in total. */
+	BENCH_TRIAL_VALUES = 10000000,
+	BENCH_TRIALS_MIN = 5,
+	BENCH_TRIALS_MAX = 1000,
+	/** Distinct values of the few-unique dataset. */
+	BENCH_FEW_UNIQUE = 16,
+	/** Distinct values of the Zipfian dataset. */
+	BENCH_ZIPF_RANKS = 1000000,
+};
+
+static int64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** splitmix64, the datasets are the same on each run. */
+static uint64_t
+bench_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+typedef void (*bench_generate_f)(int *data, size_t size, uint64_t *state);
+
+static void
+bench_generate_random(int *data, size_t size, uint64_t *state)
+{
+	for (size_t i = 0; i < size; ++i)
+		data[i] = (int)(uint32_t)bench_random(state);
+}
+
+/** Distinct values from the whole range, in ascending order. */
+static int
+bench_ascending(size_t i, size_t size)
+{
+	return (int)((int64_t)INT32_MIN + (int64_t)(i * (UINT32_MAX /
+							  (size + 1))));
+}
+
+static void
+bench_generate_sorted(int *data, size_t size, uint64_t *state)
+{
+	(void)state;
+	for (size_t i = 0; i < size; ++i)
+		data[i] = bench_ascending(i, size);
+}
+
+static void
+bench_generate_reverse(int *data, size_t size, uint64_t *state)
+{
+	(void)state;
+	for (size_t i = 0; i < size; ++i)
+		data[i] = bench_ascending(size - 1 - i, size);
+}
+
+/** Ascending to the middle, then descending. */
+static void
+bench_generate_organ(int *data, size_t size, uint64_t *state)
+{
+	(void)state;
+	for (size_t i = 0; i < size; ++i) {
+		size_t rank = i < size / 2 ? i : size - 1 - i;
+		data[i] = bench_ascending(rank, size);
+	}
+}
+
+static void
+bench_generate_few_unique(int *data, size_t size, uint64_t *state)
+{
+	for (size_t i = 0; i < size; ++i) {
+		data[i] = bench_ascending(bench_random(state) %
+					  BENCH_FEW_UNIQUE, BENCH_FEW_UNIQUE);
+	}
+}
+
+/**
+ * Zipf with the exponent 1: the rank is M^u for uniform u, so the
+ * rank r is taken about 1/r times as often as the first one. The
+ * ranks are scattered over the value range by a multiplicative
+ * hash.
+ */
+static void
+bench_generate_zipf(int *data, size_t size, uint64_t *state)
+{
+	double log_ranks = log(BENCH_ZIPF_RANKS);
+	for (size_t i = 0; i < size; ++i) {
+		double u = (bench_random(state) >> 11) * 0x1.0p-53;
+		uint32_t rank = (uint32_t)exp(u * log_ranks);
+		data[i] = (int)(rank * 2654435761u);
+	}
+}
+
+static void
+bench_generate_equal(int *data, size_t size, uint64_t *state)
+{
+	(void)state;
+	for (size_t i = 0; i < size; ++i)
+		data[i] = 42;
+}
+
+struct bench_dataset {
+	const char *name;
+	bench_generate_f generate;
+};
+
+static const struct bench_dataset bench_datasets[] = {
+	{"random", bench_generate_random},
+	{"sorted", bench_generate_sorted},
+	{"reverse", bench_generate_reverse},
+	{"organ", bench_generate_organ},
+	{"few_unique", bench_generate_few_unique},
+	{"zipf", bench_generate_zipf},
+	{"equal", bench_generate_equal},
+};
+
+enum bench_stage {
+	BENCH_PARSE,
+	BENCH_SORT,
+	BENCH_MERGE,
+	bench_stage_MAX,
+};
+
+static const char *bench_stage_names[] = {"parse", "sort", "merge"};
+
+struct bench {
+	/** What to run, from the options. */
+	bool datasets[sizeof(bench_datasets) / sizeof(bench_datasets[0])];
+	bool stages[bench_stage_MAX];
+	size_t *sizes;
+	int size_count;
+	/** 0 - chosen by the size. */
+	int trials;
+	int run_count;
+	const char *dir;
+	/** The dataset being run, and a copy to work on. */
+	int *data;
+	int *work;
+	/** The dataset, sorted. */
+	int *sorted;
+	size_t size;
+	int64_t *times;
+};
+
+static int
+bench_compare_int(const void *a, const void *b)
+{
+	int x = *(const int *)a;
+	int y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+bench_compare_time(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void
+bench_check(const struct bench *b, const int *result, size_t size,
+	    const char *stage)
+{
+	if (size != b->size ||
+	    memcmp(result, b->sorted, size * sizeof(result[0])) != 0) {
+		fprintf(stderr, "%s: the result is wrong\n", stage);
+		exit(1);
+	}
+}
+
+/** Write the dataset as text, as the inputs are. */
+static char *
+bench_write_text(const struct bench *b)
+{
+	size_t len = strlen(b->dir) + sizeof("/sort_bench.XXXXXX");
+	char *path = malloc(len);
+	snprintf(path, len, "%s/sort_bench.XXXXXX", b->dir);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("Error creating dataset file");
+		exit(1);
+	}
+	struct int_writer w;
+	int_writer_create(&w, fd, INT_WRITER_TEXT, 0);
+	int_writer_put_array(&w, b->data, b->size);
+	if (int_writer_destroy(&w) != 0) {
+		perror("Error writing dataset file");
+		exit(1);
+	}
+	close(fd);
+	return path;
+}
+
+static int64_t
+bench_parse(struct bench *b, const char *path, bool is_checked)
+{
+	struct int_array arr;
+	int_array_create(&arr);
+	int64_t start = bench_now_ns();
+	if (int_array_load(&arr, path) != 0) {
+		perror("Error reading dataset file");
+		exit(1);
+	}
+	int64_t ns = bench_now_ns() - start;
+	if (is_checked) {
+		if (arr.size != b->size ||
+		    memcmp(arr.data, b->data, arr.size * sizeof(int)) != 0) {
+			fprintf(stderr, "parse: the result is wrong\n");
+			exit(1);
+		}
+	}
+	int_array_destroy(&arr);
+	return ns;
+}
+
+static int64_t
+bench_sort(struct bench *b, bool is_checked)
+{
+	memcpy(b->work, b->data, b->size * sizeof(int));
+	int64_t start = bench_now_ns();
+	int_sort_auto(b->work, b->size, NULL, NULL);
+	int64_t ns = bench_now_ns() - start;
+	if (is_checked)
+		bench_check(b, b->work, b->size, "sort");
+	return ns;
+}
+
+/** Cut the dataset into sorted runs in the work copy. */
+static void
+bench_merge_prepare(struct bench *b, struct kmerge_run *runs)
+{
+	memcpy(b->work, b->data, b->size * sizeof(int));
+	for (int i = 0; i < b->run_count; ++i) {
+		size_t begin = b->size * i / b->run_count;
+		size_t end = b->size * (i + 1) / b->run_count;
+		int_sort_auto(b->work + begin, end - begin, NULL, NULL);
+		runs[i].cur = b->work + begin;
+		runs[i].end = b->work + end;
+	}
+}
+
+/** Merge the runs, the merge does not change them. */
+static int64_t
+bench_merge(struct bench *b, const struct kmerge_run *runs, int *out,
+	    bool is_checked)
+{
+	struct kmerge_run *sources = calloc(b->run_count, sizeof(runs[0]));
+	memcpy(sources, runs, b->run_count * sizeof(runs[0]));
+	int64_t start = bench_now_ns();
+	struct kmerge m;
+	kmerge_create(&m, sources, b->run_count);
+	const int *block;
+	size_t len;
+	size_t size = 0;
+	while ((len = kmerge_next(&m, &block)) != 0) {
+		memcpy(out + size, block, len * sizeof(int));
+		size += len;
+	}
+	kmerge_destroy(&m);
+	int64_t ns = bench_now_ns() - start;
+	if (is_checked)
+		bench_check(b, out, size, "merge");
+	free(sources);
+	return ns;
+}
+
+/** Nearest-rank percentile of the sorted times. */
+static int64_t
+bench_percentile(const int64_t *times, int count, int percent)
+{
+	int rank = (count * percent + 99) / 100;
+	return times[rank > 0 ? rank - 1 : 0];
+}
+
+static void
+bench_report(const struct bench *b, const char *dataset,
+	     enum bench_stage stage, int trials)
+{
+	qsort(b->times, trials, sizeof(b->times[0]), bench_compare_time);
+	int64_t p50 = bench_percentile(b->times, trials, 50);
+	int64_t p99 = bench_percentile(b->times, trials, 99);
+	/* Values per nanosecond are thousands of millions per second. */
+	printf("%s,%zu,%s,%d,%.3f,%.3f,%.2f,%.2f\n", dataset, b->size,
+	       bench_stage_names[stage], trials, p50 / 1e6, p99 / 1e6,
+	       p50 > 0 ? b->size * 1e3 / p50 : 0,
+	       p99 > 0 ? b->size * 1e3 / p99 : 0);
+	fflush(stdout);
+}
+
+static void
+bench_run_stage(struct bench *b, const char *dataset, enum bench_stage stage)
+{
+	int trials = b->trials;
+	if (trials == 0) {
+		trials = BENCH_TRIAL_VALUES / b->size;
+		if (trials < BENCH_TRIALS_MIN)
+			trials = BENCH_TRIALS_MIN;
+		if (trials > BENCH_TRIALS_MAX)
+			trials = BENCH_TRIALS_MAX;
+	}
+	b->times = realloc(b->times, trials * sizeof(b->times[0]));
+	char *path = NULL;
+	int *out = NULL;
+	struct kmerge_run *runs = NULL;
+	if (stage == BENCH_PARSE) {
+		path = bench_write_text(b);
+	} else if (stage == BENCH_MERGE) {
+		out = malloc(b->size * sizeof(int));
+		runs = calloc(b->run_count, sizeof(runs[0]));
+		bench_merge_prepare(b, runs);
+	}
+	/* The first trial is checked, it is not timed to warm up. */
+	for (int i = -1; i < trials; ++i) {
+		int64_t ns = 0;
+		switch (stage) {
+		case BENCH_PARSE:
+			ns = bench_parse(b, path, i < 0);
+			break;
+		case BENCH_SORT:
+			ns = bench_sort(b, i < 0);
+			break;
+		case BENCH_MERGE:
+			ns = bench_merge(b, runs, out, i < 0);
+			break;
+		default:
+			abort();
+		}
+		if (i >= 0)
+			b->times[i] = ns;
+	}
+	if (path != NULL) {
+		unlink(path);
+		free(path);
+	}
+	free(out);
+	free(runs);
+	bench_report(b, dataset, stage, trials);
+}
+
+static void
+bench_run_dataset(struct bench *b, const struct bench_dataset *dataset,
+		  size_t size)
+{
+	b->size = size;
+	b->data = realloc(b->data, size * sizeof(int));
+	b->work = realloc(b->work, size * sizeof(int));
+	b->sorted = realloc(b->sorted, size * sizeof(int));
+	uint64_t state = size;
+	dataset->generate(b->data, size, &state);
+	memcpy(b->sorted, b->data, size * sizeof(int));
+	qsort(b->sorted, size, sizeof(int), bench_compare_int);
+	for (int stage = 0; stage < bench_stage_MAX; ++stage) {
+		if (b->stages[stage])
+			bench_run_stage(b, dataset->name, stage);
+	}
+}
+
+/** A size like 1000, 10K or 100M. */
+static size_t
+bench_parse_size(const char *str)
+{
+	char *end;
+	unsigned long long size = strtoull(str, &end, 10);
+	if (*end == 'K' || *end == 'k') {
+		size *= 1000;
+		++end;
+	} else if (*end == 'M' || *end == 'm') {
+		size *= 1000000;
+		++end;
+	}
+	return *end == 0 ? size : 0;
+}
+
+static int
+bench_find_dataset(const char *name)
+{
+	int count = sizeof(bench_datasets) / sizeof(bench_datasets[0]);
+	for (int i = 0; i < count; ++i) {
+		if (strcmp(bench_datasets[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int
+bench_find_stage(const char *name)
+{
+	for (int i = 0; i < bench_stage_MAX; ++i) {
+		if (strcmp(bench_stage_names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Turn on the items of the comma-separated @a list, the rest are
+ * turned off.
+ * @retval 0 Success.
+ * @retval -1 An unknown name.
+ */
+static int
+bench_parse_list(char *list, int (*find)(const char *name), bool *is_on,
+		 int count)
+{
+	for (int i = 0; i < count; ++i)
+		is_on[i] = false;
+	for (char *name = strtok(list, ","); name != NULL;
+	     name = strtok(NULL, ",")) {
+		int i = find(name);
+		if (i < 0)
+			return -1;
+		is_on[i] = true;
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const int dataset_count = sizeof(bench_datasets) /
+				  sizeof(bench_datasets[0]);
+	struct bench b;
+	memset(&b, 0, sizeof(b));
+	for (int i = 0; i < dataset_count; ++i)
+		b.datasets[i] = true;
+	for (int i = 0; i < bench_stage_MAX; ++i)
+		b.stages[i] = true;
+	char default_sizes[] = "1K,10K,100K,1M,10M";
+	char *sizes = default_sizes;
+	b.run_count = BENCH_RUNS_DEFAULT;
+	b.dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+	bool is_ok = true;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:s:S:t:k:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			is_ok &= bench_parse_list(optarg, bench_find_dataset,
+						  b.datasets, dataset_count) == 0;
+			break;
+		case 's':
+			sizes = optarg;
+			break;
+		case 'S':
+			is_ok &= bench_parse_list(optarg, bench_find_stage,
+						  b.stages, bench_stage_MAX) == 0;
+			break;
+		case 't':
+			b.trials = atoi(optarg);
+			is_ok &= b.trials > 0;
+			break;
+		case 'k':
+			b.run_count = atoi(optarg);
+			is_ok &= b.run_count > 0;
+			break;
+		case 'w':
+			b.dir = optarg;
+			break;
+		default:
+			is_ok = false;
+			break;
+		}
+	}
+	for (char *str = strtok(sizes, ","); str != NULL && is_ok;
+	     str = strtok(NULL, ",")) {
+		size_t size = bench_parse_size(str);
+		is_ok = size > 0;
+		b.sizes = realloc(b.sizes, (b.size_count + 1) * sizeof(size_t));
+		b.sizes[b.size_count++] = size;
+	}
+	if (!is_ok || optind != argc) {
+		printf("Usage: %s [-d datasets] [-s sizes] [-S stages] "
+		       "[-t trials] [-k runs] [-w dir]\n", argv[0]);
+		printf("  datasets: random,sorted,reverse,organ,few_unique,"
+		       "zipf,equal\n");
+		printf("  sizes: 1K,10K,100K,1M,10M by default, up to 100M "
+		       "takes about 2 GB of memory\n");
+		printf("  stages: parse,sort,merge\n");
+		return 1;
+	}
+	printf("dataset,size,stage,trials,p50_ms,p99_ms,p50_mvals_s,"
+	       "p99_mvals_s\n");
+	for (int i = 0; i < b.size_count; ++i) {
+		for (int j = 0; j < dataset_count; ++j) {
+			if (b.datasets[j])
+				bench_run_dataset(&b, &bench_datasets[j],
+						  b.sizes[i]);
+		}
+	}
+	free(b.sizes);
+	free(b.data);
+	free(b.work);
+	free(b.sorted);
+	free(b.times);
+	return 0;
+}
@@ -0,0 +1,2200 @@
+#include "libcoro.h"
+#include "coro_sync.h"
+#include "int_reader.h"
+#include "int_writer.h"
+#include "kmerge.h"
+#include "pmerge.h"
+#include "int_sort.h"
+#include "extsort.h"
+#include "pipeline.h"
+#include "run_file.h"
+#include "run_cache.h"
+#include "query.h"
+#include "unit.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Each test runs on a runtime of 1 thread, where the coroutines
+ * only interleave at switches, and of TEST_THREADS threads, where
+ * they also run in parallel and get stolen between the workers.
+ */
+enum {
+	TEST_THREADS = 4,
+};
+
+static const int test_thread_counts[] = {1, TEST_THREADS};
+
+/**
+ * Run @a func as the first coroutine of a new runtime and wait
+ * for it and for all the coroutines it has spawned.
+ */
+static void
+test_rt_run(int thread_count, coro_f func, void *arg)
+{
+	struct coro_rt *rt = coro_rt_new(thread_count);
+	coro_rt_spawn(rt, func, arg);
+	struct coro *c;
+	while ((c = coro_rt_wait(rt)) != NULL)
+		coro_delete(c);
+	coro_rt_delete(rt);
+}
+
+/** CLOCK_MONOTONIC time in nanoseconds. */
+static uint64_t
+test_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Time quantum. */
+
+enum {
+	QUANTUM_CORO_COUNT = 3,
+	/** How long each coroutine spins. */
+	QUANTUM_WORK_NS = 50000000,
+};
+
+struct quantum_ctx {
+	int yield_count;
+};
+
+static int
+quantum_spinner_f(void *arg)
+{
+	struct quantum_ctx *ctx = arg;
+	uint64_t deadline = test_now_ns() + QUANTUM_WORK_NS;
+	while (test_now_ns() < deadline) {
+		if (coro_quantum_is_expired()) {
+			__atomic_add_fetch(&ctx->yield_count, 1,
+					   __ATOMIC_RELAXED);
+			coro_yield();
+		}
+	}
+	return 0;
+}
+
+static int
+quantum_main_f(void *arg)
+{
+	for (int i = 0; i < QUANTUM_CORO_COUNT; ++i)
+		coro_new(quantum_spinner_f, arg);
+	return 0;
+}
+
+static void
+test_quantum(void)
+{
+	unit_test_start();
+
+	/*
+	 * A quantum much shorter than a signal delivery is clamped.
+	 * Otherwise the threads would only handle the timer.
+	 */
+	coro_quantum_set(1000);
+	for (size_t i = 0; i < sizeof(test_thread_counts) /
+	     sizeof(test_thread_counts[0]); ++i) {
+		int threads = test_thread_counts[i];
+		unit_msg("%d threads", threads);
+		struct quantum_ctx ctx = {0};
+		uint64_t start = test_now_ns();
+		test_rt_run(threads, quantum_main_f, &ctx);
+		uint64_t duration = test_now_ns() - start;
+		unit_msg("%d quanta in %d ms", ctx.yield_count,
+			 (int)(duration / 1000000));
+		unit_check(ctx.yield_count > 0, "the quantum expires");
+		unit_check((uint64_t)ctx.yield_count <=
+			   2 * threads * duration / CORO_QUANTUM_MIN_NS,
+			   "no more than one expiration per minimal quantum");
+		unit_check(duration < 20 * QUANTUM_WORK_NS,
+			   "the work is not stalled by the timer");
+	}
+	coro_quantum_set(0);
+
+	unit_test_finish();
+}
+
+/** Mutex. */
+
+enum {
+	MUTEX_CORO_COUNT = 10,
+	MUTEX_ITERATIONS = 1000,
+};
+
+struct mutex_ctx {
+	struct coro_mutex *m;
+	struct coro_wait_group *wg;
+	int counter;
+	int in_section;
+	bool is_broken;
+};
+
+static int
+mutex_worker_f(void *arg)
+{
+	struct mutex_ctx *ctx = arg;
+	for (int i = 0; i < MUTEX_ITERATIONS; ++i) {
+		coro_mutex_lock(ctx->m);
+		if (__atomic_add_fetch(&ctx->in_section, 1,
+				       __ATOMIC_RELAXED) != 1)
+			ctx->is_broken = true;
+		int value = ctx->counter;
+		/* Let the others run into the locked mutex. */
+		if (i % 3 == 0)
+			coro_yield();
+		ctx->counter = value + 1;
+		__atomic_sub_fetch(&ctx->in_section, 1, __ATOMIC_RELAXED);
+		coro_mutex_unlock(ctx->m);
+	}
+	coro_wait_group_done(ctx->wg);
+	return 0;
+}
+
+static int
+mutex_main_f(void *arg)
+{
+	struct mutex_ctx *ctx = arg;
+	coro_wait_group_add(ctx->wg, MUTEX_CORO_COUNT);
+	for (int i = 0; i < MUTEX_CORO_COUNT; ++i)
+		coro_new(mutex_worker_f, ctx);
+	coro_wait_group_wait(ctx->wg);
+	return 0;
+}
+
+static void
+test_mutex(void)
+{
+	unit_test_start();
+
+	struct coro_mutex *m = coro_mutex_new();
+	unit_check(coro_mutex_trylock(m), "trylock of a free mutex");
+	unit_check(! coro_mutex_trylock(m), "trylock of a locked mutex");
+	coro_mutex_unlock(m);
+	unit_check(coro_mutex_trylock(m), "trylock after unlock");
+	coro_mutex_unlock(m);
+
+	for (size_t i = 0; i < sizeof(test_thread_counts) /
+	     sizeof(test_thread_counts[0]); ++i) {
+		int threads = test_thread_counts[i];
+		unit_msg("%d threads", threads);
+		struct mutex_ctx ctx = {0};
+		ctx.m = m;
+		ctx.wg = coro_wait_group_new();
+		test_rt_run(threads, mutex_main_f, &ctx);
+		unit_check(! ctx.is_broken, "one owner at a time");
+		unit_check(ctx.counter == MUTEX_CORO_COUNT * MUTEX_ITERATIONS,
+			   "no lost increments");
+		unit_check(coro_mutex_trylock(m), "unlocked in the end");
+		coro_mutex_unlock(m);
+		coro_wait_group_delete(ctx.wg);
+	}
+	coro_mutex_delete(m);
+
+	unit_test_finish();
+}
+
+/** Condition variable. */
+
+enum {
+	COND_CONSUMER_COUNT = 5,
+	COND_ITEM_COUNT = 1000,
+};
+
+struct cond_ctx {
+	struct coro_mutex *m;
+	struct coro_cond *cond;
+	struct coro_wait_group *wg;
+	/** Produced, but not consumed yet. */
+	int ready;
+	/** Left to produce. */
+	int left;
+	int consumed;
+	/** For broadcast: waiters stay until it is set. */
+	bool is_open;
+	int waiting;
+	int passed;
+};
+
+static int
+cond_consumer_f(void *arg)
+{
+	struct cond_ctx *ctx = arg;
+	coro_mutex_lock(ctx->m);
+	while (true) {
+		while (ctx->ready == 0 && ctx->left > 0)
+			coro_cond_wait(ctx->cond, ctx->m);
+		if (ctx->ready == 0)
+			break;
+		--ctx->ready;
+		++ctx->consumed;
+	}
+	coro_mutex_unlock(ctx->m);
+	coro_wait_group_done(ctx->wg);
+	return 0;
+}
+
+static int
+cond_signal_main_f(void *arg)
+{
+	struct cond_ctx *ctx = arg;
+	coro_wait_group_add(ctx->wg, COND_CONSUMER_COUNT);
+	for (int i = 0; i < COND_CONSUMER_COUNT; ++i)
+		coro_new(cond_consumer_f, ctx);
+	for (int i = 0; i < COND_ITEM_COUNT; ++i) {
+		coro_mutex_lock(ctx->m);
+		++ctx->ready;
+		--ctx->left;
+		coro_cond_signal(ctx->cond);
+		coro_mutex_unlock(ctx->m);
+		if (i % 7 == 0)
+			coro_yield();
+	}
+	/* The consumers, which saw no items left, have to see the end. */
+	coro_mutex_lock(ctx->m);
+	coro_cond_broadcast(ctx->cond);
+	coro_mutex_unlock(ctx->m);
+	coro_wait_group_wait(ctx->wg);
+	return 0;
+}
+
+static int
+cond_waiter_f(void *arg)
+{
+	struct cond_ctx *ctx = arg;
+	coro_mutex_lock(ctx->m);
+	++ctx->waiting;
+	while (! ctx->is_open)
+		coro_cond_wait(ctx->cond, ctx->m);
+	++ctx->passed;
+	coro_mutex_unlock(ctx->m);
+	coro_wait_group_done(ctx->wg);
+	return 0;
+}
+
+static int
+cond_broadcast_main_f(void *arg)
+{
+	struct cond_ctx *ctx = arg;
+	coro_wait_group_add(ctx->wg, COND_CONSUMER_COUNT);
+	for (int i = 0; i < COND_CONSUMER_COUNT; ++i)
+		coro_new(cond_waiter_f, ctx);
+	/* Wait till all of them are in the wait. */
+	coro_mutex_lock(ctx->m);
+	while (ctx->waiting < COND_CONSUMER_COUNT) {
+		coro_mutex_unlock(ctx->m);
+		coro_yield();
+		coro_mutex_lock(ctx->m);
+	}
+	ctx->is_open = true;
+	coro_cond_broadcast(ctx->cond);
+	coro_mutex_unlock(ctx->m);
+	coro_wait_group_wait(ctx->wg);
+	return 0;
+}
+
+static void
+test_cond(void)
+{
+	unit_test_start();
+
+	for (size_t i = 0; i < sizeof(test_thread_counts) /
+	     sizeof(test_thread_counts[0]); ++i) {
+		int threads = test_thread_counts[i];
+		unit_msg("%d threads", threads);
+		struct cond_ctx ctx = {0};
+		ctx.m = coro_mutex_new();
+		ctx.cond = coro_cond_new();
+		ctx.wg = coro_wait_group_new();
+		ctx.left = COND_ITEM_COUNT;
+		test_rt_run(threads, cond_signal_main_f, &ctx);
+		unit_check(ctx.consumed == COND_ITEM_COUNT && ctx.ready == 0,
+			   "signal: all the items are consumed");
+
+		test_rt_run(threads, cond_broadcast_main_f, &ctx);
+		unit_check(ctx.passed == COND_CONSUMER_COUNT,
+			   "broadcast wakes up all the waiters");
+
+		coro_wait_group_delete(ctx.wg);
+		coro_cond_delete(ctx.cond);
+		coro_mutex_delete(ctx.m);
+	}
+
+	unit_test_finish();
+}
+
+/** Wait group. */
+
+enum {
+	WG_JOB_COUNT = 50,
+	WG_WAITER_COUNT = 3,
+};
+
+struct wg_ctx {
+	struct coro_wait_group *wg;
+	bool is_done[WG_JOB_COUNT];
+	int next_job;
+	/** Waiters, which saw all the jobs done. */
+	int waiters_ok;
+};
+
+static int
+wg_job_f(void *arg)
+{
+	struct wg_ctx *ctx = arg;
+	int id = __atomic_fetch_add(&ctx->next_job, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < id % 5; ++i)
+		coro_yield();
+	__atomic_store_n(&ctx->is_done[id], true, __ATOMIC_RELAXED);
+	coro_wait_group_done(ctx->wg);
+	return 0;
+}
+
+static int
+wg_waiter_f(void *arg)
+{
+	struct wg_ctx *ctx = arg;
+	coro_wait_group_wait(ctx->wg);
+	bool ok = true;
+	for (int i = 0; i < WG_JOB_COUNT; ++i)
+		ok = ok && __atomic_load_n(&ctx->is_done[i], __ATOMIC_RELAXED);
+	if (ok)
+		__atomic_add_fetch(&ctx->waiters_ok, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int
+wg_main_f(void *arg)
+{
+	struct wg_ctx *ctx = arg;
+	/* Empty group does not block. */
+	coro_wait_group_wait(ctx->wg);
+	coro_wait_group_add(ctx->wg, WG_JOB_COUNT);
+	for (int i = 0; i < WG_WAITER_COUNT; ++i)
+		coro_new(wg_waiter_f, ctx);
+	for (int i = 0; i < WG_JOB_COUNT; ++i)
+		coro_new(wg_job_f, ctx);
+	return 0;
+}
+
+static void
+test_wait_group(void)
+{
+	unit_test_start();
+
+	for (size_t i = 0; i < sizeof(test_thread_counts) /
+	     sizeof(test_thread_counts[0]); ++i) {
+		int threads = test_thread_counts[i];
+		unit_msg("%d threads", threads);
+		struct wg_ctx ctx = {0};
+		ctx.wg = coro_wait_group_new();
+		test_rt_run(threads, wg_main_f, &ctx);
+		unit_check(ctx.waiters_ok == WG_WAITER_COUNT,
+			   "all the waiters saw all the jobs done");
+		coro_wait_group_delete(ctx.wg);
+	}
+
+	unit_test_finish();
+}
+
+/** Channel. */
+
+enum {
+	CHAN_PRODUCER_COUNT = 4,
+	CHAN_CONSUMER_COUNT = 3,
+	CHAN_MSG_COUNT = 1000,
+	CHAN_CAPACITY = 4,
+};
+
+struct chan_ctx {
+	struct coro_chan *ch;
+	struct coro_wait_group *producers;
+	int next_producer;
+	long long sum;
+	int received;
+	/** Receivers, which got EPIPE in the end. */
+	int closed_seen;
+	bool is_broken;
+};
+
+static int
+chan_producer_f(void *arg)
+{
+	struct chan_ctx *ctx = arg;
+	int id = __atomic_fetch_add(&ctx->next_producer, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < CHAN_MSG_COUNT; ++i) {
+		intptr_t msg = id * CHAN_MSG_COUNT + i + 1;
+		if (coro_chan_send(ctx->ch, (void *)msg) != 0)
+			ctx->is_broken = true;
+	}
+	coro_wait_group_done(ctx->producers);
+	return 0;
+}
+
+static int
+chan_consumer_f(void *arg)
+{
+	struct chan_ctx *ctx = arg;
+	void *msg;
+	while (coro_chan_recv(ctx->ch, &msg) == 0) {
+		__atomic_add_fetch(&ctx->sum, (intptr_t)msg, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ctx->received, 1, __ATOMIC_RELAXED);
+	}
+	if (errno == EPIPE)
+		__atomic_add_fetch(&ctx->closed_seen, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int
+chan_main_f(void *arg)
+{
+	struct chan_ctx *ctx = arg;
+	coro_wait_group_add(ctx->producers, CHAN_PRODUCER_COUNT);
+	for (int i = 0; i < CHAN_CONSUMER_COUNT; ++i)
+		coro_new(chan_consumer_f, ctx);
+	for (int i = 0; i < CHAN_PRODUCER_COUNT; ++i)
+		coro_new(chan_producer_f, ctx);
+	coro_wait_group_wait(ctx->producers);
+	coro_chan_close(ctx->ch);
+	return 0;
+}
+
+static int
+chan_drain_f(void *arg)
+{
+	struct chan_ctx *ctx = arg;
+	for (intptr_t i = 1; i <= CHAN_CAPACITY; ++i) {
+		if (coro_chan_send(ctx->ch, (void *)i) != 0)
+			ctx->is_broken = true;
+	}
+	coro_chan_close(ctx->ch);
+	if (coro_chan_send(ctx->ch, (void *)1) == 0 || errno != EPIPE)
+		ctx->is_broken = true;
+	void *msg;
+	for (intptr_t i = 1; i <= CHAN_CAPACITY; ++i) {
+		/* Buffered messages are drained in order after close. */
+		if (coro_chan_recv(ctx->ch, &msg) != 0 || (intptr_t)msg != i)
+			ctx->is_broken = true;
+	}
+	if (coro_chan_recv(ctx->ch, &msg) == 0 || errno != EPIPE)
+		ctx->is_broken = true;
+	return 0;
+}
+
+static void
+test_chan(void)
+{
+	unit_test_start();
+
+	long long total = (long long)CHAN_PRODUCER_COUNT * CHAN_MSG_COUNT;
+	for (size_t i = 0; i < sizeof(test_thread_counts) /
+	     sizeof(test_thread_counts[0]); ++i) {
+		int threads = test_thread_counts[i];
+		unit_msg("%d threads", threads);
+		struct chan_ctx ctx = {0};
+		ctx.ch = coro_chan_new(CHAN_CAPACITY);
+		ctx.producers = coro_wait_group_new();
+		test_rt_run(threads, chan_main_f, &ctx);
+		unit_check(! ctx.is_broken, "all sends succeeded");
+		unit_check(ctx.received == total &&
+			   ctx.sum == total * (total + 1) / 2,
+			   "each message is received once");
+		unit_check(ctx.closed_seen == CHAN_CONSUMER_COUNT,
+			   "close wakes up all the receivers");
+		unit_check(coro_chan_count(ctx.ch) == 0, "channel is empty");
+		coro_wait_group_delete(ctx.producers);
+		coro_chan_delete(ctx.ch);
+
+		ctx = (struct chan_ctx){0};
+		ctx.ch = coro_chan_new(CHAN_CAPACITY);
+		test_rt_run(threads, chan_drain_f, &ctx);
+		unit_check(! ctx.is_broken, "closed channel is drained, "\
+			   "then gives EPIPE");
+		coro_chan_delete(ctx.ch);
+	}
+
+	unit_test_finish();
+}
+
+/** Timers. */
+
+enum {
+	/** Tick of the timer wheel, 2^16 ns. */
+	TIMER_TICK_NS = 1 << 16,
+	/** Real time of one clock step, while the clock is driven. */
+	TIMER_STEP_NS = 20000,
+};
+
+/**
+ * Deadlines in ticks: each wheel level, their edges, and beyond
+ * the last level, which covers 64^4 ticks.
+ */
+static const uint64_t timer_ticks[] = {
+	0, 1, 2, 63, 64, 65, 100,
+	64 * 64 - 1, 64 * 64, 64 * 64 + 1, 100000,
+	64 * 64 * 64 - 1, 64 * 64 * 64, 64 * 64 * 64 + 1, 5000000,
+	64ULL * 64 * 64 * 64 - 1, 64ULL * 64 * 64 * 64,
+	64ULL * 64 * 64 * 64 + 1, 3 * 64ULL * 64 * 64 * 64 + 12345,
+};
+
+enum {
+	TIMER_COUNT = sizeof(timer_ticks) / sizeof(timer_ticks[0]),
+};
+
+struct timer_ctx {
+	uint64_t deadline[TIMER_COUNT];
+	int next_timer;
+	int early_count;
+	int woken_count;
+	struct coro_wait_group *wg;
+};
+
+static int
+timer_sleeper_f(void *arg)
+{
+	struct timer_ctx *ctx = arg;
+	int id = __atomic_fetch_add(&ctx->next_timer, 1, __ATOMIC_RELAXED);
+	/* Nobody else wakes it up - the return is the timer. */
+	coro_park_until(ctx->deadline[id]);
+	if (coro_now_ns() < ctx->deadline[id])
+		__atomic_add_fetch(&ctx->early_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ctx->woken_count, 1, __ATOMIC_RELAXED);
+	coro_wait_group_done(ctx->wg);
+	return 0;
+}
+
+static int
+timer_main_f(void *arg)
+{
+	struct timer_ctx *ctx = arg;
+	uint64_t now = coro_now_ns();
+	for (int i = 0; i < TIMER_COUNT; ++i) {
+		/* Not aligned to a tick, so the rounding matters. */
+		ctx->deadline[i] = now + timer_ticks[i] * TIMER_TICK_NS + 777;
+	}
+	coro_wait_group_add(ctx->wg, TIMER_COUNT);
+	for (int i = 0; i < TIMER_COUNT; ++i)
+		coro_new(timer_sleeper_f, ctx);
+	/*
+	 * Drive the clock by steps of random size - from less than a
+	 * tick to a good part of the last level - so every level gets
+	 * cascaded at different offsets.
+	 */
+	uint64_t rnd = 12345;
+	while (! coro_wait_group_wait_until(ctx->wg,
+					    coro_now_ns() + TIMER_STEP_NS)) {
+		rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+		int bits = (rnd >> 33) % 24;
+		coro_clock_advance((rnd >> 8) % ((uint64_t)TIMER_TICK_NS << bits));
+	}
+	return 0;
+}
+
+static void
+test_timer_levels(void)
+{
+	unit_test_start();
+
+	for (size_t i = 0; i < sizeof(test_thread_counts) /
+	     sizeof(test_thread_counts[0]); ++i) {
+		int threads = test_thread_counts[i];
+		unit_msg("%d threads", threads);
+		struct timer_ctx ctx = {0};
+		ctx.wg = coro_wait_group_new();
+		test_rt_run(threads, timer_main_f, &ctx);
+		unit_check(ctx.woken_count == TIMER_COUNT, "all timers fired");
+		unit_check(ctx.early_count == 0, "no timer fired early");
+		coro_wait_group_delete(ctx.wg);
+	}
+
+	unit_test_finish();
+}
+
+enum {
+	/** Timeout of the _until() calls, which have to expire. */
+	UNTIL_TIMEOUT_NS = 1000000,
+	/** Timeout of the waits, which must succeed. */
+	UNTIL_LONG_NS = 5000000000ULL,
+};
+
+struct until_ctx {
+	struct coro_chan *ch;
+	struct coro_mutex *m;
+	struct coro_cond *cond;
+	struct coro_wait_group *wg;
+	struct coro_wait_group *done;
+	bool is_waiting;
+	bool is_passed;
+	bool is_broken;
+};
+
+/** Check, that an _until() call took until its deadline. */
+static void
+until_check_expired(struct until_ctx *ctx, uint64_t deadline)
+{
+	if (coro_now_ns() < deadline || errno != ETIMEDOUT)
+		ctx->is_broken = true;
+}
+
+static int
+until_receiver_f(void *arg)
+{
+	struct until_ctx *ctx = arg;
+	void *msg;
+	__atomic_store_n(&ctx->is_waiting, true, __ATOMIC_RELAXED);
+	if (coro_chan_recv(ctx->ch, &msg) != 0 || (intptr_t)msg != 2)
+		ctx->is_broken = true;
+	coro_wait_group_done(ctx->done);
+	return 0;
+}
+
+static int
+until_cond_waiter_f(void *arg)
+{
+	struct until_ctx *ctx = arg;
+	coro_mutex_lock(ctx->m);
+	__atomic_store_n(&ctx->is_waiting, true, __ATOMIC_RELAXED);
+	while (! ctx->is_passed)
+		coro_cond_wait(ctx->cond, ctx->m);
+	coro_mutex_unlock(ctx->m);
+	coro_wait_group_done(ctx->done);
+	return 0;
+}
+
+/** Yield until the spawned waiter has started its wait. */
+static void
+until_wait_waiting(struct until_ctx *ctx)
+{
+	while (! __atomic_load_n(&ctx->is_waiting, __ATOMIC_RELAXED))
+		coro_sleep(10000);
+	__atomic_store_n(&ctx->is_waiting, false, __ATOMIC_RELAXED);
+	/* Let it get from the flag into the wait list. */
+	coro_sleep(100000);
+}
+
+static int
+until_main_f(void *arg)
+{
+	struct until_ctx *ctx = arg;
+	void *msg;
+	uint64_t deadline;
+	/*
+	 * A timed out receiver leaves the wait list: the next message
+	 * goes to the receiver after it, not to a gone waiter.
+	 */
+	deadline = coro_now_ns() + UNTIL_TIMEOUT_NS;
+	if (coro_chan_recv_until(ctx->ch, &msg, deadline) == 0)
+		ctx->is_broken = true;
+	until_check_expired(ctx, deadline);
+	coro_wait_group_add(ctx->done, 1);
+	coro_new(until_receiver_f, ctx);
+	until_wait_waiting(ctx);
+	if (coro_chan_send(ctx->ch, (void *)2) != 0)
+		ctx->is_broken = true;
+	if (! coro_wait_group_wait_until(ctx->done,
+					 coro_now_ns() + UNTIL_LONG_NS))
+		ctx->is_broken = true;
+	/* Same for a sender to a full channel. */
+	if (coro_chan_send(ctx->ch, (void *)1) != 0)
+		ctx->is_broken = true;
+	deadline = coro_now_ns() + UNTIL_TIMEOUT_NS;
+	if (coro_chan_send_until(ctx->ch, (void *)3, deadline) == 0)
+		ctx->is_broken = true;
+	until_check_expired(ctx, deadline);
+	if (coro_chan_count(ctx->ch) != 1 ||
+	    coro_chan_recv(ctx->ch, &msg) != 0 || (intptr_t)msg != 1)
+		ctx->is_broken = true;
+	/* Timed out cond wait returns with the mutex locked. */
+	coro_mutex_lock(ctx->m);
+	deadline = coro_now_ns() + UNTIL_TIMEOUT_NS;
+	if (coro_cond_wait_until(ctx->cond, ctx->m, deadline) ||
+	    coro_now_ns() < deadline || coro_mutex_trylock(ctx->m))
+		ctx->is_broken = true;
+	coro_mutex_unlock(ctx->m);
+	coro_wait_group_add(ctx->done, 1);
+	coro_new(until_cond_waiter_f, ctx);
+	until_wait_waiting(ctx);
+	coro_mutex_lock(ctx->m);
+	ctx->is_passed = true;
+	coro_cond_signal(ctx->cond);
+	coro_mutex_unlock(ctx->m);
+	if (! coro_wait_group_wait_until(ctx->done,
+					 coro_now_ns() + UNTIL_LONG_NS))
+		ctx->is_broken = true;
+	/* Wait group. */
+	coro_wait_group_add(ctx->wg, 1);
+	deadline = coro_now_ns() + UNTIL_TIMEOUT_NS;
+	if (coro_wait_group_wait_until(ctx->wg, deadline) ||
+	    coro_now_ns() < deadline)
+		ctx->is_broken = true;
+	coro_wait_group_done(ctx->wg);
+	if (! coro_wait_group_wait_until(ctx->wg,
+					 coro_now_ns() + UNTIL_LONG_NS))
+		ctx->is_broken = true;
+	return 0;
+}
+
+static void
+test_until_timeout(void)
+{
+	unit_test_start();
+
+	for (size_t i = 0; i < sizeof(test_thread_counts) /
+	     sizeof(test_thread_counts[0]); ++i) {
+		int threads = test_thread_counts[i];
+		unit_msg("%d threads", threads);
+		struct until_ctx ctx = {0};
+		ctx.ch = coro_chan_new(1);
+		ctx.m = coro_mutex_new();
+		ctx.cond = coro_cond_new();
+		ctx.wg = coro_wait_group_new();
+		ctx.done = coro_wait_group_new();
+		test_rt_run(threads, until_main_f, &ctx);
+		unit_check(! ctx.is_broken, "expired waits return a timeout "\
+			   "and leave the wait lists");
+		coro_wait_group_delete(ctx.done);
+		coro_wait_group_delete(ctx.wg);
+		coro_cond_delete(ctx.cond);
+		coro_mutex_delete(ctx.m);
+		coro_chan_delete(ctx.ch);
+	}
+
+	unit_test_finish();
+}
+
+enum {
+	RACE_COUNT = 300,
+};
+
+struct race_ctx {
+	struct coro_chan *ch;
+	struct coro_wait_group *wg;
+	uint64_t deadline;
+	int received;
+	int timed_out;
+	bool is_broken;
+};
+
+static int
+race_receiver_f(void *arg)
+{
+	struct race_ctx *ctx = arg;
+	void *msg;
+	if (coro_chan_recv_until(ctx->ch, &msg, ctx->deadline) == 0)
+		++ctx->received;
+	else if (errno == ETIMEDOUT)
+		++ctx->timed_out;
+	else
+		ctx->is_broken = true;
+	coro_wait_group_done(ctx->wg);
+	return 0;
+}
+
+static int
+race_main_f(void *arg)
+{
+	struct race_ctx *ctx = arg;
+	for (int i = 0; i < RACE_COUNT; ++i) {
+		uint64_t now = coro_now_ns();
+		ctx->deadline = now + 200000;
+		coro_wait_group_add(ctx->wg, 1);
+		coro_new(race_receiver_f, ctx);
+		/*
+		 * Send around the deadline: before, in the same timer
+		 * tick, or after.
+		 */
+		coro_sleep_until(now + (i % 17) * 25000);
+		int received = ctx->received;
+		if (coro_chan_send(ctx->ch, (void *)1) != 0)
+			ctx->is_broken = true;
+		coro_wait_group_wait(ctx->wg);
+		/*
+		 * The message is either received, or stays in the
+		 * channel - never lost to the timed out receiver.
+		 */
+		size_t left = coro_chan_count(ctx->ch);
+		if (ctx->received - received + (int)left != 1)
+			ctx->is_broken = true;
+		void *msg;
+		if (left != 0 && coro_chan_recv(ctx->ch, &msg) != 0)
+			ctx->is_broken = true;
+	}
+	return 0;
+}
+
+static void
+test_until_race(void)
+{
+	unit_test_start();
+
+	for (size_t i = 0; i < sizeof(test_thread_counts) /
+	     sizeof(test_thread_counts[0]); ++i) {
+		int threads = test_thread_counts[i];
+		unit_msg("%d threads", threads);
+		struct race_ctx ctx = {0};
+		ctx.ch = coro_chan_new(1);
+		ctx.wg = coro_wait_group_new();
+		test_rt_run(threads, race_main_f, &ctx);
+		unit_check(! ctx.is_broken, "a message sent at the deadline "\
+			   "is received or left in the channel");
+		unit_check(ctx.received + ctx.timed_out == RACE_COUNT,
+			   "each wait ends once");
+		unit_msg("received %d, timed out %d", ctx.received,
+			 ctx.timed_out);
+		coro_wait_group_delete(ctx.wg);
+		coro_chan_delete(ctx.ch);
+	}
+
+	unit_test_finish();
+}
+
+/** Wait without a deadline. */
+
+enum {
+	/** How long the receiver is left blocked. */
+	FOREVER_WAIT_NS = 200000000,
+};
+
+struct forever_ctx {
+	struct coro_chan *ch;
+	struct coro *receiver;
+	long long switch_count;
+	bool is_received;
+};
+
+static int
+forever_receiver_f(void *arg)
+{
+	struct forever_ctx *ctx = arg;
+	void *msg;
+	ctx->is_received = coro_chan_recv(ctx->ch, &msg) == 0;
+	return 0;
+}
+
+static int
+forever_main_f(void *arg)
+{
+	struct forever_ctx *ctx = arg;
+	ctx->receiver = coro_new(forever_receiver_f, ctx);
+	coro_sleep(FOREVER_WAIT_NS);
+	ctx->switch_count = coro_switch_count(ctx->receiver);
+	coro_chan_close(ctx->ch);
+	return 0;
+}
+
+static void
+test_wait_forever(void)
+{
+	unit_test_start();
+
+	for (size_t i = 0; i < sizeof(test_thread_counts) /
+	     sizeof(test_thread_counts[0]); ++i) {
+		int threads = test_thread_counts[i];
+		unit_msg("%d threads", threads);
+		struct forever_ctx ctx = {0};
+		ctx.ch = coro_chan_new(1);
+		test_rt_run(threads, forever_main_f, &ctx);
+		unit_msg("%lld switches", ctx.switch_count);
+		unit_check(ctx.switch_count == 1,
+			   "the blocked receiver is not woken up");
+		unit_check(! ctx.is_received, "close wakes it up in the end");
+		coro_chan_delete(ctx.ch);
+	}
+
+	unit_test_finish();
+}
+
+/** Integer writer. */
+
+enum {
+	/** Random values after the edge cases. */
+	WRITER_RANDOM_COUNT = 100000,
+	/** Small buffer, so the numbers are cut by the flushes. */
+	WRITER_BUFFER_SIZE = 61,
+};
+
+/** Zero, the limits, and the powers of ten with their neighbours. */
+static size_t
+writer_values(int *values)
+{
+	size_t count = 0;
+	values[count++] = 0;
+	values[count++] = INT_MIN;
+	values[count++] = INT_MIN + 1;
+	values[count++] = INT_MAX;
+	values[count++] = INT_MAX - 1;
+	for (int64_t p = 1; p <= INT_MAX; p *= 10) {
+		for (int64_t v = p - 1; v <= p + 1; ++v) {
+			if (v > INT_MAX)
+				continue;
+			values[count++] = v;
+			values[count++] = -v;
+		}
+	}
+	for (int i = 0; i < WRITER_RANDOM_COUNT; ++i)
+		values[count++] = (int)((uint32_t)rand() << 16 ^ rand());
+	return count;
+}
+
+/** Write the values to @a fd, array or one by one, read them back. */
+static bool
+writer_round_trip(int fd, const char *path, const int *values,
+		  size_t count, enum int_writer_format format,
+		  bool is_array)
+{
+	if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0)
+		return false;
+	struct int_writer w;
+	int_writer_create(&w, fd, format, WRITER_BUFFER_SIZE);
+	if (is_array) {
+		int_writer_put_array(&w, values, count);
+	} else {
+		for (size_t i = 0; i < count; ++i)
+			int_writer_put(&w, values[i]);
+	}
+	if (int_writer_destroy(&w) != 0)
+		return false;
+	struct int_array arr;
+	int_array_create(&arr);
+	bool ok;
+	if (format == INT_WRITER_TEXT) {
+		ok = int_array_load(&arr, path) == 0 && arr.size == count &&
+		     memcmp(arr.data, values, count * sizeof(int)) == 0;
+	} else {
+		int_array_reserve(&arr, count);
+		size_t size = count * sizeof(int);
+		ok = pread(fd, arr.data, size, 0) == (ssize_t)size &&
+		     memcmp(arr.data, values, size) == 0 &&
+		     lseek(fd, 0, SEEK_END) == (off_t)size;
+	}
+	int_array_destroy(&arr);
+	return ok;
+}
+
+static void
+test_writer_round_trip(void)
+{
+	unit_test_start();
+
+	int *values = malloc((WRITER_RANDOM_COUNT + 128) * sizeof(values[0]));
+	size_t count = writer_values(values);
+	bool is_formatted = true;
+	for (size_t i = 0; i < count; ++i) {
+		char expected[INT_WRITER_NUMBER_MAX + 1];
+		char out[INT_WRITER_NUMBER_MAX];
+		int len = snprintf(expected, sizeof(expected), "%d ", values[i]);
+		is_formatted = is_formatted &&
+			       int_format(out, values[i]) == (size_t)len &&
+			       memcmp(out, expected, len) == 0 &&
+			       int_format_length(values[i]) == (size_t)len;
+	}
+	unit_check(is_formatted, "numbers are formatted as by printf");
+
+	char path[] = "/tmp/coro_test_writer_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	unit_check(writer_round_trip(fd, path, values, count,
+				     INT_WRITER_TEXT, false),
+		   "text is read back by int_reader");
+	unit_check(writer_round_trip(fd, path, values, count,
+				     INT_WRITER_TEXT, true),
+		   "text of an array is read back by int_reader");
+	unit_check(writer_round_trip(fd, path, values, count,
+				     INT_WRITER_BINARY, false),
+		   "binary values are read back");
+	unit_check(writer_round_trip(fd, path, values, count,
+				     INT_WRITER_BINARY, true),
+		   "binary array is read back");
+	close(fd);
+	unlink(path);
+	free(values);
+
+	unit_test_finish();
+}
+
+/** K-way merge. */
+
+enum {
+	KMERGE_RUN_SIZE_MAX = 300,
+	KMERGE_SHAPE_COUNT = 4,
+};
+
+static int
+test_int_cmp(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Value of a run of @a shape: random, few distinct values, all
+ * equal, or the limits of int.
+ */
+static int
+kmerge_value(int shape)
+{
+	switch (shape) {
+	case 0:
+		return (int)((uint32_t)rand() << 16 ^ rand());
+	case 1:
+		return rand() % 4;
+	case 2:
+		return 7;
+	default:
+		return rand() % 2 == 0 ? INT_MIN : INT_MAX;
+	}
+}
+
+/** Make @a count sorted runs, some of them empty, in @a values. */
+static size_t
+kmerge_fill(int *values, struct kmerge_run *runs, int count, int shape)
+{
+	size_t total = 0;
+	for (int i = 0; i < count; ++i) {
+		size_t size = rand() % 4 == 0 ? 0 :
+			      (size_t)rand() % KMERGE_RUN_SIZE_MAX;
+		int *run = values + total;
+		for (size_t j = 0; j < size; ++j)
+			run[j] = kmerge_value(shape);
+		qsort(run, size, sizeof(run[0]), test_int_cmp);
+		runs[i] = (struct kmerge_run){run, run + size, NULL, NULL};
+		total += size;
+	}
+	return total;
+}
+
+/** Source of a run, which is given to the merge in small pieces. */
+struct kmerge_source {
+	const int *next;
+	const int *end;
+	size_t piece;
+};
+
+static void
+kmerge_refill_piece(struct kmerge_run *run)
+{
+	struct kmerge_source *src = run->arg;
+	size_t size = src->end - src->next;
+	if (size > src->piece)
+		size = src->piece;
+	run->cur = src->next;
+	run->end = src->next + size;
+	src->next += size;
+}
+
+/**
+ * Merge the runs, by pieces if @a piece is not 0, and compare with
+ * the sorted @a expected.
+ */
+static bool
+kmerge_check(struct kmerge_run *runs, int count, const int *expected,
+	     size_t total, size_t piece)
+{
+	struct kmerge_source *sources = calloc(count, sizeof(sources[0]));
+	if (piece != 0) {
+		for (int i = 0; i < count; ++i) {
+			sources[i] = (struct kmerge_source){runs[i].cur,
+							    runs[i].end, piece};
+			runs[i] = (struct kmerge_run){NULL, NULL,
+						      kmerge_refill_piece,
+						      &sources[i]};
+		}
+	}
+	struct kmerge m;
+	kmerge_create(&m, runs, count);
+	size_t pos = 0;
+	bool ok = true;
+	const int *block;
+	size_t size;
+	while ((size = kmerge_next(&m, &block)) > 0) {
+		if (pos + size > total ||
+		    memcmp(block, expected + pos, size * sizeof(int)) != 0)
+			ok = false;
+		pos += size;
+	}
+	kmerge_destroy(&m);
+	free(sources);
+	return ok && pos == total;
+}
+
+static void
+test_kmerge(void)
+{
+	unit_test_start();
+
+	static const int counts[] = {1, 2, 3, 5, 8, 17, 64};
+	static const size_t pieces[] = {0, 1, 3};
+	int max_count = counts[sizeof(counts) / sizeof(counts[0]) - 1];
+	int *values = malloc(max_count * KMERGE_RUN_SIZE_MAX *
+			     sizeof(values[0]));
+	int *expected = malloc(max_count * KMERGE_RUN_SIZE_MAX *
+			       sizeof(expected[0]));
+	struct kmerge_run *runs = malloc(max_count * sizeof(runs[0]));
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		for (int shape = 0; shape < KMERGE_SHAPE_COUNT; ++shape) {
+			for (size_t j = 0; j < sizeof(pieces) /
+			     sizeof(pieces[0]); ++j) {
+				size_t total = kmerge_fill(values, runs,
+							   counts[i], shape);
+				memcpy(expected, values, total * sizeof(int));
+				qsort(expected, total, sizeof(int),
+				      test_int_cmp);
+				ok = ok && kmerge_check(runs, counts[i],
+							expected, total,
+							pieces[j]);
+			}
+		}
+	}
+	unit_check(ok, "merge of runs with empty ones and duplicates is "\
+		   "sorted");
+
+	/* All runs are empty. */
+	for (int i = 0; i < max_count; ++i)
+		runs[i] = (struct kmerge_run){values, values, NULL, NULL};
+	unit_check(kmerge_check(runs, max_count, expected, 0, 0),
+		   "merge of empty runs is empty");
+
+	free(runs);
+	free(expected);
+	free(values);
+
+	unit_test_finish();
+}
+
+/** Merge split and parallel merge. */
+
+enum {
+	/** Enough values for several slices of PMERGE_SLICE_MIN. */
+	PMERGE_TEST_RUN_SIZE = 100000,
+	PMERGE_TEST_RUN_COUNT = 7,
+};
+
+/**
+ * Check the split of the runs at @a rank: it takes @a rank values,
+ * none of them is bigger than the values after it, and it is not to
+ * the left of the split at a smaller rank @a prev.
+ */
+static bool
+kmerge_split_check(const struct kmerge_run *runs, int count, size_t rank,
+		   const size_t *split, const size_t *prev)
+{
+	size_t sum = 0;
+	int64_t max_before = INT64_MIN, min_after = INT64_MAX;
+	for (int i = 0; i < count; ++i) {
+		size_t size = runs[i].end - runs[i].cur;
+		if (split[i] > size || (prev != NULL && split[i] < prev[i]))
+			return false;
+		sum += split[i];
+		if (split[i] > 0 && runs[i].cur[split[i] - 1] > max_before)
+			max_before = runs[i].cur[split[i] - 1];
+		if (split[i] < size && runs[i].cur[split[i]] < min_after)
+			min_after = runs[i].cur[split[i]];
+	}
+	return sum == rank && max_before <= min_after;
+}
+
+static void
+test_kmerge_split(void)
+{
+	unit_test_start();
+
+	static const int counts[] = {1, 2, 3, 8, 17};
+	int max_count = counts[sizeof(counts) / sizeof(counts[0]) - 1];
+	int *values = malloc(max_count * KMERGE_RUN_SIZE_MAX *
+			     sizeof(values[0]));
+	struct kmerge_run *runs = malloc(max_count * sizeof(runs[0]));
+	size_t *split = malloc(max_count * sizeof(split[0]));
+	size_t *prev = malloc(max_count * sizeof(prev[0]));
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		for (int shape = 0; shape < KMERGE_SHAPE_COUNT; ++shape) {
+			size_t total = kmerge_fill(values, runs, counts[i],
+						   shape);
+			for (size_t rank = 0; rank <= total; ++rank) {
+				kmerge_split(runs, counts[i], rank, split);
+				ok = ok && kmerge_split_check(runs, counts[i],
+							      rank, split,
+							      rank > 0 ? prev :
+							      NULL);
+				memcpy(prev, split, counts[i] * sizeof(prev[0]));
+			}
+		}
+	}
+	unit_check(ok, "splits take the rank, are ordered and monotonic, "\
+		   "also inside equal values");
+	free(prev);
+	free(split);
+	free(runs);
+	free(values);
+
+	unit_test_finish();
+}
+
+/** Merge the runs into @a fd by kmerge and one writer. */
+static bool
+pmerge_serial(const struct kmerge_run *runs, int count, int fd,
+	      enum int_writer_format format)
+{
+	struct kmerge_run *copy = malloc(count * sizeof(copy[0]));
+	memcpy(copy, runs, count * sizeof(copy[0]));
+	struct kmerge m;
+	kmerge_create(&m, copy, count);
+	struct int_writer w;
+	int_writer_create(&w, fd, format, 0);
+	const int *block;
+	size_t size;
+	while ((size = kmerge_next(&m, &block)) > 0)
+		int_writer_put_array(&w, block, size);
+	kmerge_destroy(&m);
+	free(copy);
+	return int_writer_destroy(&w) == 0;
+}
+
+/** Make the file empty, for a new write from its start. */
+static int
+test_file_reset(int fd)
+{
+	if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0)
+		return -1;
+	return 0;
+}
+
+/** Read the whole file into a new buffer. */
+static char *
+test_file_read(int fd, size_t *size)
+{
+	off_t end = lseek(fd, 0, SEEK_END);
+	char *buf = malloc(end > 0 ? end : 1);
+	*size = end;
+	if (end < 0 || pread(fd, buf, end, 0) != end) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void
+test_pmerge(void)
+{
+	unit_test_start();
+
+	static const int thread_counts[] = {1, 2, 3, 4, 8};
+	static const enum int_writer_format formats[] = {
+		INT_WRITER_TEXT, INT_WRITER_BINARY,
+	};
+	int *values = malloc(PMERGE_TEST_RUN_COUNT * PMERGE_TEST_RUN_SIZE *
+			     sizeof(values[0]));
+	struct kmerge_run runs[PMERGE_TEST_RUN_COUNT];
+	char path[] = "/tmp/coro_test_pmerge_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	/* Duplicates across the runs put the slice edges inside them. */
+	for (int shape = 0; shape < 2; ++shape) {
+		int *run = values;
+		for (int i = 0; i < PMERGE_TEST_RUN_COUNT; ++i) {
+			size_t size = i == 0 ? 0 : PMERGE_TEST_RUN_SIZE - i;
+			for (size_t j = 0; j < size; ++j)
+				run[j] = shape == 0 ? kmerge_value(0) :
+					 rand() % 100 - 50;
+			qsort(run, size, sizeof(run[0]), test_int_cmp);
+			runs[i] = (struct kmerge_run){run, run + size, NULL,
+						      NULL};
+			run += size;
+		}
+		for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]);
+		     ++f) {
+			unit_fail_if(test_file_reset(fd) != 0);
+			unit_fail_if(!pmerge_serial(runs, PMERGE_TEST_RUN_COUNT,
+						    fd, formats[f]));
+			size_t expected_size;
+			char *expected = test_file_read(fd, &expected_size);
+			unit_fail_if(expected == NULL);
+			bool ok = true;
+			for (size_t t = 0; t < sizeof(thread_counts) /
+			     sizeof(thread_counts[0]); ++t) {
+				unit_fail_if(test_file_reset(fd) != 0);
+				unit_fail_if(pmerge_write(runs,
+							  PMERGE_TEST_RUN_COUNT,
+							  thread_counts[t], fd,
+							  formats[f]) != 0);
+				size_t size;
+				char *data = test_file_read(fd, &size);
+				ok = ok && data != NULL &&
+				     size == expected_size &&
+				     memcmp(data, expected, size) == 0;
+				free(data);
+			}
+			unit_msg("%s output, %s values",
+				 formats[f] == INT_WRITER_TEXT ? "text" :
+				 "binary", shape == 0 ? "random" : "few");
+			unit_check(ok, "the same as of the serial merge");
+			free(expected);
+		}
+	}
+	close(fd);
+	unlink(path);
+	free(values);
+
+	unit_test_finish();
+}
+
+/** Integer sort. */
+
+enum {
+	SORT_SHAPE_RANDOM,
+	SORT_SHAPE_SORTED,
+	SORT_SHAPE_REVERSED,
+	SORT_SHAPE_EQUAL,
+	SORT_SHAPE_LIMITS,
+	SORT_SHAPE_PIPE,
+	SORT_SHAPE_COUNT,
+};
+
+static const char *const sort_shape_names[] = {
+	"random", "sorted", "reversed", "equal", "limits", "organ pipe",
+};
+
+/** Sizes around the thresholds of the sorts. */
+static const size_t sort_sizes[] = {
+	0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33,
+	INT_SORT_INSERTION_MAX - 1, INT_SORT_INSERTION_MAX,
+	INT_SORT_INSERTION_MAX + 1,
+	INT_SORT_NETWORK_MAX - 1, INT_SORT_NETWORK_MAX,
+	INT_SORT_NETWORK_MAX + 1,
+	INT_SORT_NINTHER_MIN - 1, INT_SORT_NINTHER_MIN,
+	INT_SORT_NINTHER_MIN + 1,
+	INT_SORT_RADIX_MIN - 1, INT_SORT_RADIX_MIN, INT_SORT_RADIX_MIN + 1,
+	10007, 300000,
+};
+
+static void
+sort_fill(int *data, size_t size, int shape)
+{
+	for (size_t i = 0; i < size; ++i) {
+		switch (shape) {
+		case SORT_SHAPE_RANDOM:
+			data[i] = (int)((uint32_t)rand() << 16 ^ rand());
+			break;
+		case SORT_SHAPE_SORTED:
+			data[i] = (int)i - (int)(size / 2);
+			break;
+		case SORT_SHAPE_REVERSED:
+			data[i] = (int)(size - i) - (int)(size / 2);
+			break;
+		case SORT_SHAPE_EQUAL:
+			data[i] = -5;
+			break;
+		case SORT_SHAPE_LIMITS: {
+			static const int limits[] = {INT_MIN, INT_MAX, 0,
+						     INT_MIN + 1, INT_MAX - 1};
+			data[i] = limits[rand() % 5];
+			break;
+		}
+		default:
+			data[i] = i < size / 2 ? (int)i : (int)(size - i);
+			break;
+		}
+	}
+}
+
+typedef void (*sort_f)(int *data, size_t size, int_sort_yield_f yield,
+		       void *arg);
+
+static void
+sort_count_yield(void *arg)
+{
+	++*(int *)arg;
+}
+
+/**
+ * Sort every shape of every size by @a sort and compare with qsort.
+ * @retval Number of mismatches.
+ */
+static int
+sort_check(sort_f sort, const char *name)
+{
+	size_t max_size = sort_sizes[sizeof(sort_sizes) /
+				     sizeof(sort_sizes[0]) - 1];
+	int *data = malloc(max_size * sizeof(data[0]));
+	int *expected = malloc(max_size * sizeof(expected[0]));
+	int error_count = 0;
+	for (int shape = 0; shape < SORT_SHAPE_COUNT; ++shape) {
+		for (size_t i = 0; i < sizeof(sort_sizes) /
+		     sizeof(sort_sizes[0]); ++i) {
+			size_t size = sort_sizes[i];
+			sort_fill(data, size, shape);
+			memcpy(expected, data, size * sizeof(data[0]));
+			qsort(expected, size, sizeof(expected[0]),
+			      test_int_cmp);
+			int yield_count = 0;
+			sort(data, size, sort_count_yield, &yield_count);
+			if (memcmp(data, expected, size * sizeof(data[0])) != 0 ||
+			    (size >= 100000 && yield_count == 0)) {
+				unit_msg("%s: %s, %zu values", name,
+					 sort_shape_names[shape], size);
+				++error_count;
+			}
+		}
+	}
+	free(expected);
+	free(data);
+	return error_count;
+}
+
+static void
+test_int_sort(void)
+{
+	unit_test_start();
+
+	unit_check(sort_check(int_sort, "int_sort") == 0,
+		   "int_sort is the same as qsort");
+	unit_check(sort_check(int_sort_radix, "int_sort_radix") == 0,
+		   "int_sort_radix is the same as qsort");
+	unit_check(sort_check(int_sort_auto, "int_sort_auto") == 0,
+		   "int_sort_auto is the same as qsort");
+
+	unit_test_finish();
+}
+
+/** External sort. */
+
+enum {
+	EXTSORT_TEST_FILE_COUNT = 3,
+	EXTSORT_TEST_FILE_SIZE = 100000,
+	/** Gives 16K value chunks and merges of 3 runs. */
+	EXTSORT_TEST_MEMORY = 64 << 10,
+};
+
+static void
+test_extsort(void)
+{
+	unit_test_start();
+
+	static const enum int_writer_format formats[] = {
+		INT_WRITER_TEXT, INT_WRITER_BINARY,
+	};
+	int *values = malloc(EXTSORT_TEST_FILE_COUNT *
+			     EXTSORT_TEST_FILE_SIZE * sizeof(values[0]));
+	char paths[EXTSORT_TEST_FILE_COUNT][32];
+	size_t total = 0;
+	/* Random values, few values and an empty file. */
+	for (int i = 0; i < EXTSORT_TEST_FILE_COUNT; ++i) {
+		strcpy(paths[i], "/tmp/coro_test_extsort_XXXXXX");
+		int fd = mkstemp(paths[i]);
+		unit_fail_if(fd < 0);
+		size_t size = i == 2 ? 0 : EXTSORT_TEST_FILE_SIZE - i;
+		int *file = values + total;
+		for (size_t j = 0; j < size; ++j)
+			file[j] = i == 0 ? kmerge_value(0) : rand() % 100 - 50;
+		struct int_writer w;
+		int_writer_create(&w, fd, INT_WRITER_TEXT, 0);
+		int_writer_put_array(&w, file, size);
+		unit_fail_if(int_writer_destroy(&w) != 0);
+		close(fd);
+		total += size;
+	}
+	qsort(values, total, sizeof(values[0]), test_int_cmp);
+	struct kmerge_run sorted = {values, values + total, NULL, NULL};
+	char path[] = "/tmp/coro_test_extsort_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+		unit_fail_if(test_file_reset(fd) != 0);
+		unit_fail_if(!pmerge_serial(&sorted, 1, fd, formats[f]));
+		size_t expected_size;
+		char *expected = test_file_read(fd, &expected_size);
+		unit_fail_if(expected == NULL);
+
+		struct extsort e;
+		extsort_create(&e, "/tmp", EXTSORT_TEST_MEMORY, 1);
+		bool ok = true;
+		for (int i = 0; i < EXTSORT_TEST_FILE_COUNT; ++i)
+			ok = ok && extsort_add_file(&e, paths[i], NULL,
+						    NULL) == 0;
+		unit_msg("%s output", formats[f] == INT_WRITER_TEXT ? "text" :
+			 "binary");
+		unit_check(ok, "files are spilled");
+		unit_check(e.run_count > 3, "runs are merged in several passes");
+		unit_fail_if(test_file_reset(fd) != 0);
+		unit_fail_if(extsort_merge(&e, fd, formats[f]) != 0);
+		extsort_destroy(&e);
+		size_t size;
+		char *data = test_file_read(fd, &size);
+		unit_check(data != NULL && size == expected_size &&
+			   memcmp(data, expected, size) == 0,
+			   "the same as of the in-memory sort");
+		free(data);
+		free(expected);
+	}
+	close(fd);
+	unlink(path);
+	for (int i = 0; i < EXTSORT_TEST_FILE_COUNT; ++i)
+		unlink(paths[i]);
+	free(values);
+
+	unit_test_finish();
+}
+
+/** Parser limit. */
+
+/** Numbers of different lengths, signs and separators. */
+static const char parser_text[] =
+	"1 -22 333\n4444  -55555 6 77 -888 9999 0 -1 123456 7 - 8 "
+	"2147483647 -2147483648 42";
+
+static const int parser_values[] = {
+	1, -22, 333, 4444, -55555, 6, 77, -888, 9999, 0, -1, 123456, 7, 8,
+	2147483647, -2147483648, 42,
+};
+
+enum {
+	PARSER_VALUE_COUNT = sizeof(parser_values) / sizeof(parser_values[0]),
+};
+
+/**
+ * Feed the text by pieces of @a piece bytes into chunks of
+ * @a max_size values. Check, that each chunk is cut exactly, and
+ * that the values are all there.
+ */
+static bool
+parser_check_chunks(size_t piece, size_t max_size)
+{
+	size_t text_len = strlen(parser_text);
+	struct int_parser p;
+	int_parser_create(&p);
+	struct int_array chunk;
+	int_array_create(&chunk);
+	bool ok = true;
+	size_t got = 0;
+	for (size_t off = 0; off < text_len; off += piece) {
+		size_t len = piece < text_len - off ? piece : text_len - off;
+		size_t pos = 0;
+		while (true) {
+			pos += int_parser_feed_max(&p, parser_text + off + pos,
+						   len - pos, &chunk, max_size);
+			if (chunk.size < max_size)
+				break;
+			ok = ok && chunk.size == max_size;
+			for (size_t i = 0; i < chunk.size; ++i)
+				ok = ok &&
+				     chunk.data[i] == parser_values[got++];
+			chunk.size = 0;
+		}
+		ok = ok && pos == len;
+	}
+	/* The last number can fill the last chunk up. */
+	int_parser_finish(&p, &chunk);
+	ok = ok && chunk.size <= max_size &&
+	     got + chunk.size == PARSER_VALUE_COUNT;
+	for (size_t i = 0; i < chunk.size && ok; ++i)
+		ok = chunk.data[i] == parser_values[got++];
+	int_array_destroy(&chunk);
+	return ok;
+}
+
+static void
+test_parser_feed_max(void)
+{
+	unit_test_start();
+
+	bool ok = true;
+	for (size_t max = 1; max <= PARSER_VALUE_COUNT + 1; ++max) {
+		for (size_t piece = 1; piece < sizeof(parser_text); ++piece)
+			ok = ok && parser_check_chunks(piece, max);
+	}
+	unit_check(ok, "chunks of any size from pieces of any size");
+
+	unit_test_finish();
+}
+
+/** Pipeline chunks. */
+
+enum {
+	PIPELINE_TEST_CHUNK_SIZE = 300,
+	PIPELINE_TEST_FILE_COUNT = 3,
+};
+
+/** Each file ends with a partial chunk, except the empty one. */
+static const size_t pipeline_test_sizes[PIPELINE_TEST_FILE_COUNT] = {
+	1000, 0, 2500,
+};
+
+struct pipeline_test_ctx {
+	struct pipeline pl;
+	char paths[PIPELINE_TEST_FILE_COUNT][32];
+	/** All the values of the files in their order. */
+	int *values;
+	bool ok;
+};
+
+static int
+pipeline_test_parser_f(void *arg)
+{
+	struct pipeline_test_ctx *ctx = arg;
+	for (int i = 0; i < PIPELINE_TEST_FILE_COUNT; ++i) {
+		if (pipeline_parse_file(&ctx->pl, ctx->paths[i]) != 0)
+			ctx->ok = false;
+	}
+	pipeline_parser_done(&ctx->pl);
+	return 0;
+}
+
+/** Take the chunks instead of the sorters and check their sizes. */
+static int
+pipeline_test_receiver_f(void *arg)
+{
+	struct pipeline_test_ctx *ctx = arg;
+	coro_new(pipeline_test_parser_f, ctx);
+	const int *expected = ctx->values;
+	for (int i = 0; i < PIPELINE_TEST_FILE_COUNT; ++i) {
+		size_t left = pipeline_test_sizes[i];
+		while (left > 0) {
+			size_t size = left < PIPELINE_TEST_CHUNK_SIZE ? left :
+				      PIPELINE_TEST_CHUNK_SIZE;
+			void *msg;
+			if (coro_chan_recv(ctx->pl.parsed, &msg) != 0) {
+				ctx->ok = false;
+				return 0;
+			}
+			struct int_array *chunk = msg;
+			ctx->ok = ctx->ok && chunk->size == size &&
+				  memcmp(chunk->data, expected,
+					 size * sizeof(expected[0])) == 0;
+			expected += size;
+			left -= size;
+			int_array_destroy(chunk);
+			free(chunk);
+		}
+	}
+	void *msg;
+	ctx->ok = ctx->ok && coro_chan_recv(ctx->pl.parsed, &msg) != 0;
+	return 0;
+}
+
+static void
+test_pipeline_chunks(void)
+{
+	unit_test_start();
+
+	struct pipeline_test_ctx ctx;
+	size_t total = 0;
+	for (int i = 0; i < PIPELINE_TEST_FILE_COUNT; ++i)
+		total += pipeline_test_sizes[i];
+	ctx.values = malloc(total * sizeof(ctx.values[0]));
+	int *file = ctx.values;
+	for (int i = 0; i < PIPELINE_TEST_FILE_COUNT; ++i) {
+		strcpy(ctx.paths[i], "/tmp/coro_test_pipeline_XXXXXX");
+		int fd = mkstemp(ctx.paths[i]);
+		unit_fail_if(fd < 0);
+		for (size_t j = 0; j < pipeline_test_sizes[i]; ++j)
+			file[j] = kmerge_value(0);
+		struct int_writer w;
+		int_writer_create(&w, fd, INT_WRITER_TEXT, 0);
+		int_writer_put_array(&w, file, pipeline_test_sizes[i]);
+		unit_fail_if(int_writer_destroy(&w) != 0);
+		close(fd);
+		file += pipeline_test_sizes[i];
+	}
+	for (size_t t = 0; t < sizeof(test_thread_counts) /
+	     sizeof(test_thread_counts[0]); ++t) {
+		/* Not used, there is no merger. */
+		pipeline_create(&ctx.pl, PIPELINE_TEST_CHUNK_SIZE, 1, 0, 2, -1,
+				INT_WRITER_BINARY);
+		ctx.ok = true;
+		test_rt_run(test_thread_counts[t], pipeline_test_receiver_f,
+			    &ctx);
+		pipeline_destroy(&ctx.pl);
+		unit_msg("%d threads", test_thread_counts[t]);
+		unit_check(ctx.ok, "chunks have exactly chunk_size values, "
+			   "but the last of each file");
+	}
+	for (int i = 0; i < PIPELINE_TEST_FILE_COUNT; ++i)
+		unlink(ctx.paths[i]);
+	free(ctx.values);
+
+	unit_test_finish();
+}
+
+/** Run file search. */
+
+enum {
+	RUN_TEST_COUNT_MAX = 1000,
+	RUN_SHAPE_COUNT = 5,
+};
+
+/** Values of a run: @a count values of @a shape, sorted. */
+static void
+run_fill(int *values, size_t count, int shape, size_t step)
+{
+	for (size_t i = 0; i < count; ++i) {
+		switch (shape) {
+		case 0:
+			/* All equal. */
+			values[i] = 5;
+			break;
+		case 1:
+			/* Unique. */
+			values[i] = (int)i * 2;
+			break;
+		case 2:
+			/* Equal ones end exactly at the block edges. */
+			values[i] = (int)(i / step);
+			break;
+		case 3:
+			/* Equal ones cross the block edges. */
+			values[i] = (int)((i + step / 2) / (step + 1));
+			break;
+		default:
+			/* Long runs of duplicates, with negatives. */
+			values[i] = (int)(i / 37) * 3 - 20;
+			break;
+		}
+	}
+}
+
+static size_t
+run_brute_bound(const int *values, size_t count, int key, bool is_upper)
+{
+	size_t i = 0;
+	while (i < count && (values[i] < key || (is_upper && values[i] == key)))
+		++i;
+	return i;
+}
+
+/**
+ * Write a run of @a count values of @a shape into @a fd with the
+ * index @a step, and compare its bounds with the linear search for
+ * all the keys around the values.
+ * @retval Number of mismatches.
+ */
+static int
+run_check_bounds(int fd, const char *path, int *values, size_t count,
+		 int shape, size_t step)
+{
+	run_fill(values, count, shape, step);
+	unit_fail_if(test_file_reset(fd) != 0);
+	struct run_file_writer wr;
+	run_file_writer_create(&wr, fd, step);
+	/* Blocks of odd sizes, so the index crosses them. */
+	for (size_t pos = 0, len = 1; pos < count; pos += len, len += 5) {
+		if (len > count - pos)
+			len = count - pos;
+		run_file_writer_put_array(&wr, values + pos, len);
+	}
+	unit_fail_if(run_file_writer_destroy(&wr) != 0);
+	struct run_file rf;
+	unit_fail_if(run_file_open(&rf, path) != 0);
+	int min = count > 0 ? values[0] : 0;
+	int max = count > 0 ? values[count - 1] : 0;
+	int error_count = 0;
+	for (int key = min - 2; key <= max + 2; ++key) {
+		if (run_file_lower_bound(&rf, key) ==
+		    run_brute_bound(values, count, key, false) &&
+		    run_file_upper_bound(&rf, key) ==
+		    run_brute_bound(values, count, key, true))
+			continue;
+		unit_msg("step %zu, count %zu, shape %d, key %d", step, count,
+			 shape, key);
+		++error_count;
+	}
+	run_file_close(&rf);
+	return error_count;
+}
+
+static void
+test_run_file_bounds(void)
+{
+	unit_test_start();
+
+	static const size_t steps[] = {1, 2, 3, 7, 64};
+	static const size_t counts[] = {0, 1, 2, 6, 7, 8, 63, 64, 65, 449,
+					RUN_TEST_COUNT_MAX};
+	char path[] = "/tmp/coro_test_run_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	int *values = malloc(RUN_TEST_COUNT_MAX * sizeof(values[0]));
+	int error_count = 0;
+	for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); ++i) {
+		for (size_t j = 0; j < sizeof(counts) / sizeof(counts[0]); ++j) {
+			for (int shape = 0; shape < RUN_SHAPE_COUNT; ++shape) {
+				error_count += run_check_bounds(fd, path, values,
+								counts[j], shape,
+								steps[i]);
+			}
+		}
+	}
+	unit_check(error_count == 0, "bounds match the linear search on "
+		   "duplicates and block edges");
+	free(values);
+	close(fd);
+	unlink(path);
+
+	unit_test_finish();
+}
+
+/** File ranges. */
+
+enum {
+	/** Values of the big file, it is read in several pieces. */
+	RANGE_BIG_COUNT = 400000,
+	RANGE_BIG_PARTS = 7,
+};
+
+/** Numbers of different lengths and signs, odd separators. */
+static const char range_text[] =
+	"12 -3  456\n-7890 1\t\t22 - 333 -4 55555\n\n6 -77 8 999999 ";
+
+/**
+ * Load the file by ranges, cut at @a cuts, and compare with the
+ * load of the whole file.
+ */
+static bool
+range_check(const char *path, const off_t *cuts, int cut_count,
+	    const struct int_array *whole)
+{
+	struct int_array arr;
+	int_array_create(&arr);
+	bool ok = true;
+	for (int i = 0; i <= cut_count && ok; ++i) {
+		off_t from = i == 0 ? 0 : cuts[i - 1];
+		off_t to = i == cut_count ? -1 : cuts[i];
+		ok = int_array_load_range(&arr, path, from, to) == 0;
+	}
+	ok = ok && arr.size == whole->size &&
+	     memcmp(arr.data, whole->data, arr.size * sizeof(arr.data[0])) == 0;
+	int_array_destroy(&arr);
+	return ok;
+}
+
+static void
+test_file_ranges(void)
+{
+	unit_test_start();
+
+	char path[] = "/tmp/coro_test_range_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	unit_fail_if(write(fd, range_text, strlen(range_text)) !=
+		     (ssize_t)strlen(range_text));
+	struct int_array whole;
+	int_array_create(&whole);
+	unit_fail_if(int_array_load(&whole, path) != 0);
+	unit_check(whole.size == 13, "the whole file is loaded");
+	bool ok = true;
+	off_t len = strlen(range_text);
+	for (off_t a = 0; a <= len + 1; ++a) {
+		for (off_t b = a; b <= len + 1; ++b) {
+			off_t cuts[] = {a, b};
+			ok = ok && range_check(path, cuts, 2, &whole);
+		}
+	}
+	unit_check(ok, "three ranges cut at any offsets have each value once");
+
+	/* Cuts inside the pieces, in which the ranges are read. */
+	int *values = malloc(RANGE_BIG_COUNT * sizeof(values[0]));
+	for (int i = 0; i < RANGE_BIG_COUNT; ++i)
+		values[i] = kmerge_value(0);
+	unit_fail_if(test_file_reset(fd) != 0);
+	struct int_writer w;
+	int_writer_create(&w, fd, INT_WRITER_TEXT, 0);
+	int_writer_put_array(&w, values, RANGE_BIG_COUNT);
+	unit_fail_if(int_writer_destroy(&w) != 0);
+	off_t size = lseek(fd, 0, SEEK_END);
+	off_t cuts[RANGE_BIG_PARTS - 1];
+	for (int i = 0; i < RANGE_BIG_PARTS - 1; ++i)
+		cuts[i] = size * (i + 1) / RANGE_BIG_PARTS;
+	whole.size = 0;
+	unit_fail_if(int_array_load(&whole, path) != 0);
+	unit_check(whole.size == RANGE_BIG_COUNT &&
+		   memcmp(whole.data, values, sizeof(values[0]) *
+			  RANGE_BIG_COUNT) == 0, "the big file is loaded");
+	unit_check(range_check(path, cuts, RANGE_BIG_PARTS - 1, &whole),
+		   "parts of the big file have each value once");
+	free(values);
+	int_array_destroy(&whole);
+	close(fd);
+	unlink(path);
+
+	unit_test_finish();
+}
+
+/** Run cache. */
+
+enum {
+	CACHE_TEST_COUNT = 1000,
+};
+
+/** Write the values as text and set the mtime @a age_ns ago. */
+static void
+cache_write_input(const char *path, const int *values, size_t count,
+		  int64_t age_ns)
+{
+	int fd = open(path, O_WRONLY | O_TRUNC);
+	unit_fail_if(fd < 0);
+	struct int_writer w;
+	int_writer_create(&w, fd, INT_WRITER_TEXT, 0);
+	int_writer_put_array(&w, values, count);
+	unit_fail_if(int_writer_destroy(&w) != 0);
+	close(fd);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t mtime_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec -
+			   age_ns;
+	struct timespec times[2] = {
+		{.tv_nsec = UTIME_OMIT},
+		{.tv_sec = mtime_ns / 1000000000,
+		 .tv_nsec = mtime_ns % 1000000000},
+	};
+	unit_fail_if(utimensat(AT_FDCWD, path, times, 0) != 0);
+}
+
+/** Restore the mtime of the file after a change. */
+static void
+cache_set_mtime(const char *path, const struct timespec *mtime)
+{
+	struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, *mtime};
+	unit_fail_if(utimensat(AT_FDCWD, path, times, 0) != 0);
+}
+
+/**
+ * Reopen the cache and look the input up.
+ * @retval 1 The run of the values is found.
+ * @retval 0 No run.
+ * @retval -1 The run is of other values.
+ */
+static int
+cache_lookup(const char *dir, const char *path, const int *sorted,
+	     size_t count)
+{
+	struct run_cache c;
+	unit_fail_if(run_cache_open(&c, dir) != 0);
+	struct run_cache_key key;
+	unit_fail_if(run_cache_key_create(&c, &key, path) != 0);
+	struct run_file rf;
+	int rc = 0;
+	if (run_cache_get(&c, &key, &rf) == 0) {
+		rc = rf.count == count &&
+		     memcmp(rf.data, sorted, count * sizeof(sorted[0])) == 0 ?
+		     1 : -1;
+		run_file_close(&rf);
+	}
+	run_cache_key_destroy(&key);
+	run_cache_close(&c);
+	return rc;
+}
+
+/** Sort the values of the file into the cache and save it. */
+static void
+cache_store(const char *dir, const char *path, int *values, size_t count)
+{
+	struct run_cache c;
+	unit_fail_if(run_cache_open(&c, dir) != 0);
+	struct run_cache_key key;
+	unit_fail_if(run_cache_key_create(&c, &key, path) != 0);
+	qsort(values, count, sizeof(values[0]), test_int_cmp);
+	unit_fail_if(run_cache_put(&c, &key, values, count) != 0);
+	unit_fail_if(run_cache_save(&c) != 0);
+	run_cache_key_destroy(&key);
+	run_cache_close(&c);
+}
+
+static void
+cache_remove_dir(const char *dir)
+{
+	DIR *d = opendir(dir);
+	unit_fail_if(d == NULL);
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		unlink(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+static void
+test_run_cache(void)
+{
+	unit_test_start();
+
+	char dir[] = "/tmp/coro_test_cache_XXXXXX";
+	unit_fail_if(mkdtemp(dir) == NULL);
+	char path[] = "/tmp/coro_test_input_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	close(fd);
+	/* The values keep their text length, so the size stays. */
+	int values[CACHE_TEST_COUNT];
+	for (int i = 0; i < CACHE_TEST_COUNT; ++i)
+		values[i] = 100000 + rand() % 900000;
+
+	/* An old mtime, which is far from the time of the record. */
+	cache_write_input(path, values, CACHE_TEST_COUNT,
+			  10 * RUN_CACHE_RACY_NS);
+	unit_check(cache_lookup(dir, path, values, CACHE_TEST_COUNT) == 0,
+		   "miss before the run is stored");
+	cache_store(dir, path, values, CACHE_TEST_COUNT);
+	unit_check(cache_lookup(dir, path, values, CACHE_TEST_COUNT) == 1,
+		   "hit after the cache is saved and reopened");
+
+	for (int i = 0; i < CACHE_TEST_COUNT; ++i)
+		values[i] = 100000 + rand() % 900000;
+	cache_write_input(path, values, CACHE_TEST_COUNT,
+			  5 * RUN_CACHE_RACY_NS);
+	unit_check(cache_lookup(dir, path, values, CACHE_TEST_COUNT) == 0,
+		   "miss after a change of the content and mtime");
+	cache_store(dir, path, values, CACHE_TEST_COUNT);
+
+	/* The same size and mtime vouch for the content, like in make. */
+	struct stat st;
+	unit_fail_if(stat(path, &st) != 0);
+	int old[CACHE_TEST_COUNT];
+	memcpy(old, values, sizeof(old));
+	for (int i = 0; i < CACHE_TEST_COUNT; ++i)
+		values[i] = 100000 + rand() % 900000;
+	cache_write_input(path, values, CACHE_TEST_COUNT, 0);
+	cache_set_mtime(path, &st.st_mtim);
+	unit_check(cache_lookup(dir, path, old, CACHE_TEST_COUNT) == 1,
+		   "an old mtime is trusted without reading the file");
+
+	/*
+	 * A change right after the record keeps the mtime within the
+	 * clock tick - such a record doesn't vouch for the content.
+	 */
+	cache_write_input(path, values, CACHE_TEST_COUNT, 0);
+	cache_store(dir, path, values, CACHE_TEST_COUNT);
+	unit_fail_if(stat(path, &st) != 0);
+	for (int i = 0; i < CACHE_TEST_COUNT; ++i)
+		values[i] = 100000 + rand() % 900000;
+	cache_write_input(path, values, CACHE_TEST_COUNT, 0);
+	cache_set_mtime(path, &st.st_mtim);
+	unit_check(cache_lookup(dir, path, values, CACHE_TEST_COUNT) == 0,
+		   "a racy mtime makes the content rehashed, a miss");
+
+	unlink(path);
+	cache_remove_dir(dir);
+
+	unit_test_finish();
+}
+
+/** Queries. */
+
+enum {
+	QUERY_RUN_COUNT_MAX = 33,
+};
+
+/**
+ * Compare all the queries over the runs with the full sort of
+ * their values.
+ * @retval Number of mismatches.
+ */
+static int
+query_check(const struct kmerge_run *runs, int count, const int *values,
+	    size_t total)
+{
+	static const int permilles[] = {0, 1, 10, 250, 500, 900, 990, 999,
+					1000};
+	int *sorted = malloc((total + 1) * sizeof(sorted[0]));
+	memcpy(sorted, values, total * sizeof(sorted[0]));
+	qsort(sorted, total, sizeof(sorted[0]), test_int_cmp);
+	int *out = malloc((total + 1) * sizeof(out[0]));
+	int error_count = query_size(runs, count) != total;
+	size_t ks[] = {0, 1, total / 2, total, total + 5};
+	for (size_t i = 0; i < sizeof(ks) / sizeof(ks[0]); ++i) {
+		size_t k = ks[i] < total ? ks[i] : total;
+		if (query_top_k(runs, count, ks[i], out) != k ||
+		    memcmp(out, sorted, k * sizeof(out[0])) != 0)
+			++error_count;
+	}
+	for (size_t rank = 1; rank <= total; ++rank)
+		error_count += query_select(runs, count, rank) !=
+			       sorted[rank - 1];
+	for (size_t i = 0; i < sizeof(permilles) / sizeof(permilles[0]) &&
+	     total > 0; ++i) {
+		/* The nearest rank, in integers. */
+		size_t rank = (permilles[i] * total + 999) / 1000;
+		if (rank < 1)
+			rank = 1;
+		error_count += query_percentile(runs, count,
+						permilles[i] / 10.0) !=
+			       sorted[rank - 1];
+	}
+	free(out);
+	free(sorted);
+	return error_count;
+}
+
+static void
+test_query(void)
+{
+	unit_test_start();
+
+	static const int counts[] = {1, 2, 5, 9, QUERY_RUN_COUNT_MAX};
+	int *values = malloc(QUERY_RUN_COUNT_MAX * KMERGE_RUN_SIZE_MAX *
+			     sizeof(values[0]));
+	struct kmerge_run runs[QUERY_RUN_COUNT_MAX];
+	int error_count = 0;
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		for (int shape = 0; shape < KMERGE_SHAPE_COUNT; ++shape) {
+			size_t total = kmerge_fill(values, runs, counts[i],
+						   shape);
+			int errors = query_check(runs, counts[i], values,
+						 total);
+			if (errors != 0) {
+				unit_msg("%d runs, shape %d", counts[i],
+					 shape);
+			}
+			error_count += errors;
+		}
+	}
+	unit_check(error_count == 0, "top-k, select and percentiles match "
+		   "the full sort");
+	free(values);
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_quantum();
+	test_mutex();
+	test_cond();
+	test_wait_group();
+	test_chan();
+	test_timer_levels();
+	test_until_timeout();
+	test_until_race();
+	test_wait_forever();
+	test_writer_round_trip();
+	test_kmerge();
+	test_kmerge_split();
+	test_pmerge();
+	test_int_sort();
+	test_extsort();
+	test_parser_feed_max();
+	test_pipeline_chunks();
+	test_run_file_bounds();
+	test_file_ranges();
+	test_run_cache();
+	test_query();
+
+	unit_test_finish();
+	return 0;
+}
@@ -10,10 +10,20 @@ python3 generator.py -f test5.txt -c 10000 -m 10000
 python3 generator.py -f test6.txt -c 100000 -m 10000
 
 # Compile the solution
-gcc libcoro.c solution.c -o main
+gcc libcoro.c coro_sync.c coro_io.c int_reader.c int_writer.c int_sort.c kmerge.c pmerge.c extsort.c pipeline.c run_file.c run_cache.c query.c ../hw4/thread_pool.c solution.c -I../hw4 -o main -pthread
 
 # Run the solution
 ./main 100 3 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
 
 # Check the result
 python3 checker.py -f output.txt
+
+# A latency budget below the minimal quantum must not stall the run
+timeout 60 ./main 1 20 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+python3 checker.py -f output.txt
+
+# A file over 2 MB is split into ranges for the pool threads
+python3 generator.py -f test_big.txt -c 300000
+./main -T 4 100 3 test_big.txt test1.txt
+# Every number once, the same as sort -n gives
+cat test_big.txt <(echo) test1.txt | tr -s ' ' '\n' | sort -n | tr '\n' ' ' | cmp - <(tr -s ' \n' ' ' < output.txt) && echo "Split output is ok"